@@ -0,0 +1,708 @@
+#include "objects.h"
+#include "bvhtraversal.h"
+
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cstdint>
+#include <filesystem>
+#include <new>
+#include <shared_mutex>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+    constexpr char clusterMagic[8]{ 'C', 'Y', 'C', 'L', 'U', 'S', 'T', '\0' };
+    constexpr uint32_t clusterVersion{ 2 };
+
+    // Cluster data starts at multiples of this, so that each cluster can be mapped on its own
+    constexpr uint64_t clusterAlignment{ 4096 };
+
+    struct FileHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t nodeSize;
+        uint64_t contentHash;
+        uint32_t numClusters;
+        uint32_t numFaces;
+        uint64_t fileSize;
+        uint32_t numMaterials;   // of the OBJ file, only recorded since a clustered mesh has no per-face materials
+        uint32_t padding;
+    };
+
+    std::atomic<unsigned int> numPageIns{ 0 };
+    std::atomic<unsigned int> numEvictions{ 0 };
+    std::atomic<unsigned int> numDeferredRays{ 0 };
+
+    uint64_t alignCluster(uint64_t offset)
+    {
+        return (offset + clusterAlignment - 1) / clusterAlignment * clusterAlignment;
+    }
+
+    // Spreads the low 10 bits of v to every third bit
+    uint32_t expandBits(uint32_t v)
+    {
+        v &= 0x3ff;
+        v = (v | (v << 16)) & 0x30000ff;
+        v = (v | (v << 8)) & 0x300f00f;
+        v = (v | (v << 4)) & 0x30c30c3;
+        v = (v | (v << 2)) & 0x9249249;
+        return v;
+    }
+
+    uint32_t mortonCode(const Vec3f& p, const Box& box)
+    {
+        const Vec3f extent{ box.pmax - box.pmin };
+        const auto quantize = [](float f, float lo, float size)
+        {
+            const float u{ size > 0.0f ? (f - lo) / size : 0.0f };
+            return static_cast<uint32_t>(std::clamp(u, 0.0f, 1.0f) * 1023.0f);
+        };
+        return (expandBits(quantize(p.x, box.pmin.x, extent.x)) << 2)
+             | (expandBits(quantize(p.y, box.pmin.y, extent.y)) << 1)
+             |  expandBits(quantize(p.z, box.pmin.z, extent.z));
+    }
+
+    std::string getClusterPath(const char* meshFilename, const char* clusterDir)
+    {
+        const std::filesystem::path meshPath{ meshFilename };
+        std::filesystem::path clusterPath{ meshPath };
+        if (clusterDir != nullptr && clusterDir[0] != '\0')
+            clusterPath = std::filesystem::path{ clusterDir } / meshPath.filename();
+        clusterPath += ".clusters";
+        return clusterPath.string();
+    }
+}
+
+struct ClusteredMesh::ClusterInfo
+{
+    float bounds[6];
+    uint64_t offset;   // of the cluster data in the file, a multiple of clusterAlignment
+    uint64_t size;
+    uint32_t numVertices;
+    uint32_t numNormals;
+    uint32_t numTexVerts;
+    uint32_t numFaces;
+    uint32_t numNodes;
+    uint32_t numElements;
+
+    // The cluster data is the BVH nodes (with the unused node 0) and elements, then v, vn, vt, f, fn, and ft as in TriMesh
+    uint64_t ElementOffset() const { return (static_cast<uint64_t>(numNodes) + 1) * cy::BVH::GetNodeSize(); }
+    uint64_t VertexOffset() const { return ElementOffset() + static_cast<uint64_t>(numElements) * sizeof(unsigned int); }
+    uint64_t NormalOffset() const { return VertexOffset() + static_cast<uint64_t>(numVertices) * sizeof(Vec3f); }
+    uint64_t TexVertOffset() const { return NormalOffset() + static_cast<uint64_t>(numNormals) * sizeof(Vec3f); }
+    uint64_t FaceOffset() const { return TexVertOffset() + static_cast<uint64_t>(numTexVerts) * sizeof(Vec3f); }
+    uint64_t NormalFaceOffset() const { return FaceOffset() + static_cast<uint64_t>(numFaces) * sizeof(cy::TriMesh::TriFace); }
+    uint64_t TexFaceOffset() const { return NormalFaceOffset() + (numNormals > 0 ? static_cast<uint64_t>(numFaces) * sizeof(cy::TriMesh::TriFace) : 0); }
+    uint64_t DataSize() const { return TexFaceOffset() + (numTexVerts > 0 ? static_cast<uint64_t>(numFaces) * sizeof(cy::TriMesh::TriFace) : 0); }
+};
+
+struct ClusteredMesh::Cluster
+{
+    // Shared while rays use the cluster, exclusive while it is paged in or out
+    mutable std::shared_mutex lock;
+    std::atomic<bool> resident{ false };
+    std::atomic<uint64_t> lastUse{ 0 };
+
+    void* data{ nullptr };
+    BVHTriMesh bvh;   // over the mapped nodes and elements
+    const Vec3f* v{ nullptr };
+    const Vec3f* vn{ nullptr };
+    const Vec3f* vt{ nullptr };
+    const cy::TriMesh::TriFace* f{ nullptr };
+    const cy::TriMesh::TriFace* fn{ nullptr };
+    const cy::TriMesh::TriFace* ft{ nullptr };
+};
+
+ClusteredMesh::ClusteredMesh() = default;
+
+ClusteredMesh::~ClusteredMesh()
+{
+    for (unsigned int c{ 0 }; c < numClusters; ++c)
+    {
+        Cluster& cluster{ clusters[c] };
+        if (cluster.data == nullptr) continue;
+#ifdef _WIN32
+        ::operator delete[](cluster.data, std::align_val_t{ clusterAlignment });
+#else
+        munmap(cluster.data, clusterInfos[c].size);
+#endif
+    }
+#ifndef _WIN32
+    if (fileDescriptor >= 0) close(fileDescriptor);
+#endif
+}
+
+bool ClusteredMesh::Load(char const* filename, Options const& options)
+{
+    const auto start{ std::chrono::high_resolution_clock::now() };
+
+    const unsigned int clusterFaces{ std::clamp(options.clusterFaces, 1u, maxClusterFaces) };
+    const uint64_t contentHash{ BVHCache::HashFile(filename, BVHCache::HashCombine(BVHCache::HashCombine(clusterVersion, clusterFaces), CY_BVH_MAX_ELEMENT_COUNT)) };
+    if (contentHash == 0)
+    {
+        std::cout << "ERROR: Cannot open " << filename << "\n";
+        return false;
+    }
+
+    clusterFile = getClusterPath(filename, options.clusterDir);
+    residentBudget = options.residentBudget;
+
+    bool converted{ false };
+    if (!OpenClusterFile(contentHash))
+    {
+        if (!BuildClusterFile(filename, contentHash, clusterFaces) || !OpenClusterFile(contentHash))
+        {
+            std::cout << "ERROR: Cannot convert " << filename << " to " << clusterFile << "\n";
+            return false;
+        }
+        converted = true;
+    }
+
+    const auto end{ std::chrono::high_resolution_clock::now() };
+    const std::chrono::duration<float, std::milli> loadTime{ end - start };
+
+    unsigned int numFaces{ 0 };
+    uint64_t dataBytes{ 0 };
+    for (const ClusterInfo& info : clusterInfos)
+    {
+        numFaces += info.numFaces;
+        dataBytes += info.size;
+    }
+    std::cout << "Clusters " << filename << ": " << numFaces << " triangles in " << numClusters << " clusters ("
+              << dataBytes / (1 << 20) << " MB on disk, " << residentBudget / (1 << 20) << " MB resident budget), "
+              << (converted ? "converted" : "opened") << " in " << loadTime.count() << " ms\n";
+    return true;
+}
+
+bool ClusteredMesh::BuildClusterFile(char const* filename, uint64_t contentHash, unsigned int clusterFaces) const
+{
+    cy::TriMesh mesh;
+    if (!mesh.LoadFromFileObj(filename)) return false;
+    if (!mesh.HasNormals()) mesh.ComputeNormals();
+
+    const auto faceCenter = [&](unsigned int i)
+    {
+        const cy::TriMesh::TriFace& face{ mesh.F(i) };
+        return (mesh.V(face.v[0]) + mesh.V(face.v[1]) + mesh.V(face.v[2])) / 3.0f;
+    };
+
+    Box centerBox;
+    for (unsigned int i{ 0 }; i < mesh.NF(); ++i)
+        centerBox += faceCenter(i);
+
+    // Consecutive triangles in Morton order are close together, so they make compact clusters
+    std::vector<std::pair<uint32_t, unsigned int>> order(mesh.NF());
+    for (unsigned int i{ 0 }; i < mesh.NF(); ++i)
+        order[i] = { mortonCode(faceCenter(i), centerBox), i };
+    std::sort(order.begin(), order.end());
+
+    // The cluster index has to fit in the bits of RayHit::primID above the face index, so a large mesh gets larger clusters
+    const unsigned int minClusterFaces{ static_cast<unsigned int>((uint64_t{ mesh.NF() } + maxClusters - 1) / maxClusters) };
+    if (clusterFaces < minClusterFaces)
+    {
+        std::cout << "WARNING: " << filename << " needs more than " << maxClusters << " clusters of " << clusterFaces
+                  << " triangles, using " << minClusterFaces << " triangles per cluster\n";
+        clusterFaces = minClusterFaces;
+    }
+    const unsigned int count{ static_cast<unsigned int>((uint64_t{ mesh.NF() } + clusterFaces - 1) / clusterFaces) };
+    std::vector<ClusterInfo> infos(count);
+
+    FileHeader header{};
+    std::memcpy(header.magic, clusterMagic, sizeof(clusterMagic));
+    header.version = clusterVersion;
+    header.nodeSize = static_cast<uint32_t>(cy::BVH::GetNodeSize());
+    header.contentHash = contentHash;
+    header.numClusters = count;
+    header.numFaces = mesh.NF();
+    header.numMaterials = mesh.NM();
+
+    // Write to a temporary file first, so that a concurrent load never sees a partial file
+    std::error_code error;
+    const std::filesystem::path directory{ std::filesystem::path{ clusterFile }.parent_path() };
+    if (!directory.empty()) std::filesystem::create_directories(directory, error);
+
+    const std::string tempPath{ clusterFile + ".tmp" };
+    {
+        std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+        if (!file) return false;
+
+        // The header and the cluster table are written again once the table is filled in
+        uint64_t offset{ alignCluster(sizeof(FileHeader) + count * sizeof(ClusterInfo)) };
+
+        // Maps the mesh vertex indices to the cluster ones, and lists the used ones in cluster order
+        std::vector<unsigned int> vertexMap(mesh.NV(), ~0u), normalMap(mesh.NVN(), ~0u), texVertMap(mesh.NVT(), ~0u);
+        std::vector<unsigned int> vertices, normals, texVerts;
+        const auto remap = [](const cy::TriMesh::TriFace& face, std::vector<unsigned int>& map, std::vector<unsigned int>& used)
+        {
+            cy::TriMesh::TriFace localFace;
+            for (int j{ 0 }; j < 3; ++j)
+            {
+                unsigned int& index{ map[face.v[j]] };
+                if (index == ~0u)
+                {
+                    index = static_cast<unsigned int>(used.size());
+                    used.push_back(face.v[j]);
+                }
+                localFace.v[j] = index;
+            }
+            return localFace;
+        };
+
+        for (unsigned int c{ 0 }; c < count; ++c)
+        {
+            const unsigned int first{ c * clusterFaces };
+            const unsigned int numFaces{ std::min(clusterFaces, mesh.NF() - first) };
+
+            std::vector<cy::TriMesh::TriFace> faces(numFaces), normalFaces, texFaces;
+            if (mesh.HasNormals()) normalFaces.resize(numFaces);
+            if (mesh.HasTextureVertices()) texFaces.resize(numFaces);
+            for (unsigned int i{ 0 }; i < numFaces; ++i)
+            {
+                const unsigned int face{ order[first + i].second };
+                faces[i] = remap(mesh.F(face), vertexMap, vertices);
+                if (mesh.HasNormals()) normalFaces[i] = remap(mesh.FN(face), normalMap, normals);
+                if (mesh.HasTextureVertices()) texFaces[i] = remap(mesh.FT(face), texVertMap, texVerts);
+            }
+
+            cy::TriMesh clusterMesh;
+            clusterMesh.SetNumVertex(static_cast<unsigned int>(vertices.size()));
+            clusterMesh.SetNumFaces(numFaces);
+            for (size_t i{ 0 }; i < vertices.size(); ++i)
+                clusterMesh.V(static_cast<unsigned int>(i)) = mesh.V(vertices[i]);
+            for (unsigned int i{ 0 }; i < numFaces; ++i)
+                clusterMesh.F(i) = faces[i];
+
+            BVHTriMesh clusterBVH;
+            clusterBVH.SetMesh(&clusterMesh, CY_BVH_MAX_ELEMENT_COUNT);
+
+            ClusterInfo& info{ infos[c] };
+            std::memcpy(info.bounds, clusterBVH.GetNodeBounds(clusterBVH.GetRootNodeID()), sizeof(info.bounds));
+            info.offset = offset;
+            info.numVertices = static_cast<uint32_t>(vertices.size());
+            info.numNormals = static_cast<uint32_t>(normals.size());
+            info.numTexVerts = static_cast<uint32_t>(texVerts.size());
+            info.numFaces = numFaces;
+            info.numNodes = clusterBVH.GetNumNodes();
+            info.numElements = clusterBVH.GetNumElements();
+            info.size = info.DataSize();
+
+            const auto writeVertices = [&](const std::vector<unsigned int>& used, const Vec3f* meshVertices)
+            {
+                for (unsigned int index : used)
+                    file.write(reinterpret_cast<const char*>(&meshVertices[index]), sizeof(Vec3f));
+            };
+            const auto writeFaces = [&](const std::vector<cy::TriMesh::TriFace>& clusterFaces)
+            {
+                file.write(reinterpret_cast<const char*>(clusterFaces.data()), static_cast<std::streamsize>(clusterFaces.size() * sizeof(cy::TriMesh::TriFace)));
+            };
+
+            file.seekp(static_cast<std::streamoff>(offset));
+            file.write(static_cast<const char*>(clusterBVH.GetNodeData()), static_cast<std::streamsize>(info.ElementOffset()));
+            file.write(reinterpret_cast<const char*>(clusterBVH.GetElementData()), static_cast<std::streamsize>(info.numElements * sizeof(unsigned int)));
+            writeVertices(vertices, &mesh.V(0));
+            if (!normals.empty()) writeVertices(normals, &mesh.VN(0));
+            if (!texVerts.empty()) writeVertices(texVerts, &mesh.VT(0));
+            writeFaces(faces);
+            writeFaces(normalFaces);
+            writeFaces(texFaces);
+            offset = alignCluster(offset + info.size);
+
+            for (unsigned int index : vertices) vertexMap[index] = ~0u;
+            for (unsigned int index : normals) normalMap[index] = ~0u;
+            for (unsigned int index : texVerts) texVertMap[index] = ~0u;
+            vertices.clear();
+            normals.clear();
+            texVerts.clear();
+        }
+
+        // The file ends with a full page, so that the last cluster can be mapped without reading past the end
+        header.fileSize = offset;
+        if (offset > 0)
+        {
+            file.seekp(static_cast<std::streamoff>(offset - 1));
+            file.put('\0');
+        }
+        file.seekp(0);
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(infos.data()), static_cast<std::streamsize>(count * sizeof(ClusterInfo)));
+        if (!file) return false;
+    }
+
+    std::filesystem::rename(tempPath, clusterFile, error);
+    if (error)
+    {
+        std::filesystem::remove(tempPath, error);
+        return false;
+    }
+    return true;
+}
+
+bool ClusteredMesh::OpenClusterFile(uint64_t contentHash)
+{
+    std::ifstream file(clusterFile, std::ios::binary | std::ios::ate);
+    if (!file) return false;
+    const uint64_t fileSize{ static_cast<uint64_t>(file.tellg()) };
+    file.seekg(0);
+
+    FileHeader header;
+    if (!file.read(reinterpret_cast<char*>(&header), sizeof(header))) return false;
+    const bool valid{ std::memcmp(header.magic, clusterMagic, sizeof(clusterMagic)) == 0
+        && header.version == clusterVersion
+        && header.nodeSize == cy::BVH::GetNodeSize()
+        && header.contentHash == contentHash
+        && header.fileSize == fileSize
+        && header.numClusters > 0
+        && header.numClusters <= maxClusters };
+    if (!valid) return false;
+
+    std::vector<ClusterInfo> infos(header.numClusters);
+    if (!file.read(reinterpret_cast<char*>(infos.data()), static_cast<std::streamsize>(infos.size() * sizeof(ClusterInfo)))) return false;
+    for (const ClusterInfo& info : infos)
+    {
+        if (info.offset % clusterAlignment != 0 || info.size != info.DataSize() || info.offset + info.size > fileSize || info.numFaces > maxClusterFaces)
+            return false;
+    }
+
+#ifndef _WIN32
+    fileDescriptor = open(clusterFile.c_str(), O_RDONLY);
+    if (fileDescriptor < 0) return false;
+#endif
+
+    clusterInfos = std::move(infos);
+    numClusters = header.numClusters;
+    numMaterials = header.numMaterials;
+    clusters = std::make_unique<Cluster[]>(numClusters);
+
+    boundBox.Init();
+    for (const ClusterInfo& info : clusterInfos)
+        boundBox += Box{ info.bounds };
+    bvh.Build(clusterInfos);
+    return true;
+}
+
+void ClusteredMesh::ClusterBVH::Build(std::vector<ClusterInfo> const& c)
+{
+    clusterInfos = &c;
+    Clear();
+    cy::BVH::Build(static_cast<unsigned int>(c.size()), 1);
+}
+
+void ClusteredMesh::ClusterBVH::GetElementBounds(unsigned int i, float box[6]) const
+{
+    std::memcpy(box, (*clusterInfos)[i].bounds, 6 * sizeof(float));
+}
+
+Box ClusteredMesh::GetClusterBox(unsigned int cluster) const
+{
+    return Box{ clusterInfos[cluster].bounds };
+}
+
+void ClusteredMesh::PageIn(unsigned int c) const
+{
+    Cluster& cluster{ clusters[c] };
+    {
+        std::unique_lock lock{ cluster.lock };
+        if (!cluster.resident)
+        {
+            const ClusterInfo& info{ clusterInfos[c] };
+#ifdef _WIN32
+            void* data{ ::operator new[](info.size, std::align_val_t{ clusterAlignment }) };
+            std::ifstream file(clusterFile, std::ios::binary);
+            file.seekg(static_cast<std::streamoff>(info.offset));
+            if (!file.read(static_cast<char*>(data), static_cast<std::streamsize>(info.size)))
+            {
+                ::operator delete[](data, std::align_val_t{ clusterAlignment });
+                data = nullptr;
+            }
+#else
+            int flags{ MAP_PRIVATE };
+#ifdef MAP_POPULATE
+            flags |= MAP_POPULATE;   // the rays waiting for the cluster are about to touch most of it
+#endif
+            void* data{ mmap(nullptr, info.size, PROT_READ, flags, fileDescriptor, static_cast<off_t>(info.offset)) };
+            if (data == MAP_FAILED) data = nullptr;
+#endif
+            // A cluster that cannot be read stays resident without any triangles, instead of stalling the rays that reach it
+            if (data == nullptr)
+                std::cout << "ERROR: Cannot read cluster " << c << " of " << clusterFile << "\n";
+            else
+            {
+                const char* const bytes{ static_cast<const char*>(data) };
+                cluster.bvh.SetExternalData(bytes, info.numNodes, reinterpret_cast<const unsigned int*>(bytes + info.ElementOffset()), info.numElements);
+                cluster.v = reinterpret_cast<const Vec3f*>(bytes + info.VertexOffset());
+                cluster.vn = info.numNormals > 0 ? reinterpret_cast<const Vec3f*>(bytes + info.NormalOffset()) : nullptr;
+                cluster.vt = info.numTexVerts > 0 ? reinterpret_cast<const Vec3f*>(bytes + info.TexVertOffset()) : nullptr;
+                cluster.f = reinterpret_cast<const cy::TriMesh::TriFace*>(bytes + info.FaceOffset());
+                cluster.fn = info.numNormals > 0 ? reinterpret_cast<const cy::TriMesh::TriFace*>(bytes + info.NormalFaceOffset()) : nullptr;
+                cluster.ft = info.numTexVerts > 0 ? reinterpret_cast<const cy::TriMesh::TriFace*>(bytes + info.TexFaceOffset()) : nullptr;
+                cluster.data = data;
+                residentBytes += info.size;
+            }
+            cluster.resident = true;
+            ++numPageIns;
+        }
+        cluster.lastUse = ++useClock;
+    }
+
+    if (residentBytes > residentBudget) EvictOverBudget();
+}
+
+void ClusteredMesh::EvictOverBudget() const
+{
+    // Another thread that is already evicting does the work for this one too
+    std::unique_lock evictLock{ evictMutex, std::try_to_lock };
+    if (!evictLock.owns_lock()) return;
+
+    std::vector<std::pair<uint64_t, unsigned int>> candidates;
+    for (unsigned int c{ 0 }; c < numClusters; ++c)
+    {
+        if (clusters[c].resident) candidates.push_back({ clusters[c].lastUse, c });
+    }
+    std::sort(candidates.begin(), candidates.end());
+
+    // Clusters used since the last page-in are kept, so a budget smaller than the working set of a batch overshoots
+    // instead of paging the same clusters in and out, and clusters that rays are using are skipped
+    const uint64_t now{ useClock };
+    for (const auto& [lastUse, c] : candidates)
+    {
+        if (residentBytes <= residentBudget || lastUse >= now) break;
+
+        Cluster& cluster{ clusters[c] };
+        std::unique_lock lock{ cluster.lock, std::try_to_lock };
+        if (!lock.owns_lock() || !cluster.resident || cluster.data == nullptr || cluster.lastUse >= now) continue;
+
+#ifdef _WIN32
+        ::operator delete[](cluster.data, std::align_val_t{ clusterAlignment });
+#else
+        munmap(cluster.data, clusterInfos[c].size);
+#endif
+        cluster.data = nullptr;
+        cluster.bvh.Clear();
+        cluster.resident = false;
+        residentBytes -= clusterInfos[c].size;
+        ++numEvictions;
+    }
+}
+
+void ClusteredMesh::PinCluster(unsigned int c) const
+{
+    Cluster& cluster{ clusters[c] };
+    while (true)
+    {
+        cluster.lock.lock_shared();
+        if (cluster.resident)
+        {
+            // Stamping only when the clock moved keeps the cache line shared between the threads using the cluster
+            const uint64_t now{ useClock.load(std::memory_order_relaxed) };
+            if (cluster.lastUse.load(std::memory_order_relaxed) != now) cluster.lastUse.store(now, std::memory_order_relaxed);
+            return;
+        }
+        cluster.lock.unlock_shared();
+        PageIn(c);
+    }
+}
+
+void ClusteredMesh::UnpinCluster(unsigned int c) const
+{
+    clusters[c].lock.unlock_shared();
+}
+
+bool ClusteredMesh::ReachesCluster(unsigned int c, Ray const& ray, float t_max) const
+{
+    float tNear;
+    return IntersectRayBVHNode(TraversalRay{ ray }, t_max, clusterInfos[c].bounds, tNear);
+}
+
+bool ClusteredMesh::IntersectCluster(unsigned int c, Ray const& localRay, RayHit& rayHit, int hitSide) const
+{
+    const Cluster& cluster{ clusters[c] };
+    const TraversalRay ray{ localRay };
+    TriangleHit closest{};
+    closest.t = rayHit.z;
+    bool hit{ false };
+
+    TraverseBVH<false>(cluster.bvh, ray, closest.t, [&](unsigned int leafID)
+    {
+        const unsigned int* elements{ cluster.bvh.GetNodeElements(leafID) };
+        for (unsigned int i{ 0 }; i < cluster.bvh.GetNodeElementCount(leafID); ++i)
+        {
+            const cy::TriMesh::TriFace& face{ cluster.f[elements[i]] };
+            if (!IntersectTriangle(localRay, cluster.v[face.v[0]], cluster.v[face.v[1]], cluster.v[face.v[2]], hitSide, closest.t, closest))
+                continue;
+
+            closest.faceID = elements[i];
+            hit = true;
+        }
+        return false;
+    });
+
+    // A hit at exactly rayHit.z is not closer
+    if (!hit || closest.t >= rayHit.z) return false;
+
+    rayHit.z = closest.t;
+    rayHit.primID = (c << clusterFaceBits) | closest.faceID;
+    rayHit.u = closest.u;
+    rayHit.v = closest.v;
+    rayHit.front = closest.det > 0.0f;
+    rayHit.lod = 0;
+    return true;
+}
+
+bool ClusteredMesh::IntersectClusterShadow(unsigned int c, Ray const& localRay, float t_max) const
+{
+    const Cluster& cluster{ clusters[c] };
+    const TraversalRay ray{ localRay };
+    return TraverseBVH<true>(cluster.bvh, ray, t_max, [&](unsigned int leafID)
+    {
+        const unsigned int* elements{ cluster.bvh.GetNodeElements(leafID) };
+        for (unsigned int i{ 0 }; i < cluster.bvh.GetNodeElementCount(leafID); ++i)
+        {
+            const cy::TriMesh::TriFace& face{ cluster.f[elements[i]] };
+            TriangleHit triangleHit;
+            if (IntersectTriangle(localRay, cluster.v[face.v[0]], cluster.v[face.v[1]], cluster.v[face.v[2]], HIT_FRONT_AND_BACK, t_max, triangleHit))
+                return true;
+        }
+        return false;
+    });
+}
+
+template <bool anyHit, typename ClusterFunc>
+bool ClusteredMesh::TraverseClusters(Ray const& localRay, float& tMax, ClusterFunc&& intersectCluster) const
+{
+    // The cluster BVH has one cluster per leaf, so a leaf box is the bounds of its cluster
+    return TraverseBVH<anyHit>(bvh, TraversalRay{ localRay }, tMax, [&](unsigned int leafID)
+    {
+        return intersectCluster(bvh.GetNodeElements(leafID)[0]);
+    });
+}
+
+bool ClusteredMesh::IntersectRayHit(Ray const& ray, RayHit& hit, int hitSide) const
+{
+    bool found{ false };
+    TraverseClusters<false>(ray, hit.z, [&](unsigned int c)
+    {
+        PinCluster(c);
+        found |= IntersectCluster(c, ray, hit, hitSide);
+        UnpinCluster(c);
+        return false;
+    });
+    return found;
+}
+
+bool ClusteredMesh::IntersectShadowRay(Ray const& ray, float t_max) const
+{
+    return TraverseClusters<true>(ray, t_max, [&](unsigned int c)
+    {
+        PinCluster(c);
+        const bool occluded{ IntersectClusterShadow(c, ray, t_max) };
+        UnpinCluster(c);
+        return occluded;
+    });
+}
+
+bool ClusteredMesh::IntersectResident(Ray const& ray, RayHit& hit, int hitSide, std::vector<unsigned int>& deferred) const
+{
+    bool found{ false };
+    TraverseClusters<false>(ray, hit.z, [&](unsigned int c)
+    {
+        // try_lock_shared only fails while the cluster is being paged in or out
+        Cluster& cluster{ clusters[c] };
+        if (!cluster.lock.try_lock_shared())
+        {
+            deferred.push_back(c);
+            return false;
+        }
+        if (!cluster.resident)
+        {
+            cluster.lock.unlock_shared();
+            deferred.push_back(c);
+            return false;
+        }
+        const uint64_t now{ useClock.load(std::memory_order_relaxed) };
+        if (cluster.lastUse.load(std::memory_order_relaxed) != now) cluster.lastUse.store(now, std::memory_order_relaxed);
+        found |= IntersectCluster(c, ray, hit, hitSide);
+        cluster.lock.unlock_shared();
+        return false;
+    });
+    return found;
+}
+
+bool ClusteredMesh::IntersectResidentShadow(Ray const& ray, float t_max, std::vector<unsigned int>& deferred) const
+{
+    return TraverseClusters<true>(ray, t_max, [&](unsigned int c)
+    {
+        Cluster& cluster{ clusters[c] };
+        if (!cluster.lock.try_lock_shared())
+        {
+            deferred.push_back(c);
+            return false;
+        }
+        if (!cluster.resident)
+        {
+            cluster.lock.unlock_shared();
+            deferred.push_back(c);
+            return false;
+        }
+        const uint64_t now{ useClock.load(std::memory_order_relaxed) };
+        if (cluster.lastUse.load(std::memory_order_relaxed) != now) cluster.lastUse.store(now, std::memory_order_relaxed);
+        const bool occluded{ IntersectClusterShadow(c, ray, t_max) };
+        cluster.lock.unlock_shared();
+        return occluded;
+    });
+}
+
+void ClusteredMesh::SetHitInfo(Ray const& ray, RayHit const& hit, HitInfo& hitInfo) const
+{
+    const unsigned int c{ hit.primID >> clusterFaceBits };
+    const unsigned int face{ hit.primID & (maxClusterFaces - 1) };
+    const float w{ 1.0f - hit.u - hit.v };
+
+    hitInfo.z = hit.z;
+    hitInfo.p = ray.p + ray.dir * hit.z;
+    hitInfo.front = hit.front;
+
+    PinCluster(c);
+    const Cluster& cluster{ clusters[c] };
+    if (cluster.data == nullptr)
+    {
+        hitInfo.N = -ray.dir.GetNormalized();
+        hitInfo.uvw = Vec3f{ 0.0f, 0.0f, 0.0f };
+    }
+    else
+    {
+        if (cluster.vn != nullptr)
+        {
+            const cy::TriMesh::TriFace& normalFace{ cluster.fn[face] };
+            hitInfo.N = (w * cluster.vn[normalFace.v[0]] + hit.u * cluster.vn[normalFace.v[1]] + hit.v * cluster.vn[normalFace.v[2]]).GetNormalized();
+        }
+        else
+        {
+            const cy::TriMesh::TriFace& vertFace{ cluster.f[face] };
+            const Vec3f& v0{ cluster.v[vertFace.v[0]] };
+            hitInfo.N = ((cluster.v[vertFace.v[1]] - v0) ^ (cluster.v[vertFace.v[2]] - v0)).GetNormalized();
+        }
+        if (cluster.vt != nullptr)
+        {
+            const cy::TriMesh::TriFace& texFace{ cluster.ft[face] };
+            hitInfo.uvw = w * cluster.vt[texFace.v[0]] + hit.u * cluster.vt[texFace.v[1]] + hit.v * cluster.vt[texFace.v[2]];
+        }
+        else
+            hitInfo.uvw = Vec3f{ w, hit.u, hit.v };
+    }
+    UnpinCluster(c);
+}
+
+unsigned int ClusteredMesh::NumPageIns() { return numPageIns; }
+unsigned int ClusteredMesh::NumEvictions() { return numEvictions; }
+unsigned int ClusteredMesh::NumDeferredRays() { return numDeferredRays; }
+void ClusteredMesh::AddDeferredRays(unsigned int count) { numDeferredRays += count; }
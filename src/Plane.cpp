@@ -4,23 +4,30 @@
 #include <cmath>
 #include <algorithm>
 
-bool Plane::IntersectRay(const Ray& localRay, HitInfo& hitInfo, int hitSide) const
+bool Plane::IntersectRayHit(const Ray& localRay, RayHit& hit, int hitSide) const
 {
     if (abs(localRay.dir.z) < 1e-6f) return false;
 
     const float t{ -localRay.p.z / localRay.dir.z };
-    if (t < 0.0f) return false;
+    if (t < 0.0f || t >= hit.z) return false;
 
     const Vec3f pos{ localRay.p + localRay.dir * t };
     if (abs(pos.x) > 1.0f || abs(pos.y) > 1.0f) return false;
 
-    hitInfo.z = t;
+    hit.z = t;
+    hit.front = localRay.dir.z < 0.0f;
+    return true;
+}
+
+void Plane::SetHitInfo(const Ray& localRay, const RayHit& hit, HitInfo& hitInfo) const
+{
+    const Vec3f pos{ localRay.p + localRay.dir * hit.z };
+    hitInfo.z = hit.z;
     hitInfo.p = pos;
     hitInfo.N = Vec3f{ 0.0f, 0.0f, 1.0f };
-    hitInfo.front = localRay.dir.z < 0.0f;
+    hitInfo.front = hit.front;
     hitInfo.uvw = Vec3f{ (0.5f * pos) + Vec3f{ 1.0f, 1.0f, 1.0f } };
-    return true;
-} 
+}
 
 bool Plane::IntersectShadowRay( Ray const &localRay, float t_max ) const
 {
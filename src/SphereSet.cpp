@@ -0,0 +1,266 @@
+#include "objects.h"
+#include "bvhtraversal.h"
+#include "simdfloat.h"
+
+#include <iostream>
+#include <fstream>
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <limits>
+#include <vector>
+
+namespace
+{
+    constexpr char particleMagic[4]{ 'S', 'P', 'H', 'S' };
+
+    struct Particle
+    {
+        float x, y, z, radius;
+    };
+
+    // Spreads the low 10 bits of v to every third bit
+    uint32_t expandBits(uint32_t v)
+    {
+        v &= 0x3ff;
+        v = (v | (v << 16)) & 0x30000ff;
+        v = (v | (v << 8)) & 0x300f00f;
+        v = (v | (v << 4)) & 0x30c30c3;
+        v = (v | (v << 2)) & 0x9249249;
+        return v;
+    }
+
+    uint32_t mortonCode(const Particle& particle, const Box& box)
+    {
+        const Vec3f extent{ box.pmax - box.pmin };
+        const auto quantize = [](float f, float lo, float size)
+        {
+            const float u{ size > 0.0f ? (f - lo) / size : 0.0f };
+            return static_cast<uint32_t>(std::clamp(u, 0.0f, 1.0f) * 1023.0f);
+        };
+        return (expandBits(quantize(particle.x, box.pmin.x, extent.x)) << 2)
+             | (expandBits(quantize(particle.y, box.pmin.y, extent.y)) << 1)
+             |  expandBits(quantize(particle.z, box.pmin.z, extent.z));
+    }
+}
+
+bool SphereSet::Load(char const* filename)
+{
+    std::ifstream file(filename, std::ios::binary);
+    if (!file) return false;
+
+    char magic[4];
+    uint32_t count{ 0 };
+    if (!file.read(magic, sizeof(magic)) || std::memcmp(magic, particleMagic, sizeof(magic)) != 0 || !file.read(reinterpret_cast<char*>(&count), sizeof(count)))
+    {
+        std::cout << "ERROR: " << filename << " is not a particle file\n";
+        return false;
+    }
+
+    std::vector<Particle> particles(count);
+    if (!file.read(reinterpret_cast<char*>(particles.data()), static_cast<std::streamsize>(count * sizeof(Particle))))
+    {
+        std::cout << "ERROR: " << filename << " has fewer than " << count << " spheres\n";
+        return false;
+    }
+
+    const auto start{ std::chrono::high_resolution_clock::now() };
+
+    boundBox.Init();
+    Box centerBox;
+    for (const Particle& particle : particles)
+    {
+        const Vec3f center{ particle.x, particle.y, particle.z };
+        boundBox += center - particle.radius;
+        boundBox += center + particle.radius;
+        centerBox += center;
+    }
+
+    // Consecutive spheres in Morton order are close together, so they make compact blocks
+    std::vector<std::pair<uint32_t, unsigned int>> order(count);
+    for (unsigned int i{ 0 }; i < count; ++i)
+        order[i] = { mortonCode(particles[i], centerBox), i };
+    std::sort(order.begin(), order.end());
+
+    numSpheres = count;
+    blocks.assign((count + blockWidth - 1) / blockWidth, Block{});
+    for (size_t b{ 0 }; b < blocks.size(); ++b)
+    {
+        for (int lane{ 0 }; lane < blockWidth; ++lane)
+        {
+            const size_t i{ b * blockWidth + lane };
+            if (i >= count)
+            {
+                for (int axis{ 0 }; axis < 3; ++axis)
+                    blocks[b].center[axis][lane] = std::numeric_limits<float>::quiet_NaN();
+                blocks[b].radius[lane] = 0.0f;
+                continue;
+            }
+
+            const Particle& particle{ particles[order[i].second] };
+            blocks[b].center[0][lane] = particle.x;
+            blocks[b].center[1][lane] = particle.y;
+            blocks[b].center[2][lane] = particle.z;
+            blocks[b].radius[lane] = particle.radius;
+        }
+    }
+
+    bvh.Build(blocks);
+    const auto end{ std::chrono::high_resolution_clock::now() };
+
+    const std::chrono::duration<float, std::milli> buildTime{ end - start };
+    std::cout << "Spheres " << filename << ": " << count << " spheres, " << blocks.size() << " blocks, " << bvh.GetNumNodes() << " nodes ("
+              << MemoryBytes() / 1024 << " KB, " << (count > 0 ? static_cast<float>(MemoryBytes()) / count : 0.0f) << " bytes per sphere), built in "
+              << buildTime.count() << " ms\n";
+    return true;
+}
+
+size_t SphereSet::MemoryBytes() const
+{
+    return blocks.size() * sizeof(Block) + (bvh.GetNumNodes() + 1) * cy::BVH::GetNodeSize() + bvh.GetNumElements() * sizeof(unsigned int);
+}
+
+void SphereSet::BlockBVH::GetElementBounds(unsigned int i, float box[6]) const
+{
+    const Block& block{ (*blocks)[i] };
+    for (int axis{ 0 }; axis < 3; ++axis)
+    {
+        box[axis] = BIGFLOAT;
+        box[axis + 3] = -BIGFLOAT;
+    }
+    for (int lane{ 0 }; lane < blockWidth; ++lane)
+    {
+        if (std::isnan(block.center[0][lane])) continue;
+        for (int axis{ 0 }; axis < 3; ++axis)
+        {
+            box[axis] = std::min(box[axis], block.center[axis][lane] - block.radius[lane]);
+            box[axis + 3] = std::max(box[axis + 3], block.center[axis][lane] + block.radius[lane]);
+        }
+    }
+}
+
+int SphereSet::IntersectBlock(const Block& block, const TraversalRay& ray, int hitSide, float tMax, float* tOut, float* frontOut) const
+{
+    using F = SimdFloat<simdWidth>;
+
+    const float a{ ray.dir.Dot(ray.dir) };
+    const F dx{ F::Set(ray.dir.x) }, dy{ F::Set(ray.dir.y) }, dz{ F::Set(ray.dir.z) };
+    const F px{ F::Set(ray.p.x) }, py{ F::Set(ray.p.y) }, pz{ F::Set(ray.p.z) };
+    const F zero{ F::Set(0.0f) };
+    const F invA{ F::Set(1.0f / a) };
+    const F maxT{ F::Set(tMax) };
+
+    int hitMask{ 0 };
+    for (int first{ 0 }; first < blockWidth; first += simdWidth)
+    {
+        // |p + t dir - center|^2 = radius^2 with b = dir.(center - p) is a t^2 - 2 b t + c = 0
+        const F ocx{ F::Load(block.center[0] + first) - px };
+        const F ocy{ F::Load(block.center[1] + first) - py };
+        const F ocz{ F::Load(block.center[2] + first) - pz };
+        const F radius{ F::Load(block.radius + first) };
+
+        const F b{ ocx * dx + ocy * dy + ocz * dz };
+        const F c{ ocx * ocx + ocy * ocy + ocz * ocz - radius * radius };
+        const F discriminant{ b * b - F::Set(a) * c };
+        F mask{ discriminant >= zero };
+        if (mask.Mask() == 0) continue;
+
+        const F root{ Sqrt(Max(discriminant, zero)) };
+        const F t1{ (b - root) * invA };
+        const F t2{ (b + root) * invA };
+
+        // The near intersection is on the front, and the far one on the back when the ray starts inside
+        const F frontHit{ t1 > zero };
+        const F backHit{ (t1 <= zero) & (t2 > zero) };
+        if (hitSide == HIT_FRONT)
+            mask = mask & frontHit;
+        else if (hitSide == HIT_BACK)
+            mask = mask & backHit;
+        else
+            mask = mask & (frontHit | backHit);
+
+        const F t{ Select(frontHit, t1, t2) };
+        mask = mask & (t <= maxT);
+
+        const int laneMask{ mask.Mask() };
+        if (laneMask == 0) continue;
+
+        t.Store(tOut + first);
+        (frontHit & F::Set(1.0f)).Store(frontOut + first);
+        hitMask |= laneMask << first;
+    }
+    return hitMask;
+}
+
+bool SphereSet::IntersectRayHit(const Ray& localRay, RayHit& hit, int hitSide) const
+{
+    const TraversalRay ray{ localRay };
+    float closestT{ hit.z };
+    unsigned int closestBlock{ 0 };
+    int closestLane{ -1 };
+    bool closestFront{ true };
+
+    TraverseBVH<false>(bvh, ray, closestT, [&](unsigned int leafID)
+    {
+        const unsigned int* elements{ bvh.GetNodeElements(leafID) };
+        for (unsigned int i{ 0 }; i < bvh.GetNodeElementCount(leafID); ++i)
+        {
+            alignas(32) float t[blockWidth], front[blockWidth];
+            int mask{ IntersectBlock(blocks[elements[i]], ray, hitSide, closestT, t, front) };
+            for (; mask != 0; mask &= mask - 1)
+            {
+                const int lane{ std::countr_zero(static_cast<unsigned int>(mask)) };
+                if (t[lane] >= closestT) continue;
+
+                closestT = t[lane];
+                closestBlock = elements[i];
+                closestLane = lane;
+                closestFront = front[lane] != 0.0f;
+            }
+        }
+        return false;
+    });
+
+    if (closestLane < 0) return false;
+
+    hit.z = closestT;
+    hit.primID = closestBlock * blockWidth + closestLane;
+    hit.front = closestFront;
+    return true;
+}
+
+void SphereSet::SetHitInfo(const Ray& localRay, const RayHit& hit, HitInfo& hitInfo) const
+{
+    const Block& block{ blocks[hit.primID / blockWidth] };
+    const unsigned int lane{ hit.primID % blockWidth };
+    const Vec3f center{ block.center[0][lane], block.center[1][lane], block.center[2][lane] };
+
+    hitInfo.z = hit.z;
+    hitInfo.p = localRay.p + localRay.dir * hit.z;
+    hitInfo.N = (hitInfo.p - center) / block.radius[lane];
+    hitInfo.front = hit.front;
+
+    // The same spherical coordinates as Sphere
+    const float u{ (1.0f / (2.0f * static_cast<float>(M_PI))) * std::atan2(hitInfo.N.y, hitInfo.N.x) + 0.5f };
+    const float v{ (1.0f / static_cast<float>(M_PI)) * std::asin(std::clamp(hitInfo.N.z, -1.0f, 1.0f)) + 0.5f };
+    hitInfo.uvw = Vec3f{ u, v, 1.0f };
+}
+
+bool SphereSet::IntersectShadowRay(Ray const& localRay, float t_max) const
+{
+    const TraversalRay ray{ localRay };
+    return TraverseBVH<true>(bvh, ray, t_max, [&](unsigned int leafID)
+    {
+        const unsigned int* elements{ bvh.GetNodeElements(leafID) };
+        for (unsigned int i{ 0 }; i < bvh.GetNodeElementCount(leafID); ++i)
+        {
+            alignas(32) float t[blockWidth], front[blockWidth];
+            if (IntersectBlock(blocks[elements[i]], ray, HIT_FRONT_AND_BACK, t_max, t, front) != 0)
+                return true;
+        }
+        return false;
+    });
+}
@@ -3,281 +3,768 @@
 #include <iostream>
 #include <cmath>
 #include <algorithm>
-#include <stack>
-#include <utility>
+#include <bit>
+#include <chrono>
+#include <string>
+#include <atomic>
+#include <mutex>
+#include <array>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+namespace
+{
+    std::atomic<unsigned int> numDeferredBVHs{ 0 };
+    std::atomic<unsigned int> numLazyBuiltBVHs{ 0 };
+
+    void setRayHit(const TriangleHit& triangleHit, RayHit& rayHit)
+    {
+        rayHit.z = triangleHit.t;
+        rayHit.primID = triangleHit.faceID;
+        rayHit.u = triangleHit.u;
+        rayHit.v = triangleHit.v;
+        rayHit.front = triangleHit.det > 0.0f;
+        rayHit.lod = 0;
+    }
+
+    // Closest-hit rays per second of a mesh, in millions, for random rays from around box toward points inside it
+    float measureRayRate(const TriObj& mesh, const Box& box)
+    {
+        constexpr int numRays{ 1 << 14 };
+        std::mt19937 generator{ 1 };
+        std::uniform_real_distribution<float> uniform{ 0.0f, 1.0f };
+        const Vec3f center{ 0.5f * (box.pmin + box.pmax) };
+        const float radius{ (box.pmax - box.pmin).Length() };
+
+        std::vector<Ray> rays(numRays);
+        for (Ray& ray : rays)
+        {
+            const float z{ 2.0f * uniform(generator) - 1.0f };
+            const float phi{ 2.0f * static_cast<float>(M_PI) * uniform(generator) };
+            const float r{ std::sqrt(std::max(0.0f, 1.0f - z * z)) };
+            const Vec3f target{ box.pmin + (box.pmax - box.pmin) * Vec3f{ uniform(generator), uniform(generator), uniform(generator) } };
+            ray.p = center + Vec3f{ r * std::cos(phi), r * std::sin(phi), z } * radius;
+            ray.dir = target - ray.p;
+        }
 
-bool IntersectRayBVHNode(Ray const &r, float t_max, const float* bounds, float* dist);
+        const auto start{ std::chrono::high_resolution_clock::now() };
+        for (const Ray& ray : rays)
+        {
+            RayHit hit{};
+            mesh.IntersectRayHit(ray, hit, HIT_FRONT_AND_BACK);
+        }
+        const std::chrono::duration<float, std::micro> time{ std::chrono::high_resolution_clock::now() - start };
+        return time.count() > 0.0f ? numRays / time.count() : 0.0f;
+    }
+}
 
-// Möller-Trumbore
-bool TriObj::IntersectRay(const Ray& localRay, HitInfo& hitInfo, int hitSide) const
+bool TriObj::Load(char const* filename, BVHOptions const& options)
 {
-    float closestT{ BIGFLOAT };
-    std::stack<std::pair<unsigned int, float>> nodeStack;
+    if (!LoadFromFileObj(filename)) return false;
+    computedNormals = !HasNormals();
+    if (computedNormals) ComputeNormals();
+    ComputeBoundingBox();
+
+    // The options are kept for a lazy build, which may happen long after the scene file that cacheDir points into is gone
+    meshFile = filename;
+    cacheDir = options.cacheDir != nullptr ? options.cacheDir : "";
+    bvhOptions = options;
+    bvhOptions.cacheDir = nullptr;
+
+    lazyBVH = options.lazy;
+    if (lazyBVH)
+        ++numDeferredBVHs;
+    else
+        BuildBVH();
+
+    if (options.lodLevels > 0)
     {
-        float dist;
-        if (!IntersectRayBVHNode(localRay, closestT, bvh.GetNodeBounds(bvh.GetRootNodeID()), &dist)) return false;
-        nodeStack.push({ bvh.GetRootNodeID(), dist});
+        BuildLODs(options.lodLevels);
+        ReportLODs();
     }
+    return true;
+}
 
-    Vec3f closestX{};
-    float closestDet{};
-    float closestU{};
-    float closestV{};
-    size_t closestFaceID{};
+void TriObj::BuildLazyBVH() const
+{
+    if (!lazyBVH) return;
 
-    constexpr float epsilon{ 1e-6 };
-    bool hit{ false };
-    while (!nodeStack.empty())
+    // Rays reaching the mesh on other threads wait here until the first one has built it
+    std::call_once(bvhBuildFlag, [this]()
     {
-        const std::pair<unsigned int, float> nodePair{ nodeStack.top() };
-        nodeStack.pop();
+        const_cast<TriObj*>(this)->BuildBVH();
+        ++numLazyBuiltBVHs;
+    });
+}
 
-        const float nodeT{ nodePair.second };
-        if (closestT < nodeT)
-            continue;
+unsigned int TriObj::NumDeferredBVHs() { return numDeferredBVHs; }
+unsigned int TriObj::NumLazyBuiltBVHs() { return numLazyBuiltBVHs; }
 
-        const unsigned int parentID{ nodePair.first };
+void TriObj::BuildBVH()
+{
+    const BVHOptions& options{ bvhOptions };
+    const char* const filename{ meshFile.c_str() };
+
+    const auto start{ std::chrono::high_resolution_clock::now() };
+    bvh.SetSplitMethod(options.splitMethod);
+    bvh.SetSpatialSplitBudget(options.spatialSplitBudget);
 
-        if (bvh.IsLeafNode(parentID))
+    bool cached{ false };
+    std::string cachePath;
+    uint64_t contentHash{ 0 };
+    if (options.cache)
+    {
+        // Everything that changes the built tree goes into the hash
+        uint64_t settingsHash{ BVHCache::HashCombine(options.splitMethod, CY_BVH_MAX_ELEMENT_COUNT) };
+        settingsHash = BVHCache::HashCombine(settingsHash, CY_BVH_SAH_BIN_COUNT);
+        settingsHash = BVHCache::HashCombine(settingsHash, std::bit_cast<uint32_t>(CY_BVH_SAH_TRAVERSAL_COST));
+        settingsHash = BVHCache::HashCombine(settingsHash, std::bit_cast<uint32_t>(CY_BVH_SAH_INTERSECTION_COST));
+        settingsHash = BVHCache::HashCombine(settingsHash, CY_BVH_MORTON_30BIT_ELEMENT_LIMIT);
+        if (options.splitMethod == cy::BVH::SPLIT_SBVH)
         {
-            const unsigned int* elements{ bvh.GetNodeElements(parentID) };
-            for (int i{ 0 }; i < bvh.GetNodeElementCount(parentID); ++i)
-            {
-                const TriFace& vertFace{ f[elements[i]] };
+            settingsHash = BVHCache::HashCombine(settingsHash, std::bit_cast<uint32_t>(bvh.GetSpatialSplitBudget()));
+            settingsHash = BVHCache::HashCombine(settingsHash, std::bit_cast<uint32_t>(CY_BVH_SBVH_OVERLAP_THRESHOLD));
+        }
+        cachePath = BVHCache::GetCachePath(filename, cacheDir.c_str());
+        contentHash = BVHCache::HashFile(filename, settingsHash);
+        cached = bvhCache.Load(cachePath, contentHash, bvh);
+        if (cached) bvh.SetMeshPointer(this);
+    }
 
-                const Vec3f& v0{ v[vertFace.v[0]] };
-                const Vec3f& v1{ v[vertFace.v[1]] };
-                const Vec3f& v2{ v[vertFace.v[2]] };
+    if (!cached)
+    {
+        // The surface area heuristic also decides the leaf sizes, so we only cap them at the maximum the node format allows
+        bvh.SetMesh(this, CY_BVH_MAX_ELEMENT_COUNT);
+        if (options.cache && !BVHCache::Save(cachePath, contentHash, bvh))
+            std::cout << "WARNING: Cannot write the BVH cache file " << cachePath << "\n";
+    }
 
-                const Vec3f e1{ v1 - v0 };
-                const Vec3f e2{ v2 - v0 };
+    builtSAHCost = bvh.ComputeSAHCost();
+    rebuildThreshold = options.rebuildThreshold;
+
+    bvhWidth = options.width == 4 || options.width == 8 ? options.width : 2;
+    quantizedNodes = options.quantized && bvhWidth != 2;
+    leafBlockWidth = options.leafBlockWidth == 4 || options.leafBlockWidth == 8 ? options.leafBlockWidth : 1;
+    const size_t nodeBytes{ BuildTraversalData() };
+    const auto end{ std::chrono::high_resolution_clock::now() };
+    bvhBuilt = true;
+
+    // The world-space copies of SceneBVH are not reported, since there is one per instance
+    if (meshFile.empty()) return;
+
+    const char* const methodNames[]{ "mean", "sah", "lbvh", "sbvh" };
+    const size_t numNodes{ bvhWidth == 4 ? std::max(bvh4.NumNodes(), quantizedBVH4.NumNodes()) : bvhWidth == 8 ? std::max(bvh8.NumNodes(), quantizedBVH8.NumNodes()) : bvh.GetNumNodes() };
+    const size_t quantizedBytes{ bvhWidth == 4 ? quantizedBVH4.MemoryBytes() : quantizedBVH8.MemoryBytes() };
+    const std::chrono::duration<float, std::milli> buildTime{ end - start };
+    std::cout << "BVH" << bvhWidth << "x" << leafBlockWidth << " " << filename << " (" << methodNames[options.splitMethod] << "): " << NF() << " triangles, "
+              << bvh.GetNumElements() << " references, " << numNodes << (quantizedNodes ? " quantized" : "") << " nodes ("
+              << (quantizedNodes ? quantizedBytes : nodeBytes) / 1024 << " KB";
+    if (quantizedNodes) std::cout << ", " << (nodeBytes - quantizedBytes) / 1024 << " KB saved";
+
+    // The speed of the quantized nodes is compared against the wide nodes they replace, rebuilt only for the measurement.
+    // A lazy build cannot trace rays here, since they would wait for the build they are part of.
+    if (quantizedNodes && !lazyBVH)
+    {
+        const float quantizedRate{ measureRayRate(*this, GetBoundBox()) };
+        quantizedNodes = false;
+        if (bvhWidth == 4) bvh4.Build(bvh);
+        else bvh8.Build(bvh);
+        const float wideRate{ measureRayRate(*this, GetBoundBox()) };
+        bvh4 = WideBVH<4>{};
+        bvh8 = WideBVH<8>{};
+        quantizedNodes = true;
+        std::cout << ", " << quantizedRate << " Mrays/s, " << wideRate << " Mrays/s unquantized";
+    }
+    std::cout << "), SAH cost " << builtSAHCost << (cached ? ", loaded from cache in " : ", built in ") << buildTime.count() << " ms"
+              << (lazyBVH ? " on demand\n" : "\n");
+}
 
-                const Vec3f rayCrossE2{ localRay.dir ^ e2 };
-                const float det{ e1 % rayCrossE2 };
+bool TriObj::UpdateVertices(const Vec3f* positions)
+{
+    std::copy(positions, positions + NV(), &V(0));
+    if (computedNormals) ComputeNormals();
+    ComputeBoundingBox();
 
-                if (det > -epsilon && det < epsilon) continue;
+    // The levels of detail are simplified again from the new positions
+    if (!lods.empty()) BuildLODs(static_cast<int>(lods.size()));
 
-                if (hitSide == HIT_FRONT && det < 0.0f) continue;
-                if (hitSide == HIT_BACK && det > 0.0f) continue;
+    // A lazy BVH that has not been built yet will be built from the new positions
+    if (!bvhBuilt) return false;
 
-                const float invDet{ 1.0f / det };
-                const Vec3f s{ localRay.p - v0 };
+    // Refitting keeps the tree structure, which gets worse as the triangles move away from where they were when it was built
+    bvh.Refit();
+    const bool rebuild{ bvh.ComputeSAHCost() > rebuildThreshold * builtSAHCost };
+    if (rebuild)
+    {
+        bvh.SetMesh(this, CY_BVH_MAX_ELEMENT_COUNT);
+        builtSAHCost = bvh.ComputeSAHCost();
+    }
 
-                const float u{ invDet * (s % rayCrossE2) };
-                if (u < 0.0f || u > 1.0f) continue;
+    BuildTraversalData();
+    return rebuild;
+}
 
-                const Vec3f sCrossE1{ s ^ e1 };
-                const float v{ invDet * (localRay.dir % sCrossE1) };
-                if (v < 0.0f || u + v > 1.0f) continue;
+void TriObj::InitTransformed(const TriObj& mesh, const Transformation& transform)
+{
+    TriMesh::operator=(mesh);
+    for (unsigned int i{ 0 }; i < NV(); ++i)
+        V(i) = transform.TransformFrom(V(i));
+    for (unsigned int i{ 0 }; i < NVN(); ++i)
+        VN(i) = transform.NormalTransformFrom(VN(i)).GetNormalized();
+
+    // A mirroring transform reverses the winding, so the faces are flipped back to keep their front sides and geometric normals
+    const Matrix3f linear{ transform.GetTransform().GetSubMatrix3() };
+    if (linear.GetDeterminant() < 0.0f)
+    {
+        for (unsigned int i{ 0 }; i < NF(); ++i)
+        {
+            std::swap(F(i).v[1], F(i).v[2]);
+            if (HasNormals()) std::swap(FN(i).v[1], FN(i).v[2]);
+            if (HasTextureVertices()) std::swap(FT(i).v[1], FT(i).v[2]);
+        }
+    }
+    ComputeBoundingBox();
+    SetName(mesh.GetName());
+    computedNormals = mesh.computedNormals;
+    InitBVHFrom(mesh);
+
+    // The levels of detail are transformed along with the mesh, and their errors grow with its largest scale
+    const float scale{ std::max({ linear.Column(0).Length(), linear.Column(1).Length(), linear.Column(2).Length() }) };
+    lods.clear();
+    lodErrors.clear();
+    for (size_t i{ 0 }; i < mesh.lods.size(); ++i)
+    {
+        lods.push_back(std::make_unique<TriObj>());
+        lods.back()->InitTransformed(*mesh.lods[i], transform);
+        lodErrors.push_back(mesh.lodErrors[i] * scale);
+    }
+}
 
-                const float t{ invDet * (e2 % sCrossE1) };
-                if (t <= epsilon || t > closestT) continue;
+void TriObj::InitBVHFrom(const TriObj& mesh)
+{
+    // The vertices of a derived mesh do not match the mesh file, so it is neither cached nor reported
+    bvhOptions = mesh.bvhOptions;
+    bvhOptions.cache = false;
+    bvhOptions.lodLevels = 0;
+    meshFile.clear();
+
+    lazyBVH = mesh.lazyBVH;
+    if (lazyBVH)
+        ++numDeferredBVHs;
+    else
+        BuildBVH();
+}
 
-                hit = true;
-                closestT = t;
-                closestX = localRay.p + localRay.dir * t;
-                closestDet = det;
-                closestU = u;
-                closestV = v;
-                closestFaceID = elements[i];
-            }
+void TriObj::BuildLODs(int numLevels)
+{
+    lods.clear();
+    lodErrors.clear();
+    numLevels = std::min(numLevels, maxLODLevels);
+    if (numLevels <= 0 || NF() == 0) return;
 
-            continue;
-        }
+    double edgeLengthSum{ 0.0 };
+    for (unsigned int i{ 0 }; i < NF(); ++i)
+    {
+        for (int j{ 0 }; j < 3; ++j)
+            edgeLengthSum += (v[f[i].v[(j + 1) % 3]] - v[f[i].v[j]]).Length();
+    }
 
-        const unsigned int child1ID{ bvh.GetFirstChildNode(parentID) };
-        float child1Dist;
-        bool child1Hit{ IntersectRayBVHNode(localRay, closestT, bvh.GetNodeBounds(child1ID), &child1Dist) };
-        child1Hit = child1Hit && child1Dist < closestT;
+    float cellSize{ static_cast<float>(2.0 * edgeLengthSum / (3.0 * NF())) };
+    for (int level{ 1 }; level <= numLevels; ++level, cellSize *= 2.0f)
+    {
+        auto lod{ std::make_unique<TriObj>() };
+        lod->InitSimplified(*this, cellSize);
+        if (lod->NF() == 0 || lod->NF() == GetLOD(level - 1).NF())
+            break;
 
-        const unsigned int child2ID{ bvh.GetSecondChildNode(parentID) };
-        float child2Dist;
-        bool child2Hit{ IntersectRayBVHNode(localRay, closestT, bvh.GetNodeBounds(child2ID), &child2Dist) };
-        child2Hit = child2Hit && child2Dist < closestT;
+        lods.push_back(std::move(lod));
+        lodErrors.push_back(cellSize);
+    }
+}
 
-        if (!child1Hit && !child2Hit) 
+void TriObj::InitSimplified(const TriObj& mesh, float cellSize)
+{
+    // The vertices in the same cell of a grid merge into one cluster at their mean position
+    constexpr uint64_t maxCell{ (1u << 21) - 1 };
+    const auto cellIndex = [&](float f, float lo) { return std::min(static_cast<uint64_t>(std::max(0.0f, (f - lo) / cellSize)), maxCell); };
+
+    std::unordered_map<uint64_t, unsigned int> cellClusters;
+    std::vector<unsigned int> vertexClusters(mesh.NV());
+    std::vector<Vec3f> positionSums;
+    std::vector<unsigned int> clusterSizes;
+    for (unsigned int i{ 0 }; i < mesh.NV(); ++i)
+    {
+        const Vec3f& p{ mesh.v[i] };
+        const uint64_t key{ (cellIndex(p.x, mesh.boundMin.x) << 42) | (cellIndex(p.y, mesh.boundMin.y) << 21) | cellIndex(p.z, mesh.boundMin.z) };
+        const auto [cluster, added]{ cellClusters.try_emplace(key, static_cast<unsigned int>(positionSums.size())) };
+        if (added)
+        {
+            positionSums.push_back(Vec3f{ 0.0f });
+            clusterSizes.push_back(0);
+        }
+        vertexClusters[i] = cluster->second;
+        positionSums[cluster->second] += p;
+        ++clusterSizes[cluster->second];
+    }
+
+    // Triangles with two corners in the same cluster collapse, and of the triangles on the same three clusters only the first is kept
+    std::vector<std::array<unsigned int, 4>> clusterFaces;
+    for (unsigned int i{ 0 }; i < mesh.NF(); ++i)
+    {
+        std::array<unsigned int, 4> face{ vertexClusters[mesh.f[i].v[0]], vertexClusters[mesh.f[i].v[1]], vertexClusters[mesh.f[i].v[2]], i };
+        if (face[0] == face[1] || face[1] == face[2] || face[0] == face[2])
             continue;
+        std::sort(face.begin(), face.begin() + 3);
+        clusterFaces.push_back(face);
+    }
+    std::sort(clusterFaces.begin(), clusterFaces.end());
+
+    std::vector<unsigned int> keptFaces;
+    for (size_t i{ 0 }; i < clusterFaces.size(); ++i)
+    {
+        if (i == 0 || !std::equal(clusterFaces[i].begin(), clusterFaces[i].begin() + 3, clusterFaces[i - 1].begin()))
+            keptFaces.push_back(clusterFaces[i][3]);
+    }
+    std::sort(keptFaces.begin(), keptFaces.end());   // the original order keeps the faces of each material together
+
+    Clear();
+    SetNumVertex(static_cast<unsigned int>(positionSums.size()));
+    for (unsigned int i{ 0 }; i < NV(); ++i)
+        v[i] = positionSums[i] / static_cast<float>(clusterSizes[i]);
+
+    SetNumFaces(static_cast<unsigned int>(keptFaces.size()));
+    for (unsigned int i{ 0 }; i < NF(); ++i)
+    {
+        for (int j{ 0 }; j < 3; ++j)
+            f[i].v[j] = vertexClusters[mesh.f[keptFaces[i]].v[j]];
+    }
 
-        if (child1Hit && child2Hit)
+    // The normals of a cluster average the normals of its vertices over all the faces of the original mesh
+    computedNormals = mesh.computedNormals;
+    if (computedNormals)
+        ComputeNormals();
+    else
+    {
+        SetNumNormals(NV());
+        for (unsigned int i{ 0 }; i < NVN(); ++i)
+            vn[i] = Vec3f{ 0.0f };
+        for (unsigned int i{ 0 }; i < mesh.NF(); ++i)
         {
-            if (child1Dist < child2Dist)
+            for (int j{ 0 }; j < 3; ++j)
+                vn[vertexClusters[mesh.f[i].v[j]]] += mesh.vn[mesh.fn[i].v[j]];
+        }
+        for (unsigned int i{ 0 }; i < NVN(); ++i)
+            vn[i].Normalize();
+        for (unsigned int i{ 0 }; i < NF(); ++i)
+            fn[i] = f[i];
+    }
+
+    // Only the texture vertices of the kept faces are kept
+    if (mesh.HasTextureVertices())
+    {
+        std::vector<unsigned int> texVertexIndices(mesh.NVT(), ~0u);
+        std::vector<Vec3f> texVertices;
+        for (unsigned int i : keptFaces)
+        {
+            for (unsigned int j : mesh.ft[i].v)
             {
-                nodeStack.push({ child2ID, child2Dist });
-                nodeStack.push({ child1ID, child1Dist });
-                continue;
+                if (texVertexIndices[j] != ~0u) continue;
+                texVertexIndices[j] = static_cast<unsigned int>(texVertices.size());
+                texVertices.push_back(mesh.vt[j]);
             }
-
-            nodeStack.push({ child1ID, child1Dist });
-            nodeStack.push({ child2ID, child2Dist });
-            continue;
         }
 
-        if (child1Hit)
+        SetNumTexVerts(static_cast<unsigned int>(texVertices.size()));
+        std::copy(texVertices.begin(), texVertices.end(), vt);
+        for (unsigned int i{ 0 }; i < NF(); ++i)
         {
-            nodeStack.push({ child1ID, child1Dist });
-            continue;
+            for (int j{ 0 }; j < 3; ++j)
+                ft[i].v[j] = texVertexIndices[mesh.ft[keptFaces[i]].v[j]];
         }
+    }
+
+    SetNumMtls(mesh.NM());
+    for (unsigned int i{ 0 }; i < NM(); ++i)
+    {
+        m[i] = mesh.m[i];
+        mcfc[i] = static_cast<int>(std::lower_bound(keptFaces.begin(), keptFaces.end(), static_cast<unsigned int>(mesh.mcfc[i])) - keptFaces.begin());
+    }
 
-        nodeStack.push({ child2ID, child2Dist });
+    ComputeBoundingBox();
+    SetName(mesh.GetName());
+    InitBVHFrom(mesh);
+}
+
+void TriObj::ReportLODs() const
+{
+    // The memory and the speed of each level, with the same random rays for all levels
+    for (int level{ 0 }; level < NumLODs(); ++level)
+    {
+        const TriObj& mesh{ GetLOD(level) };
+        std::cout << "LOD " << level << " " << meshFile << ": " << mesh.NF() << " triangles, error " << LODError(level);
+        if (lazyBVH)
+            std::cout << ", BVH on demand\n";
+        else
+            std::cout << ", " << mesh.MemoryBytes() / 1024 << " KB, " << measureRayRate(mesh, GetBoundBox()) << " Mrays/s\n";
     }
+}
 
-    if (!hit) return false;
-    
-    const TriFace& normFace{ fn[closestFaceID] };
-    const TriFace& texFace{ ft[closestFaceID] };
+int TriObj::SelectLOD(const Ray& ray) const
+{
+    if (lods.empty() || lodQuality <= 0.0f) return 0;
 
-    hitInfo.z = closestT;
-    hitInfo.p = closestX;
-    hitInfo.front = closestDet > 0.0f;
+    // The footprint where the ray enters the bounding box, or at its origin if it starts inside
+    float tEntry{ 0.0f };
+    for (int axis{ 0 }; axis < 3; ++axis)
+    {
+        const float invDir{ 1.0f / ray.dir[axis] };
+        const float t0{ (boundMin[axis] - ray.p[axis]) * invDir };
+        const float t1{ (boundMax[axis] - ray.p[axis]) * invDir };
+        tEntry = std::max(tEntry, std::min(t0, t1));
+    }
 
-    hitInfo.N = ((1.0f - closestU - closestV) * vn[normFace.v[0]] + closestU * vn[normFace.v[1]] + closestV * vn[normFace.v[2]]).GetNormalized();
-    hitInfo.uvw = (1.0f - closestU - closestV) * vt[texFace.v[0]] + closestU * vt[texFace.v[1]] + closestV * vt[texFace.v[2]];
+    const float maxError{ ray.FootprintWidth(tEntry) / lodQuality };
+    return static_cast<int>(std::upper_bound(lodErrors.begin(), lodErrors.end(), maxError) - lodErrors.begin());
+}
 
-    return true;
-} 
+size_t TriObj::MemoryBytes() const
+{
+    const size_t meshBytes{ (NV() + NVN() + NVT()) * sizeof(Vec3f) + (NF() + (fn != nullptr ? NF() : 0) + (ft != nullptr ? NF() : 0)) * sizeof(TriFace) };
+    const size_t bvhBytes{ (bvh.GetNumNodes() + 1) * cy::BVH::GetNodeSize() + bvh.GetNumElements() * sizeof(unsigned int) };
+    const size_t traversalBytes{ bvh4.MemoryBytes() + bvh8.MemoryBytes() + quantizedBVH4.MemoryBytes() + quantizedBVH8.MemoryBytes()
+                                 + leafBlocks4.MemoryBytes() + leafBlocks8.MemoryBytes() };
+    return meshBytes + bvhBytes + traversalBytes;
+}
 
-bool TriObj::IntersectShadowRay( Ray const &localRay, float t_max ) const
+size_t TriObj::BuildTraversalData()
 {
-    std::stack<unsigned int> nodeStack;
+    if (bvhWidth == 4) bvh4.Build(bvh);
+    else if (bvhWidth == 8) bvh8.Build(bvh);
+
+    // Quantized nodes replace the wide nodes they are built from, so the wide nodes are released after their size is recorded
+    const size_t nodeBytes{ bvhWidth == 4 ? bvh4.MemoryBytes() : bvhWidth == 8 ? bvh8.MemoryBytes() : bvh.GetNumNodes() * cy::BVH::GetNodeSize() };
+    if (quantizedNodes && bvhWidth == 4)
+    {
+        quantizedBVH4.Build(bvh4);
+        bvh4 = WideBVH<4>{};
+    }
+    else if (quantizedNodes && bvhWidth == 8)
     {
-        float dist;
-        if (!IntersectRayBVHNode(localRay, t_max, bvh.GetNodeBounds(bvh.GetRootNodeID()), &dist)) return false;
-        nodeStack.push(bvh.GetRootNodeID());
+        quantizedBVH8.Build(bvh8);
+        bvh8 = WideBVH<8>{};
     }
 
-    constexpr float epsilon{ 1e-6 };
-    while (!nodeStack.empty())
+    if (leafBlockWidth == 4) leafBlocks4.Build(bvh, *this);
+    else if (leafBlockWidth == 8) leafBlocks8.Build(bvh, *this);
+    return nodeBytes;
+}
+
+template <bool anyHit, typename LeafFunc>
+bool TriObj::Traverse(const TraversalRay& ray, float& tMax, LeafFunc&& intersectLeaf) const
+{
+    if (bvhWidth == 4) return quantizedNodes ? quantizedBVH4.Traverse<anyHit>(ray, tMax, intersectLeaf) : bvh4.Traverse<anyHit>(ray, tMax, intersectLeaf);
+    if (bvhWidth == 8) return quantizedNodes ? quantizedBVH8.Traverse<anyHit>(ray, tMax, intersectLeaf) : bvh8.Traverse<anyHit>(ray, tMax, intersectLeaf);
+    return TraverseBVH<anyHit>(bvh, ray, tMax, intersectLeaf);
+}
+
+bool TriObj::IntersectRayHit(const Ray& localRay, RayHit& rayHit, int hitSide) const
+{
+    const int level{ SelectLOD(localRay) };
+    if (level > 0)
     {
-        const unsigned int parentID{ nodeStack.top() };
-        nodeStack.pop();
+        if (!lods[level - 1]->IntersectRayHit(localRay, rayHit, hitSide)) return false;
+        rayHit.lod = static_cast<unsigned char>(level);
+        return true;
+    }
+
+    BuildLazyBVH();
+    const TraversalRay ray{ localRay };
+    TriangleHit closest{};
+    closest.t = rayHit.z;
+    bool hit{ false };
 
-        if (bvh.IsLeafNode(parentID))
+    if (leafBlockWidth == 4)
+        Traverse<false>(ray, closest.t, [&](unsigned int leafID) { hit |= leafBlocks4.IntersectLeaf(leafID, ray, hitSide, closest); return false; });
+    else if (leafBlockWidth == 8)
+        Traverse<false>(ray, closest.t, [&](unsigned int leafID) { hit |= leafBlocks8.IntersectLeaf(leafID, ray, hitSide, closest); return false; });
+    else
+    {
+        Traverse<false>(ray, closest.t, [&](unsigned int leafID)
         {
-            const unsigned int* elements{ bvh.GetNodeElements(parentID) };
-            for (int i{ 0 }; i < bvh.GetNodeElementCount(parentID); ++i)
+            const unsigned int* elements{ bvh.GetNodeElements(leafID) };
+            for (unsigned int i{ 0 }; i < bvh.GetNodeElementCount(leafID); ++i)
             {
                 const TriFace& vertFace{ f[elements[i]] };
+                if (!IntersectTriangle(localRay, v[vertFace.v[0]], v[vertFace.v[1]], v[vertFace.v[2]], hitSide, closest.t, closest))
+                    continue;
 
-                const Vec3f& v0{ v[vertFace.v[0]] };
-                const Vec3f& v1{ v[vertFace.v[1]] };
-                const Vec3f& v2{ v[vertFace.v[2]] };
-
-                const Vec3f e1{ v1 - v0 };
-                const Vec3f e2{ v2 - v0 };
+                closest.faceID = elements[i];
+                hit = true;
+            }
+            return false;
+        });
+    }
 
-                const Vec3f rayCrossE2{ localRay.dir ^ e2 };
-                const float det{ e1 % rayCrossE2 };
+    // A hit at exactly rayHit.z is not closer
+    if (!hit || closest.t >= rayHit.z) return false;
 
-                if (det > -epsilon && det < epsilon) continue;
+    setRayHit(closest, rayHit);
+    return true;
+} 
 
-                const float invDet{ 1.0f / det };
-                const Vec3f s{ localRay.p - v0 };
+void TriObj::SetHitInfo(const Ray& localRay, const RayHit& hit, HitInfo& hitInfo) const
+{
+    if (hit.lod > 0)
+    {
+        RayHit levelHit{ hit };
+        levelHit.lod = 0;
+        lods[hit.lod - 1]->SetHitInfo(localRay, levelHit, hitInfo);
+        return;
+    }
 
-                const float u{ invDet * (s % rayCrossE2) };
-                if (u < 0.0f || u > 1.0f) continue;
+    const TriFace& normFace{ fn[hit.primID] };
+    const TriFace& texFace{ ft[hit.primID] };
 
-                const Vec3f sCrossE1{ s ^ e1 };
-                const float v{ invDet * (localRay.dir % sCrossE1) };
-                if (v < 0.0f || u + v > 1.0f) continue;
+    hitInfo.z = hit.z;
+    hitInfo.p = localRay.p + localRay.dir * hit.z;
+    hitInfo.front = hit.front;
 
-                const float t{ invDet * (e2 % sCrossE1) };
-                if (t <= epsilon || t > t_max) continue;
+    hitInfo.N = ((1.0f - hit.u - hit.v) * vn[normFace.v[0]] + hit.u * vn[normFace.v[1]] + hit.v * vn[normFace.v[2]]).GetNormalized();
+    hitInfo.uvw = (1.0f - hit.u - hit.v) * vt[texFace.v[0]] + hit.u * vt[texFace.v[1]] + hit.v * vt[texFace.v[2]];
+}
 
-                return true;
-            }
+bool TriObj::IntersectShadowRay( Ray const &localRay, float t_max ) const
+{
+    const int level{ SelectLOD(localRay) };
+    if (level > 0) return lods[level - 1]->IntersectShadowRay(localRay, t_max);
 
-            continue;
-        }
+    BuildLazyBVH();
+    const TraversalRay ray{ localRay };
 
-        const unsigned int child1ID{ bvh.GetFirstChildNode(parentID) };
-        float child1Dist;
-        bool child1Hit{ IntersectRayBVHNode(localRay, t_max, bvh.GetNodeBounds(child1ID), &child1Dist) };
-        child1Hit = child1Hit;
+    if (leafBlockWidth == 4)
+        return Traverse<true>(ray, t_max, [&](unsigned int leafID) { return leafBlocks4.IntersectLeafShadow(leafID, ray, t_max); });
+    if (leafBlockWidth == 8)
+        return Traverse<true>(ray, t_max, [&](unsigned int leafID) { return leafBlocks8.IntersectLeafShadow(leafID, ray, t_max); });
 
-        const unsigned int child2ID{ bvh.GetSecondChildNode(parentID) };
-        float child2Dist;
-        bool child2Hit{ IntersectRayBVHNode(localRay, t_max, bvh.GetNodeBounds(child2ID), &child2Dist) };
-        child2Hit = child2Hit;
+    return Traverse<true>(ray, t_max, [&](unsigned int leafID)
+    {
+        const unsigned int* elements{ bvh.GetNodeElements(leafID) };
+        for (unsigned int i{ 0 }; i < bvh.GetNodeElementCount(leafID); ++i)
+        {
+            const TriFace& vertFace{ f[elements[i]] };
+            TriangleHit triangleHit;
+            if (IntersectTriangle(localRay, v[vertFace.v[0]], v[vertFace.v[1]], v[vertFace.v[2]], HIT_FRONT_AND_BACK, t_max, triangleHit))
+                return true;
+        }
+        return false;
+    });
+}
 
-        if (!child1Hit && !child2Hit) 
-            continue;
+int TriObj::IntersectPacket(RayPacket<rayPacketWidth>& packet, int laneMask, RayHit* rayHit, int hitSide) const
+{
+    int lodHitMask{ 0 };
+    if (!lods.empty())
+    {
+        // The lanes that select a coarser level go to its mesh as a packet of their own, and the rest stay here
+        int levelMasks[maxLODLevels + 1]{};
+        for (int mask{ laneMask }; mask != 0; mask &= mask - 1)
+        {
+            const int lane{ std::countr_zero(static_cast<unsigned int>(mask)) };
+            levelMasks[SelectLOD(packet.GetRay(lane))] |= 1 << lane;
+        }
+        for (int level{ 1 }; level < NumLODs(); ++level)
+        {
+            if (levelMasks[level] == 0) continue;
+            const int levelHitMask{ lods[level - 1]->IntersectPacket(packet, levelMasks[level], rayHit, hitSide) };
+            for (int mask{ levelHitMask }; mask != 0; mask &= mask - 1)
+                rayHit[std::countr_zero(static_cast<unsigned int>(mask))].lod = static_cast<unsigned char>(level);
+            lodHitMask |= levelHitMask;
+        }
+        laneMask = levelMasks[0];
+        if (laneMask == 0) return lodHitMask;
+    }
 
-        if (child1Hit && child2Hit)
+    BuildLazyBVH();
+    // The wide and quantized nodes are built from the binary BVH, so it is always there.
+    // Its two children per node keep the packet together longer than wide nodes would.
+    TriangleHit closest[rayPacketWidth];
+    const int hitMask{ TraversePacketBVH<false>(bvh, packet, laneMask, [&](unsigned int leafID, int leafMask)
+    {
+        int leafHitMask{ 0 };
+        const unsigned int* elements{ bvh.GetNodeElements(leafID) };
+        for (unsigned int i{ 0 }; i < bvh.GetNodeElementCount(leafID); ++i)
         {
-            if (child1Dist < child2Dist)
+            const TriFace& vertFace{ f[elements[i]] };
+            alignas(32) float t[rayPacketWidth], det[rayPacketWidth], u[rayPacketWidth], bary[rayPacketWidth];
+            int mask{ IntersectPacketTriangle(packet, v[vertFace.v[0]], v[vertFace.v[1]], v[vertFace.v[2]], hitSide, leafMask, t, det, u, bary) };
+            leafHitMask |= mask;
+            for (; mask != 0; mask &= mask - 1)
             {
-                nodeStack.push(child2ID);
-                nodeStack.push(child1ID);
-                continue;
+                const int lane{ std::countr_zero(static_cast<unsigned int>(mask)) };
+                closest[lane] = { t[lane], det[lane], u[lane], bary[lane], elements[i] };
+                packet.tMax[lane] = t[lane];
             }
-
-            nodeStack.push(child1ID);
-            nodeStack.push(child2ID);
-            continue;
         }
+        return leafHitMask;
+    }) };
+
+    for (int mask{ hitMask }; mask != 0; mask &= mask - 1)
+    {
+        const int lane{ std::countr_zero(static_cast<unsigned int>(mask)) };
+        setRayHit(closest[lane], rayHit[lane]);
+    }
+    return hitMask | lodHitMask;
+}
 
-        if (child1Hit)
+int TriObj::IntersectShadowPacket(const RayPacket<rayPacketWidth>& packet, int laneMask) const
+{
+    int lodHitMask{ 0 };
+    if (!lods.empty())
+    {
+        int levelMasks[maxLODLevels + 1]{};
+        for (int mask{ laneMask }; mask != 0; mask &= mask - 1)
         {
-            nodeStack.push(child1ID);
-            continue;
+            const int lane{ std::countr_zero(static_cast<unsigned int>(mask)) };
+            levelMasks[SelectLOD(packet.GetRay(lane))] |= 1 << lane;
         }
-
-        nodeStack.push(child2ID);
+        for (int level{ 1 }; level < NumLODs(); ++level)
+        {
+            if (levelMasks[level] != 0)
+                lodHitMask |= lods[level - 1]->IntersectShadowPacket(packet, levelMasks[level]);
+        }
+        laneMask = levelMasks[0];
+        if (laneMask == 0) return lodHitMask;
     }
 
-    return false;
+    BuildLazyBVH();
+    return lodHitMask | TraversePacketBVH<true>(bvh, packet, laneMask, [&](unsigned int leafID, int leafMask)
+    {
+        int leafHitMask{ 0 };
+        const unsigned int* elements{ bvh.GetNodeElements(leafID) };
+        for (unsigned int i{ 0 }; i < bvh.GetNodeElementCount(leafID) && leafMask != 0; ++i)
+        {
+            const TriFace& vertFace{ f[elements[i]] };
+            alignas(32) float t[rayPacketWidth], det[rayPacketWidth], u[rayPacketWidth], bary[rayPacketWidth];
+            const int mask{ IntersectPacketTriangle(packet, v[vertFace.v[0]], v[vertFace.v[1]], v[vertFace.v[2]], HIT_FRONT_AND_BACK, leafMask, t, det, u, bary) };
+            leafHitMask |= mask;
+            leafMask &= ~mask;
+        }
+        return leafHitMask;
+    });
 }
 
-bool Box::IntersectRay(Ray const &r, float t_max) const
+template <bool anyHit, typename LeafFunc>
+void TriObj::TraverseInterleaved(const TraversalRay* rays, float* tMax, size_t count, LeafFunc&& intersectLeaf) const
 {
-    const Vec3f invDir{ 1.0f / r.dir.x, 1.0f / r.dir.y, 1.0f / r.dir.z };
-    float tNear{ 0.0f };
-    float tFar{ t_max };
-
-    // x
-    float t1{ (pmin.x - r.p.x) * invDir.x };
-    float t2{ (pmax.x - r.p.x) * invDir.x };
-    float slabTMin{ std::min(t1, t2) };
-    float slabTMax{ std::max(t2, t1) };
-
-    tNear = std::max(tNear, slabTMin);
-    tFar = std::min(tFar, slabTMax);
-    if (tNear > tFar) return false;
-
-    // y
-    t1 = (pmin.y - r.p.y) * invDir.y;
-    t2 = (pmax.y - r.p.y) * invDir.y;
+    const auto prefetchLeaf = [&](unsigned int leafID)
+    {
+        if (leafBlockWidth == 4)
+            leafBlocks4.PrefetchLeaf(leafID);
+        else
+            leafBlocks8.PrefetchLeaf(leafID);
+    };
+
+    if (bvhWidth == 4)
+        bvh4.TraverseInterleaved<anyHit, interleavedRays>(rays, tMax, count, intersectLeaf, prefetchLeaf);
+    else
+        bvh8.TraverseInterleaved<anyHit, interleavedRays>(rays, tMax, count, intersectLeaf, prefetchLeaf);
+}
 
-    slabTMin = std::min(t1, t2);
-    slabTMax = std::max(t1, t2);
+void TriObj::IntersectRays(const Ray* localRays, RayHit* rayHit, bool* found, size_t count, int hitSide) const
+{
+    // A lazy BVH is built before CanInterleave reads the node and leaf formats that the build sets
+    BuildLazyBVH();
+
+    // The rays that select a coarser level or that cannot be interleaved are traced one by one
+    thread_local std::vector<TraversalRay> rays;
+    thread_local std::vector<unsigned int> rayIndex;
+    thread_local std::vector<float> tMax;
+    thread_local std::vector<TriangleHit> closest;
+    rays.clear();
+    rayIndex.clear();
+    for (size_t i{ 0 }; i < count; ++i)
+    {
+        if (!CanInterleave() || SelectLOD(localRays[i]) > 0)
+        {
+            found[i] = IntersectRayHit(localRays[i], rayHit[i], hitSide);
+            continue;
+        }
+        found[i] = false;
+        rays.emplace_back(localRays[i]);
+        rayIndex.push_back(static_cast<unsigned int>(i));
+    }
+    if (rays.empty()) return;
 
-    tNear = std::max(tNear, slabTMin);
-    tFar = std::min(tFar, slabTMax);
-    if (tNear > tFar) return false;
+    tMax.resize(rays.size());
+    closest.assign(rays.size(), TriangleHit{});
+    for (size_t k{ 0 }; k < rays.size(); ++k)
+        tMax[k] = rayHit[rayIndex[k]].z;
 
-    // z
-    t1 = (pmin.z - r.p.z) * invDir.z;
-    t2 = (pmax.z - r.p.z) * invDir.z;
+    TraverseInterleaved<false>(rays.data(), tMax.data(), rays.size(), [&](size_t k, unsigned int leafID)
+    {
+        TriangleHit& hit{ closest[k] };
+        hit.t = tMax[k];
+        const bool leafHit{ leafBlockWidth == 4 ? leafBlocks4.IntersectLeaf(leafID, rays[k], hitSide, hit) : leafBlocks8.IntersectLeaf(leafID, rays[k], hitSide, hit) };
+        if (leafHit)
+        {
+            tMax[k] = hit.t;
+            found[rayIndex[k]] = true;
+        }
+        return false;
+    });
 
-    slabTMin = std::min(t1, t2);
-    slabTMax = std::max(t1, t2);
+    for (size_t k{ 0 }; k < rays.size(); ++k)
+    {
+        // A hit at exactly rayHit.z is not closer
+        RayHit& hit{ rayHit[rayIndex[k]] };
+        if (!found[rayIndex[k]] || closest[k].t >= hit.z)
+        {
+            found[rayIndex[k]] = false;
+            continue;
+        }
+        setRayHit(closest[k], hit);
+    }
+}
 
-    tNear = std::max(tNear, slabTMin);
-    tFar = std::min(tFar, slabTMax);
-    if (tNear > tFar) return false;
+void TriObj::IntersectShadowRays(const Ray* localRays, const float* t_max, bool* occluded, size_t count) const
+{
+    BuildLazyBVH();
+
+    thread_local std::vector<TraversalRay> rays;
+    thread_local std::vector<unsigned int> rayIndex;
+    thread_local std::vector<float> tMax;
+    rays.clear();
+    rayIndex.clear();
+    tMax.clear();
+    for (size_t i{ 0 }; i < count; ++i)
+    {
+        if (!CanInterleave() || SelectLOD(localRays[i]) > 0)
+        {
+            occluded[i] = IntersectShadowRay(localRays[i], t_max[i]);
+            continue;
+        }
+        occluded[i] = false;
+        rays.emplace_back(localRays[i]);
+        rayIndex.push_back(static_cast<unsigned int>(i));
+        tMax.push_back(t_max[i]);
+    }
+    if (rays.empty()) return;
 
-    return tNear < tFar;
+    TraverseInterleaved<true>(rays.data(), tMax.data(), rays.size(), [&](size_t k, unsigned int leafID)
+    {
+        const bool leafHit{ leafBlockWidth == 4 ? leafBlocks4.IntersectLeafShadow(leafID, rays[k], tMax[k]) : leafBlocks8.IntersectLeafShadow(leafID, rays[k], tMax[k]) };
+        if (leafHit) occluded[rayIndex[k]] = true;
+        return leafHit;
+    });
 }
 
-bool IntersectRayBVHNode(Ray const &r, float t_max, const float* bounds, float* dist)
+bool Box::IntersectRay(Ray const &r, float t_max) const
 {
     const Vec3f invDir{ 1.0f / r.dir.x, 1.0f / r.dir.y, 1.0f / r.dir.z };
     float tNear{ 0.0f };
     float tFar{ t_max };
 
-    const Vec3f pmin = Vec3f{ bounds[0], bounds[1], bounds[2] };
-    const Vec3f pmax = Vec3f{ bounds[3], bounds[4], bounds[5] };
-
     // x
     float t1{ (pmin.x - r.p.x) * invDir.x };
     float t2{ (pmax.x - r.p.x) * invDir.x };
@@ -310,11 +797,5 @@ bool IntersectRayBVHNode(Ray const &r, float t_max, const float* bounds, float*
     tFar = std::min(tFar, slabTMax);
     if (tNear > tFar) return false;
 
-    if (tNear < tFar)
-    {
-        *dist = tNear;
-        return true;
-    }
-
-    return false;
+    return tNear < tFar;
 }
@@ -0,0 +1,214 @@
+#include "bvhcache.h"
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <new>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+    constexpr char cacheMagic[8]{ 'C', 'Y', 'B', 'V', 'H', 'C', 'H', '\0' };
+    constexpr uint32_t cacheVersion{ 2 };
+
+    struct CacheHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t nodeSize;
+        uint64_t contentHash;
+        uint32_t numNodes;
+        uint32_t numElements;
+        uint64_t nodeOffset;
+        uint64_t elementOffset;
+        uint64_t fileSize;
+    };
+
+    // Also the alignment of the loaded data, so that the sibling node pairs stay aligned to cache lines
+    constexpr uint64_t nodeDataOffset{ 64 };
+    static_assert(sizeof(CacheHeader) <= nodeDataOffset);
+
+    constexpr uint64_t fnvOffsetBasis{ 14695981039346656037ull };
+    constexpr uint64_t fnvPrime{ 1099511628211ull };
+}
+
+BVHCache::~BVHCache()
+{
+    release();
+}
+
+void BVHCache::release()
+{
+    if (data == nullptr) return;
+#ifdef _WIN32
+    ::operator delete[](data, std::align_val_t{ nodeDataOffset });
+#else
+    munmap(data, dataSize);
+#endif
+    data = nullptr;
+    dataSize = 0;
+}
+
+bool BVHCache::Load(const std::string& path, uint64_t contentHash, cy::BVH& bvh)
+{
+    release();
+
+#ifdef _WIN32
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file) return false;
+    dataSize = static_cast<size_t>(file.tellg());
+    if (dataSize < sizeof(CacheHeader)) return false;
+    data = ::operator new[](dataSize, std::align_val_t{ nodeDataOffset });
+    file.seekg(0);
+    if (!file.read(static_cast<char*>(data), dataSize))
+    {
+        release();
+        return false;
+    }
+#else
+    const int fd{ open(path.c_str(), O_RDONLY) };
+    if (fd < 0) return false;
+
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) != 0 || static_cast<size_t>(fileStat.st_size) < sizeof(CacheHeader))
+    {
+        close(fd);
+        return false;
+    }
+
+    dataSize = static_cast<size_t>(fileStat.st_size);
+    void* mapping{ mmap(nullptr, dataSize, PROT_READ, MAP_PRIVATE, fd, 0) };
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        dataSize = 0;
+        return false;
+    }
+    data = mapping;
+#endif
+
+    CacheHeader header;
+    std::memcpy(&header, data, sizeof(header));
+
+    const uint64_t nodeBytes{ (static_cast<uint64_t>(header.numNodes) + 1) * cy::BVH::GetNodeSize() };
+    const uint64_t elementBytes{ static_cast<uint64_t>(header.numElements) * sizeof(unsigned int) };
+    const bool valid{ std::memcmp(header.magic, cacheMagic, sizeof(cacheMagic)) == 0
+        && header.version == cacheVersion
+        && header.nodeSize == cy::BVH::GetNodeSize()
+        && header.contentHash == contentHash
+        && header.fileSize == dataSize
+        && header.numNodes > 0
+        && header.nodeOffset == nodeDataOffset
+        && header.elementOffset == nodeDataOffset + nodeBytes
+        && header.elementOffset + elementBytes <= dataSize };
+    if (!valid)
+    {
+        release();
+        return false;
+    }
+
+    const char* const bytes{ static_cast<const char*>(data) };
+    bvh.SetExternalData(bytes + header.nodeOffset, header.numNodes,
+                        reinterpret_cast<const unsigned int*>(bytes + header.elementOffset), header.numElements);
+    return true;
+}
+
+bool BVHCache::Save(const std::string& path, uint64_t contentHash, const cy::BVH& bvh)
+{
+    if (bvh.GetNumNodes() == 0) return false;
+
+    const uint64_t nodeBytes{ (static_cast<uint64_t>(bvh.GetNumNodes()) + 1) * cy::BVH::GetNodeSize() };
+    const uint64_t elementBytes{ static_cast<uint64_t>(bvh.GetNumElements()) * sizeof(unsigned int) };
+
+    CacheHeader header{};
+    std::memcpy(header.magic, cacheMagic, sizeof(cacheMagic));
+    header.version = cacheVersion;
+    header.nodeSize = static_cast<uint32_t>(cy::BVH::GetNodeSize());
+    header.contentHash = contentHash;
+    header.numNodes = bvh.GetNumNodes();
+    header.numElements = bvh.GetNumElements();
+    header.nodeOffset = nodeDataOffset;
+    header.elementOffset = nodeDataOffset + nodeBytes;
+    header.fileSize = header.elementOffset + elementBytes;
+
+    // Write to a temporary file first, so that a concurrent load never sees a partial file
+    std::error_code error;
+    const std::filesystem::path directory{ std::filesystem::path{ path }.parent_path() };
+    if (!directory.empty()) std::filesystem::create_directories(directory, error);
+
+    const std::string tempPath{ path + ".tmp" };
+    {
+        std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+        if (!file) return false;
+
+        char headerBytes[nodeDataOffset]{};
+        std::memcpy(headerBytes, &header, sizeof(header));
+        file.write(headerBytes, sizeof(headerBytes));
+        file.write(static_cast<const char*>(bvh.GetNodeData()), static_cast<std::streamsize>(nodeBytes));
+        file.write(reinterpret_cast<const char*>(bvh.GetElementData()), static_cast<std::streamsize>(elementBytes));
+        if (!file) return false;
+    }
+
+    std::filesystem::rename(tempPath, path, error);
+    if (error)
+    {
+        std::filesystem::remove(tempPath, error);
+        return false;
+    }
+    return true;
+}
+
+uint64_t BVHCache::HashCombine(uint64_t hash, uint64_t value)
+{
+    for (int i{ 0 }; i < 8; ++i)
+    {
+        hash ^= (value >> (8 * i)) & 0xff;
+        hash *= fnvPrime;
+    }
+    return hash;
+}
+
+uint64_t BVHCache::HashFile(const char* filename, uint64_t seed)
+{
+    std::ifstream file(filename, std::ios::binary);
+    if (!file) return 0;
+
+    // FNV-1a over 64-bit words, which is fast enough to be dominated by reading the file
+    uint64_t hash{ HashCombine(fnvOffsetBasis, seed) };
+    std::vector<char> buffer(1 << 20);
+    uint64_t totalSize{ 0 };
+    while (file)
+    {
+        file.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+        const size_t count{ static_cast<size_t>(file.gcount()) };
+        totalSize += count;
+
+        size_t i{ 0 };
+        for (; i + 8 <= count; i += 8)
+        {
+            uint64_t word;
+            std::memcpy(&word, buffer.data() + i, 8);
+            hash = (hash ^ word) * fnvPrime;
+        }
+        for (; i < count; ++i)
+            hash = (hash ^ static_cast<unsigned char>(buffer[i])) * fnvPrime;
+    }
+    return HashCombine(hash, totalSize);
+}
+
+std::string BVHCache::GetCachePath(const char* meshFilename, const char* cacheDir)
+{
+    const std::filesystem::path meshPath{ meshFilename };
+    std::filesystem::path cachePath{ meshPath };
+    if (cacheDir != nullptr && cacheDir[0] != '\0')
+        cachePath = std::filesystem::path{ cacheDir } / meshPath.filename();
+    cachePath += ".bvhcache";
+    return cachePath.string();
+}
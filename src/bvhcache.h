@@ -0,0 +1,47 @@
+#ifndef _BVHCACHE_H_INCLUDED_
+#define _BVHCACHE_H_INCLUDED_
+
+#include "cyCore/cyBVH.h"
+
+#include <cstdint>
+#include <string>
+
+// On-disk cache of built cy::BVH trees. A cache file keeps the node data and
+// element indices of a tree together with a hash of the content it was built
+// from (the mesh file and the build settings), so that a later load of the same
+// content maps the file and uses it in place instead of rebuilding the tree.
+// The mapping is owned by the BVHCache object and must outlive the tree using it.
+class BVHCache
+{
+public:
+    BVHCache() = default;
+    ~BVHCache();
+
+    BVHCache(const BVHCache&) = delete;
+    BVHCache& operator=(const BVHCache&) = delete;
+
+    // Maps the cache file and points bvh at its data. Returns false, leaving bvh
+    // untouched, if the file is missing or was written for a different content
+    // hash, node layout, or format version.
+    bool Load(const std::string& path, uint64_t contentHash, cy::BVH& bvh);
+
+    // Writes the tree to the cache file, replacing any previous file atomically.
+    static bool Save(const std::string& path, uint64_t contentHash, const cy::BVH& bvh);
+
+    // Hashes the bytes of the file, starting from the given seed. Returns 0 if the file cannot be read.
+    static uint64_t HashFile(const char* filename, uint64_t seed);
+
+    // Combines a value into a hash, e.g. to add the build settings of a tree.
+    static uint64_t HashCombine(uint64_t hash, uint64_t value);
+
+    // Returns the cache file path of a mesh file: next to the mesh if cacheDir is null or empty.
+    static std::string GetCachePath(const char* meshFilename, const char* cacheDir);
+
+private:
+    void* data{ nullptr };
+    size_t dataSize{ 0 };
+
+    void release();
+};
+
+#endif
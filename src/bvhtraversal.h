@@ -0,0 +1,126 @@
+#ifndef _BVHTRAVERSAL_H_INCLUDED_
+#define _BVHTRAVERSAL_H_INCLUDED_
+
+#include "scene.h"
+#include "cyCore/cyBVH.h"
+
+#include <algorithm>
+
+// Ray data that every box test of a traversal needs, computed once per ray.
+// sign[axis] is 1 for negative directions, so bounds[3 * sign[axis] + axis] is
+// the slab plane that the ray enters first and no min/max is needed per test.
+struct TraversalRay
+{
+    Vec3f p;
+    Vec3f dir;
+    Vec3f invDir;
+    int sign[3];
+
+    explicit TraversalRay(const Ray& ray)
+        : p{ ray.p }
+        , dir{ ray.dir }
+        , invDir{ 1.0f / ray.dir.x, 1.0f / ray.dir.y, 1.0f / ray.dir.z }
+        , sign{ invDir.x < 0.0f, invDir.y < 0.0f, invDir.z < 0.0f }
+    {
+    }
+};
+
+// Slab test of a cy::BVH node box (min xyz, max xyz) within [0, tMax].
+// tNear == tFar counts as a hit, so flat boxes are not missed.
+inline bool IntersectRayBVHNode(const TraversalRay& ray, float tMax, const float* bounds, float& tNear)
+{
+    const float tx0{ (bounds[3 * ray.sign[0]] - ray.p.x) * ray.invDir.x };
+    const float tx1{ (bounds[3 - 3 * ray.sign[0]] - ray.p.x) * ray.invDir.x };
+    const float ty0{ (bounds[3 * ray.sign[1] + 1] - ray.p.y) * ray.invDir.y };
+    const float ty1{ (bounds[4 - 3 * ray.sign[1]] - ray.p.y) * ray.invDir.y };
+    const float tz0{ (bounds[3 * ray.sign[2] + 2] - ray.p.z) * ray.invDir.z };
+    const float tz1{ (bounds[5 - 3 * ray.sign[2]] - ray.p.z) * ray.invDir.z };
+
+    tNear = std::max(std::max(tx0, ty0), std::max(tz0, 0.0f));
+    const float tFar{ std::min(std::min(tx1, ty1), std::min(tz1, tMax)) };
+    return tNear <= tFar;
+}
+
+// Depth-first traversal of the subtree of nodeID of a binary cy::BVH without any
+// allocation, for a ray that enters the node box at tNear. intersectLeaf(leafNodeID)
+// is called for the leaves the ray may hit, near to far. For closest-hit traversal
+// (anyHit == false) it may shorten tMax, which culls the remaining nodes; for any-hit
+// traversal the traversal stops when it returns true. The stack holds at most one
+// entry per level plus one, so a node whose children do not fit, which only a tree
+// deeper than the stack can reach, has its subtree traversed with a new stack.
+template <bool anyHit, typename LeafFunc>
+bool TraverseBVHSubtree(const cy::BVH& bvh, const TraversalRay& ray, float& tMax, unsigned int nodeID, float tNear, LeafFunc& intersectLeaf)
+{
+    constexpr int maxStackSize{ 128 };
+    struct StackEntry
+    {
+        unsigned int nodeID;
+        float tNear;
+    };
+
+    StackEntry nodeStack[maxStackSize];
+    int stackSize{ 0 };
+    nodeStack[stackSize++] = { nodeID, tNear };
+
+    while (stackSize > 0)
+    {
+        const StackEntry entry{ nodeStack[--stackSize] };
+        if (entry.tNear > tMax)
+            continue;
+
+        if (bvh.IsLeafNode(entry.nodeID))
+        {
+            if (intersectLeaf(entry.nodeID) && anyHit)
+                return true;
+            continue;
+        }
+
+        if (stackSize + 2 > maxStackSize)
+        {
+            if (TraverseBVHSubtree<anyHit>(bvh, ray, tMax, entry.nodeID, entry.tNear, intersectLeaf) && anyHit)
+                return true;
+            continue;
+        }
+
+        unsigned int child1ID, child2ID;
+        bvh.GetChildNodes(entry.nodeID, child1ID, child2ID);
+        float child1Dist, child2Dist;
+        const bool child1Hit{ IntersectRayBVHNode(ray, tMax, bvh.GetNodeBounds(child1ID), child1Dist) };
+        const bool child2Hit{ IntersectRayBVHNode(ray, tMax, bvh.GetNodeBounds(child2ID), child2Dist) };
+
+        // The distances of the tests above pick the near child, which is pushed last to be visited first
+        if (child1Hit && child2Hit)
+        {
+            if (child1Dist < child2Dist)
+            {
+                nodeStack[stackSize++] = { child2ID, child2Dist };
+                nodeStack[stackSize++] = { child1ID, child1Dist };
+                continue;
+            }
+
+            nodeStack[stackSize++] = { child1ID, child1Dist };
+            nodeStack[stackSize++] = { child2ID, child2Dist };
+            continue;
+        }
+
+        if (child1Hit)
+            nodeStack[stackSize++] = { child1ID, child1Dist };
+        else if (child2Hit)
+            nodeStack[stackSize++] = { child2ID, child2Dist };
+    }
+
+    return false;
+}
+
+// Traverses the whole cy::BVH; see TraverseBVHSubtree
+template <bool anyHit, typename LeafFunc>
+bool TraverseBVH(const cy::BVH& bvh, const TraversalRay& ray, float& tMax, LeafFunc&& intersectLeaf)
+{
+    if (bvh.GetNumNodes() == 0) return false;
+
+    float tNear;
+    if (!IntersectRayBVHNode(ray, tMax, bvh.GetNodeBounds(bvh.GetRootNodeID()), tNear)) return false;
+    return TraverseBVHSubtree<anyHit>(bvh, ray, tMax, bvh.GetRootNodeID(), tNear, intersectLeaf);
+}
+
+#endif
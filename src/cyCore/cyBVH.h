@@ -36,6 +36,15 @@
 #ifndef _CY_BVH_H_INCLUDED_
 #define _CY_BVH_H_INCLUDED_
 
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <cstdint>
+#include <bit>
+#include <new>
+#include <memory>
+#include <cstring>
+
 //-------------------------------------------------------------------------------
 namespace cy {
 //-------------------------------------------------------------------------------
@@ -48,6 +57,40 @@ namespace cy {
 #define CY_BVH_MAX_ELEMENT_COUNT	(1<<CY_BVH_ELEMENT_COUNT_BITS)	//!< Determines the maximum number of elements in a node (8)
 #endif
 
+#ifndef CY_BVH_SAH_BIN_COUNT
+#define CY_BVH_SAH_BIN_COUNT		16	//!< Determines the number of bins per axis used by the surface area heuristic split
+#endif
+
+#ifndef CY_BVH_SAH_TRAVERSAL_COST
+#define CY_BVH_SAH_TRAVERSAL_COST	1.0f	//!< The relative cost of visiting an internal node used by the surface area heuristic
+#endif
+
+#ifndef CY_BVH_SAH_INTERSECTION_COST
+#define CY_BVH_SAH_INTERSECTION_COST	1.0f	//!< The relative cost of intersecting an element used by the surface area heuristic
+#endif
+
+#ifndef CY_BVH_PARALLEL_BUILD_THRESHOLD
+#define CY_BVH_PARALLEL_BUILD_THRESHOLD	4096	//!< Determines the minimum number of elements of a node for building its subtrees on separate threads
+#endif
+
+#ifndef CY_BVH_MORTON_30BIT_ELEMENT_LIMIT
+#define CY_BVH_MORTON_30BIT_ELEMENT_LIMIT	(1<<18)	//!< Determines the maximum number of elements that use 30-bit Morton codes, 63-bit codes are used for more elements
+#endif
+
+#ifndef CY_BVH_TREELET_NODE_PAIRS
+#define CY_BVH_TREELET_NODE_PAIRS	64	//!< Determines the number of sibling node pairs stored together as a treelet (64 pairs of 64 bytes fill a 4 KB page)
+#endif
+
+#define _CY_BVH_NODE_PAIR_ALIGNMENT	64	//!< Sibling node pairs are aligned to cache lines
+
+#ifndef CY_BVH_SBVH_DEFAULT_BUDGET
+#define CY_BVH_SBVH_DEFAULT_BUDGET	0.3f	//!< The default maximum number of duplicated element references of spatial splits as a fraction of the number of elements
+#endif
+
+#ifndef CY_BVH_SBVH_OVERLAP_THRESHOLD
+#define CY_BVH_SBVH_OVERLAP_THRESHOLD	1e-5f	//!< Spatial splits are only tried when the children of the best object split overlap by more than this fraction of the root surface area
+#endif
+
 #define _CY_BVH_NODE_DATA_BITS		(sizeof(unsigned int)*8)
 #define _CY_BVH_ELEMENT_COUNT_MASK	((1<<CY_BVH_ELEMENT_COUNT_BITS)-1)
 #define _CY_BVH_LEAF_BIT_MASK		((unsigned int)1<<(_CY_BVH_NODE_DATA_BITS-1))
@@ -64,8 +107,16 @@ class BVH
 {
 public:
 
+	//! Split methods used by the default implementation of FindSplit
+	enum SplitMethod {
+		SPLIT_MEAN,	//!< splits down the middle of the widest axis of the node
+		SPLIT_SAH,	//!< binned surface area heuristic that also decides when to stop splitting
+		SPLIT_MORTON,	//!< sorts the elements by the Morton codes of their centers and splits at the highest differing bit (linear BVH)
+		SPLIT_SBVH,	//!< binned surface area heuristic that can also split element references at spatial planes (see SetSpatialSplitBudget)
+	};
+
 	//!@name Constructor and destructor
-	BVH() : nodes(0), elements(0) {}
+	BVH() : nodes(0), elements(0), numNodes(0), numElements(0), ownsData(true), splitMethod(SPLIT_MEAN), spatialSplitBudget(CY_BVH_SBVH_DEFAULT_BUDGET), elementBounds(0), elementCenters(0), mortonCodes(0), tempNodes(0), tempNodeCount(0) {}
 	virtual ~BVH() { Clear(); }
 
 	/////////////////////////////////////////////////////////////////////////////////
@@ -105,6 +156,27 @@ public:
 	//! Returns the list of element inside the given node (must be a leaf node).
 	unsigned int const * GetNodeElements(unsigned int nodeID) const { return &elements[nodes[nodeID].ElementOffset()]; }
 
+	//! Returns the number of nodes in the tree.
+	unsigned int GetNumNodes() const { return numNodes; }
+
+	//! Returns the number of elements in the tree.
+	unsigned int GetNumElements() const { return numElements; }
+
+	//! Returns the surface area heuristic cost of the tree, where the cost of the root node
+	//! is the expected cost of tracing a ray that hits the bounding box of the root node.
+	float ComputeSAHCost() const
+	{
+		if ( numNodes == 0 ) return 0;
+		float rootArea = BoxArea( nodes[GetRootNodeID()].GetBounds() );
+		if ( rootArea <= 0 ) return 0;
+		float cost = 0;
+		for ( unsigned int i=GetRootNodeID(); i<=numNodes; i++ ) {
+			float nodeCost = nodes[i].IsLeafNode() ? CY_BVH_SAH_INTERSECTION_COST * nodes[i].ElementCount() : CY_BVH_SAH_TRAVERSAL_COST;
+			cost += nodeCost * BoxArea( nodes[i].GetBounds() ) / rootArea;
+		}
+		return cost;
+	}
+
 	/////////////////////////////////////////////////////////////////////////////////
 	//@ Clear and Build Methods
 	/////////////////////////////////////////////////////////////////////////////////
@@ -112,33 +184,142 @@ public:
 	//! Clears the tree structure
 	void Clear()
 	{
-		if (nodes) delete [] nodes;
+		if ( ownsData ) {
+			if (nodes) FreeNodes();
+			if (elements) delete [] elements;
+		}
 		nodes = 0;
-		if (elements) delete [] elements;
 		elements = 0;
+		numNodes = 0;
+		numElements = 0;
+		ownsData = true;
 	}
 
+	//! Recomputes the bounding boxes of all nodes from the current element bounds, keeping the tree structure.
+	//! This is much faster than building the tree again when the elements move, but the quality of the tree
+	//! (see ComputeSAHCost) degrades as the elements move further from where they were when the tree was built.
+	//! The leaf nodes are updated in parallel. External data (see SetExternalData) is copied before it is modified.
+	void Refit()
+	{
+		if ( numNodes == 0 ) return;
+		if ( ! ownsData ) CopyExternalData();
+
+		ParallelFor( numNodes, [this]( unsigned int begin, unsigned int end ) {
+			for ( unsigned int i=begin+GetRootNodeID(); i<end+GetRootNodeID(); i++ ) {
+				if ( ! nodes[i].IsLeafNode() ) continue;
+				Box box;
+				unsigned int const *nodeElements = &elements[ nodes[i].ElementOffset() ];
+				for ( unsigned int j=0; j<nodes[i].ElementCount(); j++ ) {
+					Box elementBox;
+					GetElementBounds( nodeElements[j], elementBox.b );
+					box += elementBox;
+				}
+				nodes[i].SetBounds( box );
+			}
+		});
+
+		// Child nodes are always stored after their parents, so a reverse pass updates the children before their parents
+		for ( unsigned int i=numNodes; i>=GetRootNodeID(); i-- ) {
+			if ( nodes[i].IsLeafNode() ) continue;
+			Box box( nodes[ nodes[i].ChildIndex() ].GetBounds() );
+			box += Box( nodes[ nodes[i].ChildIndex()+1 ].GetBounds() );
+			nodes[i].SetBounds( box );
+		}
+	}
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//@ Raw Data Access Methods
+	/////////////////////////////////////////////////////////////////////////////////
+
+	//! Returns the size of a node in bytes.
+	static size_t GetNodeSize() { return sizeof(Node); }
+
+	//! Returns the raw node data, which includes the unused first node, so its size is (GetNumNodes()+1)*GetNodeSize() bytes.
+	void const * GetNodeData() const { return nodes; }
+
+	//! Returns the element indices of all leaf nodes (GetNumElements() values).
+	unsigned int const * GetElementData() const { return elements; }
+
+	//! Uses the node data and element indices of a previously built tree, as returned by GetNodeData and GetElementData,
+	//! instead of building the tree. The data is not copied, so it must remain valid until the tree is cleared.
+	void SetExternalData( void const *nodeData, unsigned int nodeCount, unsigned int const *elementData, unsigned int elementCount )
+	{
+		Clear();
+		nodes       = const_cast<Node*>( static_cast<Node const*>(nodeData) );
+		elements    = const_cast<unsigned int*>( elementData );
+		numNodes    = nodeCount;
+		numElements = elementCount;
+		ownsData    = false;
+	}
+
+	//! Sets the split method used by the default implementation of FindSplit.
+	//! It must be set before building the tree.
+	void SetSplitMethod( SplitMethod method ) { splitMethod = method; }
+
+	//! Returns the split method used by the default implementation of FindSplit.
+	SplitMethod GetSplitMethod() const { return splitMethod; }
+
+	//! Sets the maximum number of duplicated element references that SPLIT_SBVH can create, as a fraction of the
+	//! number of elements. With spatial splits an element can be listed by multiple leaf nodes, so the total number
+	//! of element indices (GetNumElements) can be up to (1+budget) times the number of elements.
+	void SetSpatialSplitBudget( float budget ) { spatialSplitBudget = budget > 0 ? budget : 0; }
+
+	//! Returns the maximum number of duplicated element references of SPLIT_SBVH as a fraction of the number of elements.
+	float GetSpatialSplitBudget() const { return spatialSplitBudget; }
+
 	//! Builds the tree structure by recursively splitting the nodes. maxElementsPerNode cannot be larger than 8.
+	//! The element bounds and centers are computed once in parallel, and large subtrees are split on
+	//! separate threads. The resulting tree does not depend on the number of threads used.
 	void Build( unsigned int numElements, unsigned int maxElementsPerNode=CY_BVH_MAX_ELEMENT_COUNT )
 	{
 		Clear();
 		if ( numElements == 0 ) return;
 		if ( maxElementsPerNode > CY_BVH_MAX_ELEMENT_COUNT ) maxElementsPerNode = CY_BVH_MAX_ELEMENT_COUNT;
 		elements = new unsigned int[numElements];
-		for ( unsigned int i=0; i<numElements; i++ ) elements[i] = i;
+		this->numElements = numElements;
+
+		// Cache the bounds and centers of the elements, so that the build does not call the virtual methods again.
+		elementBounds  = new Box[numElements];
+		elementCenters = new float[3*numElements];
+		ParallelFor( numElements, [this]( unsigned int begin, unsigned int end ) {
+			for ( unsigned int i=begin; i<end; i++ ) {
+				elements[i] = i;
+				GetElementBounds( i, elementBounds[i].b );
+				for ( int d=0; d<3; d++ ) elementCenters[3*i+d] = GetElementCenter( i, d );
+			}
+		});
 		Box box;
-		box.Init();
-		for ( unsigned int i=0; i<numElements; i++ ) {
-			Box b;
-			GetElementBounds(i,b.b);
-			box += b;
+		for ( unsigned int i=0; i<numElements; i++ ) box += elementBounds[i];
+
+		TempNode *tempRoot;
+		if ( splitMethod == SPLIT_SBVH ) {
+			tempRoot = BuildSpatialSplits( numElements, maxElementsPerNode, box );
+		} else {
+			if ( splitMethod == SPLIT_MORTON ) SortElementsByMortonCode( numElements );
+
+			// A binary tree with at most numElements leaf nodes cannot have more than 2*numElements-1 nodes,
+			// so all temporary nodes are allocated from a single array.
+			tempNodes = new TempNode[ 2*numElements ];
+			tempNodeCount = 0;
+			tempRoot = NewTempNode( numElements, 0, box );
+			unsigned int numThreads = std::thread::hardware_concurrency();
+			int parallelDepth = 0;
+			while ( (1u << parallelDepth) < numThreads ) parallelDepth++;
+			SplitTempNode( tempRoot, maxElementsPerNode, parallelDepth );
 		}
-		TempNode *tempRoot = new TempNode( numElements, 0, box );
-		SplitTempNode(tempRoot,maxElementsPerNode);
-		unsigned int numNodes = tempRoot->GetNumNodes();
-		nodes = new Node[ numNodes+1 ];
+
+		numNodes = tempNodeCount;
+		AllocateNodes( numNodes+1 );
 		ConvertTempData( 1, tempRoot, 2 );
-		delete tempRoot;
+
+		delete [] tempNodes;
+		tempNodes = 0;
+		delete [] elementBounds;
+		elementBounds = 0;
+		delete [] elementCenters;
+		elementCenters = 0;
+		if ( mortonCodes ) delete [] mortonCodes;
+		mortonCodes = 0;
 	}
 
 	/////////////////////////////////////////////////////////////////////////////////
@@ -152,6 +333,24 @@ protected:
 	virtual void  GetElementBounds(unsigned int i, float box[6] ) const=0;	//!< Sets box as the i^th element's bounding box.
 	virtual float GetElementCenter(unsigned int i, int dimension) const=0;	//!< Returns the center of the i^th element in the given dimension
 
+	//! Splits the bounding box (refBox) of a part of the i^th element at the given position along the given axis, used by SPLIT_SBVH.
+	//! The default implementation clips refBox at the plane. Sub-classes can compute tighter boxes using the element geometry.
+	//! A resulting box must be empty (min > max) if no part of the element is on that side.
+	virtual void SplitElementBounds(unsigned int i, float const refBox[6], int axis, float pos, float leftBox[6], float rightBox[6]) const
+	{
+		(void)i;
+		for ( int j=0; j<6; j++ ) leftBox[j] = rightBox[j] = refBox[j];
+		if ( leftBox [axis+3] > pos ) leftBox [axis+3] = pos;
+		if ( rightBox[axis  ] < pos ) rightBox[axis  ] = pos;
+	}
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//@ Cached element data that can be used while building the tree
+	/////////////////////////////////////////////////////////////////////////////////
+
+	float const * ElementBounds(unsigned int i) const { return elementBounds[i].b; }					//!< Returns the bounding box of the i^th element (only valid during Build).
+	float         ElementCenter(unsigned int i, int dimension) const { return elementCenters[3*i+dimension]; }	//!< Returns the center of the i^th element (only valid during Build).
+
 	/////////////////////////////////////////////////////////////////////////////////
 	//@ Building method that can be overloaded
 	/////////////////////////////////////////////////////////////////////////////////
@@ -160,10 +359,14 @@ protected:
 	//! such that first N elements are to be assigned to the first child and the 
 	//! remaining elements are to be assigned to the second child node, then returns N.
 	//! Returns zero, if the node is not to be split.
-	//! The default implementation splits the temporary node down the middle of the
-	//! widest axis of its bounding box.
+	//! It can be called from multiple threads at the same time for different nodes.
+	//! The default implementation uses the split method set by SetSplitMethod,
+	//! which splits the temporary node down the middle of the widest axis of its
+	//! bounding box unless the surface area heuristic is selected.
 	virtual unsigned int FindSplit( unsigned int elementCount, unsigned int *_elements, float const *box, unsigned int maxElementsPerNode )
 	{
+		if ( splitMethod == SPLIT_SAH    ) return SAHSplit   (elementCount,_elements,box,maxElementsPerNode);
+		if ( splitMethod == SPLIT_MORTON ) return MortonSplit(elementCount,_elements,box,maxElementsPerNode);
 		return MeanSplit(elementCount,_elements,box,maxElementsPerNode);
 	}
 
@@ -180,15 +383,19 @@ private:
 		float b[6];
 		Box() { Init(); }
 		Box( Box const &box ) { for(int i=0; i<6; i++) b[i]=box.b[i]; }
+		explicit Box( float const *bounds ) { for(int i=0; i<6; i++) b[i]=bounds[i]; }
+		Box & operator = ( Box const &box ) { for(int i=0; i<6; i++) b[i]=box.b[i]; return *this; }
 		void Init() { b[0]=b[1]=b[2]=1e30f; b[3]=b[4]=b[5]=-1e30f; }
 		void operator += ( Box const &box ) { for(int i=0; i<3; i++) { if(b[i]>box.b[i])b[i]=box.b[i]; if(b[i+3]<box.b[i+3])b[i+3]=box.b[i+3]; } }
 	};
 
-	class Node
+	//! Nodes are padded to 32 bytes, so that a pair of sibling nodes fills exactly one cache line.
+	class alignas(_CY_BVH_NODE_PAIR_ALIGNMENT/2) Node
 	{
 	public:
 		void SetLeafNode( Box const &bound, unsigned int elemCount, unsigned int elemOffset ) { box=bound; data=(elemOffset&_CY_BVH_ELEMENT_OFFSET_MASK)|((elemCount-1)<<_CY_BVH_ELEMENT_OFFSET_BITS)|_CY_BVH_LEAF_BIT_MASK; }
 		void SetInternalNode( Box const &bound, unsigned int chilIndex ) { box=bound; data=(chilIndex&_CY_BVH_CHILD_INDEX_MASK); }
+		void SetBounds( Box const &bound ) { box=bound; }
 		unsigned int  ChildIndex   () const { return (data&_CY_BVH_CHILD_INDEX_MASK); }									//!< returns the index to the first child (must be internal node)
 		unsigned int  ElementOffset() const { return (data&_CY_BVH_ELEMENT_OFFSET_MASK); }									//!< returns the offset to the first element (must be leaf node)
 		unsigned int  ElementCount () const { return ((data>>_CY_BVH_ELEMENT_OFFSET_BITS)&_CY_BVH_ELEMENT_COUNT_MASK)+1; }	//!< returns the number of elements in this node (must be leaf node)
@@ -199,32 +406,50 @@ private:
 		unsigned int data;	//!< node data bits that keep the leaf node flag and the child node index or element count and element offset.
 	};
 
-	Node         *nodes;	//!< the tree structure that keeps all the node data (nodeData[0] is not used for cache coherency)
-	unsigned int *elements;	//!< indices of all elements in all nodes
+	static_assert( sizeof(Node) == _CY_BVH_NODE_PAIR_ALIGNMENT/2, "A pair of sibling nodes must fill a cache line" );
+
+	Node         *nodes;		//!< the tree structure that keeps all the node data (nodeData[0] is not used for cache coherency)
+	unsigned int *elements;		//!< indices of all elements in all nodes
+	unsigned int  numNodes;		//!< the number of nodes in the tree (not including nodeData[0])
+	unsigned int  numElements;	//!< the number of elements in the tree
+	bool          ownsData;		//!< false if nodes and elements point to external data (see SetExternalData)
+	SplitMethod   splitMethod;	//!< the split method used by the default implementation of FindSplit
+	float         spatialSplitBudget;	//!< the maximum number of duplicated element references of SPLIT_SBVH as a fraction of the number of elements
 
 	/////////////////////////////////////////////////////////////////////////////////
 	//@ Internal methods for building the BVH tree
 	/////////////////////////////////////////////////////////////////////////////////
 
+	//! Allocates the node array, such that each pair of sibling nodes starts at a cache line.
+	void AllocateNodes( unsigned int count )
+	{
+		nodes = static_cast<Node*>( ::operator new[]( count*sizeof(Node), std::align_val_t(_CY_BVH_NODE_PAIR_ALIGNMENT) ) );
+		std::uninitialized_default_construct_n( nodes, count );
+	}
+
+	//! Frees the node array allocated by AllocateNodes.
+	void FreeNodes() { ::operator delete[]( nodes, std::align_val_t(_CY_BVH_NODE_PAIR_ALIGNMENT) ); }
+
+	//! Replaces the external data set by SetExternalData with a copy owned by the tree.
+	void CopyExternalData()
+	{
+		Node const *externalNodes = nodes;
+		unsigned int const *externalElements = elements;
+		AllocateNodes( numNodes+1 );
+		std::memcpy( static_cast<void*>(nodes), externalNodes, (numNodes+1)*sizeof(Node) );
+		elements = new unsigned int[ numElements ];
+		std::memcpy( elements, externalElements, numElements*sizeof(unsigned int) );
+		ownsData = true;
+	}
+
 	//! Temporary node class used for building the hierarchy and then converted to NodeData.
 	class TempNode
 	{
 	public:
-		TempNode( unsigned int count, unsigned int offset, Box const &boundBox) : child1(0), child2(0), elementCount(count), elementOffset(offset), box(boundBox) {}
-		~TempNode() { if ( child1 ) delete child1; if ( child2 ) delete child2; }
+		TempNode() : child1(0), child2(0), elementCount(0), elementOffset(0) {}
+		void Init( unsigned int count, unsigned int offset, Box const &boundBox ) { child1=0; child2=0; elementCount=count; elementOffset=offset; box=boundBox; }
 
-		void Split( unsigned int child1ElementCount, Box const &child1Box, Box const &child2Box )
-		{
-			child1 = new TempNode(child1ElementCount,elementOffset,child1Box);
-			child2 = new TempNode(ElementCount()-child1ElementCount,elementOffset+child1ElementCount,child2Box);
-		}
-		unsigned int GetNumNodes() const
-		{
-			unsigned int n = 1;
-			if ( child1 ) n += child1->GetNumNodes();
-			if ( child2 ) n += child2->GetNumNodes();
-			return n;
-		}
+		void SetChildren( TempNode *c1, TempNode *c2 ) { child1=c1; child2=c2; }
 		bool IsLeafNode() const { return child1==0; }
 		unsigned int ElementCount () const { return elementCount; }
 		unsigned int ElementOffset() const { return elementOffset; }
@@ -238,8 +463,53 @@ private:
 		unsigned int	elementOffset;
 	};
 
+	Box          *elementBounds;	//!< cached bounding boxes of the elements (only used during Build)
+	float        *elementCenters;	//!< cached centers of the elements (only used during Build)
+	uint64_t     *mortonCodes;		//!< sorted Morton codes of the elements in the order of the elements array (only used during Build with SPLIT_MORTON)
+	TempNode     *tempNodes;		//!< storage of all temporary nodes (only used during Build)
+	std::atomic<unsigned int> tempNodeCount;	//!< the number of temporary nodes used in tempNodes
+
+	//! Returns a new temporary node from the temporary node storage.
+	TempNode* NewTempNode( unsigned int count, unsigned int offset, Box const &boundBox )
+	{
+		TempNode *tNode = &tempNodes[ tempNodeCount++ ];
+		tNode->Init( count, offset, boundBox );
+		return tNode;
+	}
+
+	//! Returns the number of threads to be used for processing the given number of elements.
+	static unsigned int NumBuildThreads( unsigned int count )
+	{
+		unsigned int numThreads = std::thread::hardware_concurrency();
+		return ( numThreads <= 1 || count < CY_BVH_PARALLEL_BUILD_THRESHOLD ) ? 1 : numThreads;
+	}
+
+	//! Calls func(task) for all tasks in [0,numTasks), each on a separate thread.
+	template <typename FUNC>
+	static void ParallelTasks( unsigned int numTasks, FUNC func )
+	{
+		std::vector<std::thread> threads;
+		for ( unsigned int t=1; t<numTasks; t++ ) threads.emplace_back( func, t );
+		func( 0 );
+		for ( std::thread &t : threads ) t.join();
+	}
+
+	//! Calls func(begin,end) for disjoint ranges that cover [0,count) using multiple threads.
+	template <typename FUNC>
+	static void ParallelFor( unsigned int count, FUNC func )
+	{
+		unsigned int numThreads = NumBuildThreads( count );
+		unsigned int chunkSize = (count + numThreads - 1) / numThreads;
+		ParallelTasks( numThreads, [&]( unsigned int t ) {
+			unsigned int begin = t * chunkSize;
+			unsigned int end   = begin+chunkSize < count ? begin+chunkSize : count;
+			if ( begin < end ) func( begin, end );
+		});
+	}
+
 	//! Recursively splits the given temporary node.
-	void SplitTempNode(TempNode *tNode, unsigned int maxElementsPerNode)
+	//! While parallelDepth is positive, the first child of a large node is split on a new thread.
+	void SplitTempNode(TempNode *tNode, unsigned int maxElementsPerNode, int parallelDepth)
 	{
 		float const *box = tNode->GetBounds().b;
 		unsigned int *nodeElements = &elements[tNode->ElementOffset()];
@@ -260,34 +530,59 @@ private:
 		// Compute child bounding boxes
 		Box child1Box;
 		Box child2Box;
-		for ( unsigned int i=0; i<child1ElemCount; i++ ) {
-			Box eBox;
-			GetElementBounds( nodeElements[i], eBox.b );
-			child1Box += eBox;
-		}
-		for ( unsigned int i=child1ElemCount; i<tNode->ElementCount(); i++ ) {
-			Box eBox;
-			GetElementBounds( nodeElements[i], eBox.b );
-			child2Box += eBox;
-		}
+		for ( unsigned int i=0; i<child1ElemCount; i++ ) child1Box += elementBounds[ nodeElements[i] ];
+		for ( unsigned int i=child1ElemCount; i<tNode->ElementCount(); i++ ) child2Box += elementBounds[ nodeElements[i] ];
 
 		// Split recursively
-		tNode->Split( child1ElemCount, child1Box, child2Box );
-		SplitTempNode(tNode->GetChild1(),maxElementsPerNode);
-		SplitTempNode(tNode->GetChild2(),maxElementsPerNode);
+		TempNode *child1 = NewTempNode( child1ElemCount, tNode->ElementOffset(), child1Box );
+		TempNode *child2 = NewTempNode( tNode->ElementCount()-child1ElemCount, tNode->ElementOffset()+child1ElemCount, child2Box );
+		tNode->SetChildren( child1, child2 );
+		if ( parallelDepth > 0 && tNode->ElementCount() >= CY_BVH_PARALLEL_BUILD_THRESHOLD ) {
+			std::thread child1Thread( &BVH::SplitTempNode, this, child1, maxElementsPerNode, parallelDepth-1 );
+			SplitTempNode( child2, maxElementsPerNode, parallelDepth-1 );
+			child1Thread.join();
+		} else {
+			SplitTempNode( child1, maxElementsPerNode, 0 );
+			SplitTempNode( child2, maxElementsPerNode, 0 );
+		}
 	}
 
-	//! Recursively converts the temporary node data to NodeData.
+	//! Recursively converts the temporary node data to NodeData. Nodes are stored in treelets of up to
+	//! CY_BVH_TREELET_NODE_PAIRS sibling pairs, and child nodes always come after their parent.
 	unsigned int ConvertTempData( unsigned int nodeID, TempNode *tNode, unsigned int childIndex )
 	{
 		if ( tNode->IsLeafNode() ) {
 			nodes[nodeID].SetLeafNode( tNode->GetBounds(), tNode->ElementCount(), tNode->ElementOffset() );
 			return childIndex;
-		} else {
-			nodes[nodeID].SetInternalNode( tNode->GetBounds(), childIndex );
-			unsigned int newChildIndex = ConvertTempData( childIndex, tNode->GetChild1(), childIndex+2 );
-			return ConvertTempData( childIndex+1, tNode->GetChild2(), newChildIndex );
 		}
+
+		// The sibling pairs of the treelet below this node are placed next to each other. The treelet grows by
+		// expanding the internal node with the largest surface area, which is the most likely one to be visited.
+		struct TreeletNode { unsigned int nodeID; TempNode *tNode; float area; };
+		TreeletNode frontier[ CY_BVH_TREELET_NODE_PAIRS+1 ];
+		int frontierSize = 0;
+		frontier[ frontierSize++ ] = { nodeID, tNode, BoxArea(tNode->GetBounds().b) };
+		for ( int pairs=0; pairs<CY_BVH_TREELET_NODE_PAIRS && frontierSize>0; pairs++ ) {
+			int largest = 0;
+			for ( int i=1; i<frontierSize; i++ ) if ( frontier[i].area > frontier[largest].area ) largest = i;
+			TreeletNode expand = frontier[largest];
+			frontier[largest] = frontier[ --frontierSize ];
+
+			nodes[expand.nodeID].SetInternalNode( expand.tNode->GetBounds(), childIndex );
+			TempNode *children[2] = { expand.tNode->GetChild1(), expand.tNode->GetChild2() };
+			for ( int c=0; c<2; c++ ) {
+				if ( children[c]->IsLeafNode() ) {
+					nodes[childIndex+c].SetLeafNode( children[c]->GetBounds(), children[c]->ElementCount(), children[c]->ElementOffset() );
+				} else {
+					frontier[ frontierSize++ ] = { childIndex+c, children[c], BoxArea(children[c]->GetBounds().b) };
+				}
+			}
+			childIndex += 2;
+		}
+
+		// The internal nodes left on the frontier start their own treelets after this one
+		for ( int i=0; i<frontierSize; i++ ) childIndex = ConvertTempData( frontier[i].nodeID, frontier[i].tNode, childIndex );
+		return childIndex;
 	}
 
 	//! Called by the default implementation of FindSplit.
@@ -308,7 +603,7 @@ private:
 			float splitPos = 0.5f * ( box[splitDim] + box[splitDim+3] );
 			unsigned int i=0, j=elementCount;
 			while ( i<j ) {
-				float center = GetElementCenter( nodeElements[i], splitDim );
+				float center = ElementCenter( nodeElements[i], splitDim );
 				if ( center <= splitPos ) {
 					i++;
 				} else {
@@ -327,6 +622,460 @@ private:
 		return child1ElemCount;
 	}
 
+	//! Called by the default implementation of FindSplit after the elements are sorted by SortElementsByMortonCode.
+	//! Splits the elements at the highest bit that differs between the Morton codes of the first and the last element.
+	unsigned int MortonSplit(unsigned int elementCount, unsigned int *nodeElements, float const *, unsigned int maxElementsPerNode )
+	{
+		if ( elementCount <= maxElementsPerNode ) return 0;
+		uint64_t const *codes = &mortonCodes[ nodeElements - elements ];
+		uint64_t first = codes[0];
+		uint64_t last  = codes[elementCount-1];
+		if ( first == last ) return 0;	// identical codes are split in half by SplitTempNode, if necessary
+
+		// Binary search for the first element that has the highest differing bit set
+		uint64_t highBit = uint64_t(1) << (63 - std::countl_zero( first ^ last ));
+		unsigned int i=0, j=elementCount-1;
+		while ( i+1 < j ) {
+			unsigned int m = (i+j) / 2;
+			if ( codes[m] & highBit ) j=m; else i=m;
+		}
+		return j;
+	}
+
+	//! Spreads the lowest 21 bits of the given value, such that there are two zero bits between each bit.
+	static uint64_t MortonExpandBits( uint64_t v )
+	{
+		v &= 0x1fffff;
+		v = (v | v << 32) & 0x1f00000000ffffull;
+		v = (v | v << 16) & 0x1f0000ff0000ffull;
+		v = (v | v <<  8) & 0x100f00f00f00f00full;
+		v = (v | v <<  4) & 0x10c30c30c30c30c3ull;
+		v = (v | v <<  2) & 0x1249249249249249ull;
+		return v;
+	}
+
+	//! Computes the Morton codes of the element centers and sorts the elements by their codes using a parallel radix sort.
+	//! The codes use 10 bits per axis (30 bits in total) for up to CY_BVH_MORTON_30BIT_ELEMENT_LIMIT elements
+	//! and 21 bits per axis (63 bits in total) otherwise.
+	void SortElementsByMortonCode( unsigned int numElements )
+	{
+		float cmin[3] = {  1e30f,  1e30f,  1e30f };
+		float cmax[3] = { -1e30f, -1e30f, -1e30f };
+		for ( unsigned int i=0; i<numElements; i++ ) {
+			for ( int d=0; d<3; d++ ) {
+				float c = ElementCenter( i, d );
+				if ( cmin[d] > c ) cmin[d] = c;
+				if ( cmax[d] < c ) cmax[d] = c;
+			}
+		}
+		int bitsPerAxis = numElements > CY_BVH_MORTON_30BIT_ELEMENT_LIMIT ? 21 : 10;
+		float maxCell = float( (1u << bitsPerAxis) - 1 );
+		float scale[3];
+		for ( int d=0; d<3; d++ ) scale[d] = cmax[d] > cmin[d] ? maxCell / (cmax[d] - cmin[d]) : 0;
+
+		mortonCodes = new uint64_t[numElements];
+		ParallelFor( numElements, [&]( unsigned int begin, unsigned int end ) {
+			for ( unsigned int i=begin; i<end; i++ ) {
+				uint64_t code = 0;
+				for ( int d=0; d<3; d++ ) {
+					float q = ( ElementCenter( elements[i], d ) - cmin[d] ) * scale[d];
+					uint64_t cell = q <= 0 ? 0 : ( q >= maxCell ? uint64_t(maxCell) : uint64_t(q) );
+					code |= MortonExpandBits( cell ) << (2-d);
+				}
+				mortonCodes[i] = code;
+			}
+		});
+
+		// Least significant digit radix sort with 8-bit digits. Each thread counts and scatters its own chunk,
+		// so the sort is stable and its result does not depend on the number of threads.
+		unsigned int numThreads = NumBuildThreads( numElements );
+		unsigned int chunkSize  = (numElements + numThreads - 1) / numThreads;
+		uint64_t     *tempCodes    = new uint64_t[numElements];
+		unsigned int *tempElements = new unsigned int[numElements];
+		std::vector<unsigned int> offsets( numThreads*256 );
+		for ( int shift=0; shift<3*bitsPerAxis; shift+=8 ) {
+			ParallelTasks( numThreads, [&]( unsigned int t ) {
+				unsigned int *count = &offsets[t*256];
+				for ( int k=0; k<256; k++ ) count[k] = 0;
+				unsigned int end = (t+1)*chunkSize < numElements ? (t+1)*chunkSize : numElements;
+				for ( unsigned int i=t*chunkSize; i<end; i++ ) count[ (mortonCodes[i] >> shift) & 0xff ]++;
+			});
+			unsigned int sum = 0;
+			for ( int k=0; k<256; k++ ) {
+				for ( unsigned int t=0; t<numThreads; t++ ) {
+					unsigned int c = offsets[t*256+k];
+					offsets[t*256+k] = sum;
+					sum += c;
+				}
+			}
+			ParallelTasks( numThreads, [&]( unsigned int t ) {
+				unsigned int *offset = &offsets[t*256];
+				unsigned int end = (t+1)*chunkSize < numElements ? (t+1)*chunkSize : numElements;
+				for ( unsigned int i=t*chunkSize; i<end; i++ ) {
+					unsigned int pos = offset[ (mortonCodes[i] >> shift) & 0xff ]++;
+					tempCodes   [pos] = mortonCodes[i];
+					tempElements[pos] = elements[i];
+				}
+			});
+			uint64_t     *c = mortonCodes; mortonCodes = tempCodes;    tempCodes    = c;
+			unsigned int *e = elements;    elements    = tempElements; tempElements = e;
+		}
+		delete [] tempCodes;
+		delete [] tempElements;
+	}
+
+	//! Returns the surface area of the given bounding box.
+	static float BoxArea( float const *box )
+	{
+		float d[3] = { box[3]-box[0], box[4]-box[1], box[5]-box[2] };
+		return 2 * ( d[0]*d[1] + d[1]*d[2] + d[2]*d[0] );
+	}
+
+	//! Called by the default implementation of FindSplit.
+	//! Splits the elements using a binned surface area heuristic over the element centers.
+	//! Returns zero if keeping the elements in a single leaf node is cheaper than the best
+	//! split and the number of elements does not exceed maxElementsPerNode.
+	unsigned int SAHSplit(unsigned int elementCount, unsigned int *nodeElements, float const *box, unsigned int maxElementsPerNode )
+	{
+		if ( elementCount <= 1 ) return 0;
+
+		// Compute the bounding box of the element centers
+		float cmin[3] = {  1e30f,  1e30f,  1e30f };
+		float cmax[3] = { -1e30f, -1e30f, -1e30f };
+		for ( unsigned int i=0; i<elementCount; i++ ) {
+			for ( int d=0; d<3; d++ ) {
+				float c = ElementCenter( nodeElements[i], d );
+				if ( cmin[d] > c ) cmin[d] = c;
+				if ( cmax[d] < c ) cmax[d] = c;
+			}
+		}
+		float binScale[3];
+		for ( int d=0; d<3; d++ ) binScale[d] = cmax[d] > cmin[d] ? CY_BVH_SAH_BIN_COUNT / (cmax[d] - cmin[d]) : 0;
+
+		// Fill the bins of all three axes in a single pass over the elements
+		Box          binBox  [3][CY_BVH_SAH_BIN_COUNT];
+		unsigned int binCount[3][CY_BVH_SAH_BIN_COUNT] = {};
+		for ( unsigned int i=0; i<elementCount; i++ ) {
+			Box const &eBox = elementBounds[ nodeElements[i] ];
+			for ( int d=0; d<3; d++ ) {
+				if ( binScale[d] == 0 ) continue;
+				int b = SAHBinIndex( ElementCenter( nodeElements[i], d ), cmin[d], binScale[d] );
+				binBox  [d][b] += eBox;
+				binCount[d][b]++;
+			}
+		}
+
+		// Sweep the bins and find the cheapest split plane.
+		// The costs are scaled by the surface area of the node to avoid divisions.
+		float bestCost = 1e30f;
+		int   bestDim  = -1;
+		int   bestBin  = 0;
+		for ( int d=0; d<3; d++ ) {
+			if ( binScale[d] == 0 ) continue;
+			float        rightArea [CY_BVH_SAH_BIN_COUNT];
+			unsigned int rightCount[CY_BVH_SAH_BIN_COUNT];
+			Box          acc;
+			unsigned int n = 0;
+			for ( int b=CY_BVH_SAH_BIN_COUNT-1; b>0; b-- ) {
+				acc += binBox[d][b];
+				n   += binCount[d][b];
+				rightArea [b] = BoxArea( acc.b );
+				rightCount[b] = n;
+			}
+			acc.Init();
+			n = 0;
+			for ( int b=0; b<CY_BVH_SAH_BIN_COUNT-1; b++ ) {
+				acc += binBox[d][b];
+				n   += binCount[d][b];
+				if ( n == 0 || rightCount[b+1] == 0 ) continue;
+				float cost = n * BoxArea( acc.b ) + rightCount[b+1] * rightArea[b+1];
+				if ( cost < bestCost ) {
+					bestCost = cost;
+					bestDim  = d;
+					bestBin  = b;
+				}
+			}
+		}
+		if ( bestDim < 0 ) return 0;
+
+		float nodeArea  = BoxArea( box );
+		float splitCost = CY_BVH_SAH_TRAVERSAL_COST * nodeArea + CY_BVH_SAH_INTERSECTION_COST * bestCost;
+		float leafCost  = CY_BVH_SAH_INTERSECTION_COST * elementCount * nodeArea;
+		if ( elementCount <= maxElementsPerNode && leafCost <= splitCost ) return 0;
+
+		// Partition the elements using the selected bin boundary
+		unsigned int i=0, j=elementCount;
+		while ( i<j ) {
+			int b = SAHBinIndex( ElementCenter( nodeElements[i], bestDim ), cmin[bestDim], binScale[bestDim] );
+			if ( b <= bestBin ) {
+				i++;
+			} else {
+				j--;
+				unsigned int t = nodeElements[i];
+				nodeElements[i] = nodeElements[j];
+				nodeElements[j] = t;
+			}
+		}
+		return i;
+	}
+
+	//! A part of an element used by SPLIT_SBVH. Spatial splits can divide an element into multiple references.
+	struct Reference
+	{
+		unsigned int element;
+		Box          box;
+	};
+
+	//! Builds the temporary nodes using SPLIT_SBVH and replaces the elements array with the element references of the leaf nodes.
+	TempNode* BuildSpatialSplits( unsigned int numElements, unsigned int maxElementsPerNode, Box const &box )
+	{
+		unsigned int budget = (unsigned int)( spatialSplitBudget * numElements );
+		std::vector<Reference> refs( numElements );
+		for ( unsigned int i=0; i<numElements; i++ ) {
+			refs[i].element = i;
+			refs[i].box     = elementBounds[i];
+		}
+
+		unsigned int maxReferences = numElements + budget;
+		tempNodes = new TempNode[ 2*maxReferences ];
+		tempNodeCount = 0;
+		std::vector<unsigned int> leafElements;
+		leafElements.reserve( maxReferences );
+		TempNode *tempRoot = NewTempNode( numElements, 0, box );
+		SplitSpatialNode( tempRoot, refs, maxElementsPerNode, BoxArea(box.b), budget, leafElements );
+
+		delete [] elements;
+		this->numElements = (unsigned int) leafElements.size();
+		elements = new unsigned int[ this->numElements ];
+		for ( unsigned int i=0; i<this->numElements; i++ ) elements[i] = leafElements[i];
+		return tempRoot;
+	}
+
+	//! The best object or spatial split found by SplitSpatialNode.
+	struct SpatialSplitCandidate
+	{
+		float cost = 1e30f;	//!< sum of the child surface areas weighted by their reference counts
+		int   dim  = -1;
+		float pos  = 0;		//!< split position of spatial splits
+		int   bin  = 0;		//!< last bin of the first child of object splits
+		float binMin = 0, binScale = 0;
+		Box   box1, box2;
+		unsigned int duplicates = 0;
+	};
+
+	//! Finds the best binned SAH object split of the references using their centers.
+	static void FindObjectSplit( std::vector<Reference> const &refs, SpatialSplitCandidate &split )
+	{
+		float cmin[3] = {  1e30f,  1e30f,  1e30f };
+		float cmax[3] = { -1e30f, -1e30f, -1e30f };
+		for ( Reference const &r : refs ) {
+			for ( int d=0; d<3; d++ ) {
+				float c = 0.5f * ( r.box.b[d] + r.box.b[d+3] );
+				if ( cmin[d] > c ) cmin[d] = c;
+				if ( cmax[d] < c ) cmax[d] = c;
+			}
+		}
+		for ( int d=0; d<3; d++ ) {
+			if ( cmax[d] <= cmin[d] ) continue;
+			float binScale = CY_BVH_SAH_BIN_COUNT / (cmax[d] - cmin[d]);
+			Box          binBox  [CY_BVH_SAH_BIN_COUNT];
+			unsigned int binCount[CY_BVH_SAH_BIN_COUNT] = {};
+			for ( Reference const &r : refs ) {
+				int b = SAHBinIndex( 0.5f * ( r.box.b[d] + r.box.b[d+3] ), cmin[d], binScale );
+				binBox  [b] += r.box;
+				binCount[b]++;
+			}
+			Box          rightBox  [CY_BVH_SAH_BIN_COUNT];
+			unsigned int rightCount[CY_BVH_SAH_BIN_COUNT];
+			Box          acc;
+			unsigned int n = 0;
+			for ( int b=CY_BVH_SAH_BIN_COUNT-1; b>0; b-- ) {
+				acc += binBox[b];
+				n   += binCount[b];
+				rightBox  [b] = acc;
+				rightCount[b] = n;
+			}
+			acc.Init();
+			n = 0;
+			for ( int b=0; b<CY_BVH_SAH_BIN_COUNT-1; b++ ) {
+				acc += binBox[b];
+				n   += binCount[b];
+				if ( n == 0 || rightCount[b+1] == 0 ) continue;
+				float cost = n * BoxArea( acc.b ) + rightCount[b+1] * BoxArea( rightBox[b+1].b );
+				if ( cost < split.cost ) {
+					split.cost     = cost;
+					split.dim      = d;
+					split.bin      = b;
+					split.binMin   = cmin[d];
+					split.binScale = binScale;
+					split.box1     = acc;
+					split.box2     = rightBox[b+1];
+				}
+			}
+		}
+	}
+
+	//! Finds the best binned SAH spatial split of the references, where references that straddle a bin boundary are split at it.
+	void FindSpatialSplit( std::vector<Reference> const &refs, Box const &nodeBox, SpatialSplitCandidate &split ) const
+	{
+		for ( int d=0; d<3; d++ ) {
+			float binMin = nodeBox.b[d];
+			float extent = nodeBox.b[d+3] - binMin;
+			if ( extent <= 0 ) continue;
+			float binScale = CY_BVH_SAH_BIN_COUNT / extent;
+			float binSize  = extent / CY_BVH_SAH_BIN_COUNT;
+
+			Box          binBox    [CY_BVH_SAH_BIN_COUNT];
+			unsigned int entryCount[CY_BVH_SAH_BIN_COUNT] = {};
+			unsigned int exitCount [CY_BVH_SAH_BIN_COUNT] = {};
+			for ( Reference const &r : refs ) {
+				int first = SAHBinIndex( r.box.b[d  ], binMin, binScale );
+				int last  = SAHBinIndex( r.box.b[d+3], binMin, binScale );
+				entryCount[first]++;
+				exitCount [last ]++;
+				Box part = r.box;
+				for ( int b=first; b<last; b++ ) {
+					Box left, right;
+					SplitElementBounds( r.element, part.b, d, binMin + (b+1)*binSize, left.b, right.b );
+					binBox[b] += left;
+					part = right;
+				}
+				binBox[last] += part;
+			}
+
+			Box          rightBox  [CY_BVH_SAH_BIN_COUNT];
+			unsigned int rightCount[CY_BVH_SAH_BIN_COUNT];
+			Box          acc;
+			unsigned int n = 0;
+			for ( int b=CY_BVH_SAH_BIN_COUNT-1; b>0; b-- ) {
+				acc += binBox[b];
+				n   += exitCount[b];
+				rightBox  [b] = acc;
+				rightCount[b] = n;
+			}
+			acc.Init();
+			n = 0;
+			for ( int b=0; b<CY_BVH_SAH_BIN_COUNT-1; b++ ) {
+				acc += binBox[b];
+				n   += entryCount[b];
+				if ( n == 0 || rightCount[b+1] == 0 ) continue;
+				float cost = n * BoxArea( acc.b ) + rightCount[b+1] * BoxArea( rightBox[b+1].b );
+				if ( cost < split.cost ) {
+					split.cost       = cost;
+					split.dim        = d;
+					split.pos        = binMin + (b+1)*binSize;
+					split.box1       = acc;
+					split.box2       = rightBox[b+1];
+					split.duplicates = n + rightCount[b+1] - (unsigned int) refs.size();
+				}
+			}
+		}
+	}
+
+	//! Recursively splits the given temporary node using SPLIT_SBVH. The references of leaf nodes are appended to leafElements.
+	void SplitSpatialNode( TempNode *tNode, std::vector<Reference> &refs, unsigned int maxElementsPerNode, float rootArea, unsigned int &budget, std::vector<unsigned int> &leafElements )
+	{
+		unsigned int count = (unsigned int) refs.size();
+		Box const &nodeBox = tNode->GetBounds();
+
+		SpatialSplitCandidate objectSplit;
+		if ( count > 1 ) FindObjectSplit( refs, objectSplit );
+
+		// Try spatial splits only if the children of the object split overlap significantly
+		SpatialSplitCandidate spatialSplit;
+		if ( budget > 0 && count > 1 ) {
+			float overlap = 0;
+			if ( objectSplit.dim >= 0 ) {
+				Box const &b1 = objectSplit.box1;
+				Box const &b2 = objectSplit.box2;
+				float d[3];
+				for ( int i=0; i<3; i++ ) {
+					float lo = b1.b[i]   > b2.b[i]   ? b1.b[i]   : b2.b[i];
+					float hi = b1.b[i+3] < b2.b[i+3] ? b1.b[i+3] : b2.b[i+3];
+					d[i] = hi - lo;
+				}
+				if ( d[0] > 0 && d[1] > 0 && d[2] > 0 ) overlap = 2 * ( d[0]*d[1] + d[1]*d[2] + d[2]*d[0] );
+			}
+			if ( objectSplit.dim < 0 || overlap > CY_BVH_SBVH_OVERLAP_THRESHOLD * rootArea ) {
+				FindSpatialSplit( refs, nodeBox, spatialSplit );
+				if ( spatialSplit.duplicates > budget ) spatialSplit.dim = -1;
+			}
+		}
+		bool useSpatial = spatialSplit.dim >= 0 && spatialSplit.cost < objectSplit.cost;
+		float bestCost  = useSpatial ? spatialSplit.cost : objectSplit.cost;
+
+		float nodeArea  = BoxArea( nodeBox.b );
+		float splitCost = CY_BVH_SAH_TRAVERSAL_COST * nodeArea + CY_BVH_SAH_INTERSECTION_COST * bestCost;
+		float leafCost  = CY_BVH_SAH_INTERSECTION_COST * count * nodeArea;
+		bool  noSplit   = !useSpatial && objectSplit.dim < 0;
+		if ( count <= CY_BVH_MAX_ELEMENT_COUNT && ( noSplit || ( count <= maxElementsPerNode && leafCost <= splitCost ) ) ) {
+			tNode->Init( count, (unsigned int) leafElements.size(), nodeBox );
+			for ( Reference const &r : refs ) leafElements.push_back( r.element );
+			return;
+		}
+
+		std::vector<Reference> refs1, refs2;
+		if ( useSpatial ) {
+			int d = spatialSplit.dim;
+			float pos = spatialSplit.pos;
+			for ( Reference const &r : refs ) {
+				if ( r.box.b[d+3] <= pos ) refs1.push_back( r );
+				else if ( r.box.b[d] >= pos ) refs2.push_back( r );
+				else {
+					Reference left, right;
+					left.element = right.element = r.element;
+					SplitElementBounds( r.element, r.box.b, d, pos, left.box.b, right.box.b );
+					bool hasLeft  = left .box.b[d] <= left .box.b[d+3];
+					bool hasRight = right.box.b[d] <= right.box.b[d+3];
+					if ( hasLeft == hasRight && ( budget == 0 || !hasLeft ) ) {
+						// The binning can underestimate the duplicates near bin boundaries, so never exceed the budget.
+						// Also keep the reference whole if numerical issues leave it with no part on either side.
+						if ( r.box.b[d] + r.box.b[d+3] < 2*pos ) refs1.push_back( r ); else refs2.push_back( r );
+						continue;
+					}
+					if ( hasLeft  ) refs1.push_back( left  );
+					if ( hasRight ) refs2.push_back( right );
+					if ( hasLeft && hasRight ) budget--;
+				}
+			}
+			if ( refs1.empty() || refs2.empty() ) {
+				// The spatial split did not separate the references, so fall back to the other options
+				refs1.clear();
+				refs2.clear();
+				useSpatial = false;
+			}
+		}
+		if ( !useSpatial ) {
+			if ( objectSplit.dim >= 0 ) {
+				for ( Reference const &r : refs ) {
+					int b = SAHBinIndex( 0.5f * ( r.box.b[objectSplit.dim] + r.box.b[objectSplit.dim+3] ), objectSplit.binMin, objectSplit.binScale );
+					if ( b <= objectSplit.bin ) refs1.push_back( r ); else refs2.push_back( r );
+				}
+			} else {
+				// we split in half arbitrarily.
+				refs1.assign( refs.begin(), refs.begin() + count/2 );
+				refs2.assign( refs.begin() + count/2, refs.end() );
+			}
+		}
+		std::vector<Reference>().swap( refs );	// release the memory before recursion
+
+		Box child1Box, child2Box;
+		for ( Reference const &r : refs1 ) child1Box += r.box;
+		for ( Reference const &r : refs2 ) child2Box += r.box;
+		TempNode *child1 = NewTempNode( (unsigned int) refs1.size(), 0, child1Box );
+		TempNode *child2 = NewTempNode( (unsigned int) refs2.size(), 0, child2Box );
+		tNode->SetChildren( child1, child2 );
+		SplitSpatialNode( child1, refs1, maxElementsPerNode, rootArea, budget, leafElements );
+		SplitSpatialNode( child2, refs2, maxElementsPerNode, rootArea, budget, leafElements );
+	}
+
+	//! Returns the bin of the given element center used by SAHSplit.
+	static int SAHBinIndex( float center, float binMin, float binScale )
+	{
+		int b = (int)( (center - binMin) * binScale );
+		return b < 0 ? 0 : ( b >= CY_BVH_SAH_BIN_COUNT ? CY_BVH_SAH_BIN_COUNT-1 : b );
+	}
+
 	/////////////////////////////////////////////////////////////////////////////////
 };
 
@@ -351,6 +1100,9 @@ public:
 		Build(mesh->NF(),maxElementsPerNode);
 	}
 
+	//! Sets the mesh pointer without building the BVH structure, which is used when the tree data is set by SetExternalData.
+	void SetMeshPointer( TriMesh const *m ) { mesh = m; }
+
 protected:
 	//! Sets box as the i^th element's bounding box.
 	virtual void GetElementBounds(unsigned int i, float box[6]) const
@@ -374,6 +1126,43 @@ protected:
 		return ( mesh->V(f.v[0])[dim] + mesh->V(f.v[1])[dim] + mesh->V(f.v[2])[dim] ) / 3.0f;
 	}
 
+	//! Splits the bounding box of a part of the i^th triangle using the triangle edges that cross the split plane.
+	virtual void SplitElementBounds(unsigned int i, float const refBox[6], int axis, float pos, float leftBox[6], float rightBox[6]) const
+	{
+		for ( int k=0; k<3; k++ ) {
+			leftBox [k] = rightBox[k]   =  1e30f;
+			leftBox [k+3] = rightBox[k+3] = -1e30f;
+		}
+		auto grow = []( float box[6], cyVec3f const &p ) {
+			for ( int k=0; k<3; k++ ) {
+				if ( box[k] > p[k] ) box[k] = p[k];
+				if ( box[k+3] < p[k] ) box[k+3] = p[k];
+			}
+		};
+		TriMesh::TriFace const &f = mesh->F(i);
+		for ( int j=0; j<3; j++ ) {
+			cyVec3f p = mesh->V( f.v[j] );
+			cyVec3f q = mesh->V( f.v[(j+1)%3] );
+			if ( p[axis] <= pos ) grow( leftBox,  p );
+			if ( p[axis] >= pos ) grow( rightBox, p );
+			if ( ( p[axis] < pos && q[axis] > pos ) || ( p[axis] > pos && q[axis] < pos ) ) {
+				cyVec3f x = p + ( q - p ) * ( ( pos - p[axis] ) / ( q[axis] - p[axis] ) );
+				x[axis] = pos;
+				grow( leftBox,  x );
+				grow( rightBox, x );
+			}
+		}
+		// The part of the triangle is also bounded by the box of the reference
+		for ( int k=0; k<3; k++ ) {
+			if ( leftBox [k] < refBox[k] ) leftBox [k] = refBox[k];
+			if ( rightBox[k] < refBox[k] ) rightBox[k] = refBox[k];
+			if ( leftBox [k+3] > refBox[k+3] ) leftBox [k+3] = refBox[k+3];
+			if ( rightBox[k+3] > refBox[k+3] ) rightBox[k+3] = refBox[k+3];
+		}
+		if ( leftBox [axis+3] > pos ) leftBox [axis+3] = pos;
+		if ( rightBox[axis  ] < pos ) rightBox[axis  ] = pos;
+	}
+
 private:
 	TriMesh const *mesh;
 };
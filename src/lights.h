@@ -127,6 +127,16 @@ public:
 	void  Load( Loader const &loader ) override;
 
 	bool IntersectRay( Ray const &ray, HitInfo &hInfo, int hitSide=HIT_FRONT ) const override 
+    {
+        RayHit hit{};
+        if (!IntersectRayHit(ray, hit, hitSide))
+            return false;
+
+        SetHitInfo(ray, hit, hInfo);
+        return true;
+    }
+
+    bool IntersectRayHit( Ray const &ray, RayHit &hit, int hitSide=HIT_FRONT ) const override
     {
         const Ray localRay{ (ray.p - position) / size, ray.dir / size };
         const float a{ localRay.dir.Dot(localRay.dir) };
@@ -134,70 +144,47 @@ public:
         const float c{ localRay.p.Dot(localRay.p) - 1.0f };
 
         const float discriminant{ b*b - 4*a*c };
-        if (discriminant < 0.0f) return hitSide == HIT_NONE;
+        if (discriminant < 0.0f) return false;
 
         const float discriminantSquareRoot{ sqrtf(discriminant) };
         const float inverse2A{ 1.0f / (2.0f * a) };
         const float t1{ (-b - discriminantSquareRoot) * inverse2A };
+        const float t2{ (-b + discriminantSquareRoot) * inverse2A };
 
-        if (hitSide == HIT_FRONT)
+        // The near intersection is on the front, and the far one on the back when the ray starts inside
+        float t;
+        bool front;
+        if (t1 > 0.0f && (hitSide & HIT_FRONT))
         {
-            if (t1 <= 0.0f)
-                return false;
-
-            hInfo.z = t1;
-            hInfo.p = localRay.p + localRay.dir * t1;
-            hInfo.N = hInfo.p;
-            hInfo.front = true;
-            hInfo.light = true;
-
-            return true;
-
+            t = t1;
+            front = true;
         }
-
-        const float t2{ (-b + discriminantSquareRoot) * inverse2A };
-        if (hitSide == HIT_BACK)
+        else if (t1 <= 0.0f && t2 >= 0.0f && (hitSide & HIT_BACK))
         {
-            if (t1 > 0.0f || t2 < 0.0f)
-                return false;
-
-            hInfo.z = t2;
-            hInfo.p = localRay.p + localRay.dir * t2;
-            hInfo.N = hInfo.p;
-            hInfo.front = false;
-            hInfo.light = true;
-
-            return true;
+            t = t2;
+            front = false;
         }
+        else
+            return false;
 
+        if (t >= hit.z) return false;
 
-        if (hitSide == HIT_FRONT_AND_BACK)
-        {
-            if (t1 < 0.0f && t2 < 0.0f)
-                return false;
-
-            if (t1 > 0.0f)
-            {
-                hInfo.z = t1;
-                hInfo.p = localRay.p + localRay.dir * t1;
-                hInfo.N = hInfo.p;
-
-                hInfo.front = true;
-            }
-            else
-            {
-                hInfo.z = t2;
-                hInfo.p = localRay.p + localRay.dir * t2;
-                hInfo.N = hInfo.p;
-
-                hInfo.front = false;
-            }
-
-            hInfo.light = true;
-            return true;
-        }
+        hit.z = t;
+        hit.primID = 0;
+        hit.front = front;
+        return true;
+    }
 
-        return false;
+    // The hit point and normal are in the coordinates of the light, scaled to a unit sphere
+    void SetHitInfo( Ray const &ray, RayHit const &hit, HitInfo &hInfo ) const override
+    {
+        const Ray localRay{ (ray.p - position) / size, ray.dir / size };
+        hInfo.z = hit.z;
+        hInfo.p = localRay.p + localRay.dir * hit.z;
+        hInfo.N = hInfo.p;
+        hInfo.front = hit.front;
+        hInfo.light = true;
+        hInfo.lightSource = this;
     }
 
     bool IntersectShadowRay( Ray const &localRay, float t_max ) const override { return false; }
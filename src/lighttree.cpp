@@ -0,0 +1,198 @@
+#include "lighttree.h"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+namespace
+{
+    Vec3f boxCenter(const Box& box)
+    {
+        return 0.5f * (box.pmin + box.pmax);
+    }
+}
+
+void LightTree::Build(const LightList& sceneLights)
+{
+    nodes.clear();
+    lights.clear();
+    lightLeaves.clear();
+    lightIndex.clear();
+    infiniteLights.clear();
+    infinitePowers.clear();
+    infinitePower = 0.0f;
+
+    std::vector<Box> boxes;
+    std::vector<float> powers;
+    for (const Light* light : sceneLights)
+    {
+        if (light->IsAmbient()) continue;
+
+        const Box box{ light->GetBoundBox() };
+        const float power{ light->Intensity().Gray() };
+        if (!(power > 0.0f)) continue;
+        if (box.IsEmpty())
+        {
+            infiniteLights.push_back(light);
+            infinitePowers.push_back(power);
+            infinitePower += power;
+            continue;
+        }
+
+        lightIndex[light] = static_cast<unsigned int>(lights.size());
+        lights.push_back(light);
+        boxes.push_back(box);
+        powers.push_back(power);
+    }
+    if (lights.empty()) return;
+
+    const unsigned int count{ static_cast<unsigned int>(lights.size()) };
+    std::vector<unsigned int> lightIDs(count);
+    std::iota(lightIDs.begin(), lightIDs.end(), 0u);
+    lightLeaves.resize(count);
+    nodes.reserve(2 * count - 1);
+    nodes.emplace_back();
+    build(0, lightIDs.data(), count, boxes, powers);
+}
+
+void LightTree::build(unsigned int nodeID, unsigned int* lightIDs, unsigned int count, const std::vector<Box>& boxes, const std::vector<float>& powers)
+{
+    Box bounds;
+    Box centers;
+    float power{ 0.0f };
+    for (unsigned int i{ 0 }; i < count; ++i)
+    {
+        bounds += boxes[lightIDs[i]];
+        centers += boxCenter(boxes[lightIDs[i]]);
+        power += powers[lightIDs[i]];
+    }
+    nodes[nodeID].bounds = bounds;
+    nodes[nodeID].power = power;
+
+    if (count == 1)
+    {
+        nodes[nodeID].leaf = true;
+        nodes[nodeID].child = lightIDs[0];
+        lightLeaves[lightIDs[0]] = nodeID;
+        return;
+    }
+
+    // Median split along the longest axis of the light centers
+    const Vec3f extent{ centers.pmax - centers.pmin };
+    const int axis{ extent.x >= extent.y && extent.x >= extent.z ? 0 : extent.y >= extent.z ? 1 : 2 };
+    const unsigned int half{ count / 2 };
+    std::nth_element(lightIDs, lightIDs + half, lightIDs + count, [&](unsigned int a, unsigned int b)
+    {
+        return boxCenter(boxes[a])[axis] < boxCenter(boxes[b])[axis];
+    });
+
+    const unsigned int child{ static_cast<unsigned int>(nodes.size()) };
+    nodes.emplace_back();
+    nodes.emplace_back();
+    nodes[nodeID].child = child;
+    nodes[child].parent = nodeID;
+    nodes[child + 1].parent = nodeID;
+    build(child, lightIDs, half, boxes, powers);
+    build(child + 1, lightIDs + half, count - half, boxes, powers);
+}
+
+float LightTree::importance(const Node& node, const Vec3f& p, const Vec3f& N) const
+{
+    // The box is bounded by a sphere, which is seen from p within a cone around the direction to its center.
+    // The smallest angle between N and that cone bounds the cosine of every light in the box.
+    const Vec3f toCenter{ boxCenter(node.bounds) - p };
+    const float distSquared{ toCenter.LengthSquared() };
+    const float radiusSquared{ 0.25f * (node.bounds.pmax - node.bounds.pmin).LengthSquared() };
+
+    float cosBound{ 1.0f };
+    if (distSquared > radiusSquared)
+    {
+        const float sinCone{ std::sqrt(radiusSquared / distSquared) };
+        const float cosCone{ std::sqrt(1.0f - sinCone * sinCone) };
+        const float cosTheta{ N.Dot(toCenter) / std::sqrt(distSquared) };
+        if (cosTheta < cosCone)
+        {
+            const float sinTheta{ std::sqrt(std::max(0.0f, 1.0f - cosTheta * cosTheta)) };
+            cosBound = std::max(0.0f, cosTheta * cosCone + sinTheta * sinCone);
+        }
+    }
+
+    return node.power * cosBound / std::max({ distSquared, radiusSquared, 1e-8f });
+}
+
+float LightTree::treeProbability() const
+{
+    if (nodes.empty()) return 0.0f;
+    return nodes[0].power / (nodes[0].power + infinitePower);
+}
+
+const Light* LightTree::Sample(const Vec3f& p, const Vec3f& N, float u, float& prob) const
+{
+    if (IsEmpty()) return nullptr;
+
+    // u picks the tree or the infinite lights, then a child at every level, and is rescaled to [0,1) within the range of each choice
+    const float probTree{ treeProbability() };
+    if (!(u < probTree))
+    {
+        u = (u - probTree) / (1.0f - probTree) * infinitePower;
+        size_t i{ 0 };
+        while (i + 1 < infiniteLights.size() && u >= infinitePowers[i])
+            u -= infinitePowers[i++];
+        prob = (1.0f - probTree) * infinitePowers[i] / infinitePower;
+        return infiniteLights[i];
+    }
+
+    u = std::min(u / probTree, 0x1.fffffep-1f);
+    prob = probTree;
+    unsigned int nodeID{ 0 };
+    while (!nodes[nodeID].leaf)
+    {
+        const unsigned int child{ nodes[nodeID].child };
+        const float importance0{ importance(nodes[child], p, N) };
+        const float importance1{ importance(nodes[child + 1], p, N) };
+        const float total{ importance0 + importance1 };
+        if (!(total > 0.0f)) return nullptr;
+
+        const float prob0{ importance0 / total };
+        if (u < prob0)
+        {
+            u /= prob0;
+            prob *= prob0;
+            nodeID = child;
+        }
+        else
+        {
+            u = (u - prob0) / (1.0f - prob0);
+            prob *= 1.0f - prob0;
+            nodeID = child + 1;
+        }
+        u = std::min(u, 0x1.fffffep-1f);
+    }
+
+    return lights[nodes[nodeID].child];
+}
+
+float LightTree::Probability(const Light* light, const Vec3f& p, const Vec3f& N) const
+{
+    const auto found{ lightIndex.find(light) };
+    if (found == lightIndex.end())
+    {
+        const auto infinite{ std::find(infiniteLights.begin(), infiniteLights.end(), light) };
+        if (infinite == infiniteLights.end()) return 0.0f;
+        return (1.0f - treeProbability()) * infinitePowers[infinite - infiniteLights.begin()] / infinitePower;
+    }
+
+    // The choices of Sample from the leaf of the light up to the root
+    float prob{ treeProbability() };
+    for (unsigned int nodeID{ lightLeaves[found->second] }; nodeID != 0; nodeID = nodes[nodeID].parent)
+    {
+        const unsigned int child{ nodes[nodes[nodeID].parent].child };
+        const unsigned int sibling{ nodeID == child ? child + 1 : child };
+        const float importanceNode{ importance(nodes[nodeID], p, N) };
+        const float total{ importanceNode + importance(nodes[sibling], p, N) };
+        if (!(total > 0.0f)) return 0.0f;
+
+        prob *= importanceNode / total;
+    }
+    return prob;
+}
@@ -0,0 +1,60 @@
+#ifndef _LIGHTTREE_H_INCLUDED_
+#define _LIGHTTREE_H_INCLUDED_
+
+#include "scene.h"
+
+#include <unordered_map>
+#include <vector>
+
+// Binary tree over the lights of the scene for picking the light of a next event
+// estimation sample. Every node bounds its lights with a box and keeps their total
+// power, and its importance for a shading point is that power over the squared
+// distance to the box, times the largest cosine between the normal and any direction
+// toward the box. A light is picked by walking down from the root and choosing each
+// child with a probability proportional to its importance, so a sample costs one
+// root to leaf walk instead of a pass over all lights. Only the lights with a
+// position (those with a bounding box) are in the tree. The infinite lights, like
+// directional lights, are kept in a list next to it, and a sample first picks the
+// tree or the list with a probability proportional to their total power, and then
+// a light of the list by its power.
+class LightTree
+{
+public:
+    void Build(const LightList& lights);
+
+    bool IsEmpty() const { return nodes.empty() && infiniteLights.empty(); }
+    size_t NumLights() const { return lights.size() + infiniteLights.size(); }
+
+    // Picks a light for the shading point p with normal N using the random number u in [0,1), and returns it with
+    // the probability of picking it in prob. Returns nullptr if no light can reach the point from above its surface.
+    const Light* Sample(const Vec3f& p, const Vec3f& N, float u, float& prob) const;
+
+    // The probability that Sample picks the light for the shading point p with normal N, e.g. for the MIS weight of a
+    // light hit by a bounce ray from p. Returns 0 for a light that Sample never picks.
+    float Probability(const Light* light, const Vec3f& p, const Vec3f& N) const;
+
+private:
+    struct Node
+    {
+        Box bounds;
+        float power{ 0.0f };
+        unsigned int child{ 0 };   // the first of two children for an inner node, or the light of a leaf
+        unsigned int parent{ 0 };
+        bool leaf{ false };
+    };
+
+    std::vector<Node> nodes;   // the root is nodes[0], and the children of a node are next to each other
+    std::vector<const Light*> lights;
+    std::vector<unsigned int> lightLeaves;   // the leaf node of each light
+    std::unordered_map<const Light*, unsigned int> lightIndex;
+    std::vector<const Light*> infiniteLights;
+    std::vector<float> infinitePowers;
+    float infinitePower{ 0.0f };
+
+    float treeProbability() const;   // the probability of Sample picking a light of the tree rather than an infinite one
+
+    void build(unsigned int nodeID, unsigned int* lightIDs, unsigned int count, const std::vector<Box>& boxes, const std::vector<float>& powers);
+    float importance(const Node& node, const Vec3f& p, const Vec3f& N) const;
+};
+
+#endif
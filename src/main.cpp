@@ -12,81 +12,9 @@
 #include <atomic>
 #include <chrono>
 #include <vector>
-
-bool shootRay(const Node* const node, const Ray& ray, HitInfo& bestHitInfo, int hitSide)
-{
-    const Object* const obj{ node->GetNodeObj() };
-    const Ray localRay{ node->ToNodeCoords(ray) };
-
-    bool hitObject{ false };
-    if (obj != nullptr)
-    {
-        HitInfo hitInfo{};
-        if (obj->IntersectRay(localRay, hitInfo, hitSide))
-        {
-            bestHitInfo = hitInfo;
-            bestHitInfo.node = node;
-            node->FromNodeCoords(bestHitInfo);
-            hitObject = true;
-        }
-    }
-
-    for (int i{ 0 }; i < node->GetNumChild(); ++i)
-    {
-        HitInfo childHitInfo{};
-        const Node* const childNode{ node->GetChild(i) };
-        if (shootRay(childNode, localRay, childHitInfo, hitSide))
-        {
-            if (childHitInfo.z < bestHitInfo.z)
-            {
-                bestHitInfo = childHitInfo;
-                node->FromNodeCoords(bestHitInfo);
-            }
-            hitObject = true;
-        }
-    }
-
-    return hitObject;
-}
-
-bool shootRayAtLights(const Ray& ray, HitInfo& bestHitInfo)
-{
-    for (int i{ 0 }; i < static_cast<int>(renderer.GetScene().lights.size()); ++i)
-    {
-        const Light* const light{ renderer.GetScene().lights[i] };
-
-        HitInfo hitInfo{};
-        if (!light->IntersectRay(ray, hitInfo))
-            continue;
-
-        if (hitInfo.z < bestHitInfo.z)
-        {
-            bestHitInfo = hitInfo;
-            return true;
-        }
-    }
-
-    return false;
-}
-
-bool shootShadowRay(const Node* const node, const Ray& ray, float t_max)
-{
-    const Object* const obj{ node->GetNodeObj() };
-    Ray localRay{ node->ToNodeCoords(ray) };
-
-    if (obj != nullptr)
-        if (obj->IntersectShadowRay(localRay, t_max))
-            return true;
-
-    for (int i{ 0 }; i < node->GetNumChild(); ++i)
-    {
-        const Node* const childNode{ node->GetChild(i) };
-        if (shootShadowRay(childNode, localRay, t_max)) 
-            return true;
-    }
-
-    return false;
-}
+#include <algorithm>
+#include <cstdint>
+#include <memory>
 
 namespace tileThreads
 {
@@ -99,11 +27,16 @@ namespace tileThreads
     float imagePlaneHalfWidth{};
     float imagePlaneHalfHeight{};
     float pixelSize{};
+    float pixelSpread{};   // the angle of a pixel, which is the spread of the camera ray cones
     Matrix3f cameraToWorld{};
 
     Color24* pixels{ nullptr };
     float* depthValues{ nullptr };
 
+    constexpr size_t minNumSamples{ 128 };
+    constexpr size_t maxNumSamples{ 128 };
+    constexpr size_t maxBounces{ 50 };
+
     constexpr size_t samplesPerPixel{ 16 };
     RNG rng{};
     HaltonSeq<static_cast<int>(samplesPerPixel)> aaHaltonSeqX{ 2 };
@@ -114,14 +47,55 @@ namespace tileThreads
 
 bool Renderer::TraceRay(Ray const &ray, HitInfo &hInfo, int hitSide) const
 {
-    bool output{ shootRay(&scene.rootNode, ray, hInfo, HIT_FRONT_AND_BACK) };
-    output |= shootRayAtLights(ray, hInfo);
-    return output;
+    // Renderable lights are in the scene BVH, and their hits set hInfo.light
+    return sceneBVH.IntersectRay(ray, hInfo, HIT_FRONT_AND_BACK);
 }
 
 bool Renderer::TraceShadowRay(Ray const &ray, float t_max, int hitSide) const
 {
-    return shootShadowRay(&scene.rootNode, ray, t_max);
+    return sceneBVH.IntersectShadowRay(ray, t_max);
+}
+
+int Renderer::TraceRayPacket(Ray const *rays, HitInfo *hInfo, int laneMask) const
+{
+    RayPacket<rayPacketWidth> packet{};
+    for (int lane{ 0 }; lane < rayPacketWidth; ++lane)
+    {
+        if (laneMask & (1 << lane))
+            packet.Set(lane, rays[lane], hInfo[lane].z);
+    }
+
+    return sceneBVH.IntersectPacket(packet, laneMask, hInfo, HIT_FRONT_AND_BACK);
+}
+
+int Renderer::TraceShadowRayPacket(Ray const *rays, float const *t_max, int laneMask) const
+{
+    RayPacket<rayPacketWidth> packet{};
+    for (int lane{ 0 }; lane < rayPacketWidth; ++lane)
+    {
+        if (laneMask & (1 << lane))
+            packet.Set(lane, rays[lane], t_max[lane]);
+    }
+
+    return sceneBVH.IntersectShadowPacket(packet, laneMask);
+}
+
+void Renderer::TraceRays(Ray const *rays, HitInfo *hInfo, bool *found, size_t count) const
+{
+    sceneBVH.IntersectRays(rays, hInfo, found, count, HIT_FRONT_AND_BACK);
+}
+
+void Renderer::TraceShadowRays(Ray const *rays, float const *t_max, bool *occluded, size_t count) const
+{
+    sceneBVH.IntersectShadowRays(rays, t_max, occluded, count);
+}
+
+void Renderer::UpdateScene()
+{
+    // The scene BVH only has one element per object instance, so it is rebuilt rather than refit
+    scene.rootNode.ComputeChildBoundBox();
+    sceneBVH.BuildFromScene(scene.rootNode, scene.lights);
+    lightTree.Build(scene.lights);
 }
 
 # ifdef LEGACY_SHADING_API
@@ -157,20 +131,108 @@ Color ShadeInfo::TraceSecondaryRay( Ray const &ray, float &dist, bool reflection
 }
 #endif
 
-Color tracePath(Ray ray)
+// The first bounce of a camera ray, traced ahead together with the other rays of its
+// packet: the camera ray hit and, for surface hits, the next event estimation sample
+// toward the light and whether its shadow ray is occluded
+struct PrimaryHit
+{
+    bool hit{ false };
+    HitInfo hInfo{};
+    bool nextEventSampled{ false };
+    Vec3f nextEventShadowDir{};
+    DirSampler::Info nextEventInfo{};
+    bool occluded{ false };
+};
+
+// Next event estimation sample toward a light picked by the light tree for the shading point, whose probability is
+// included in info.prob. Returns the light, or nullptr if no sample is generated.
+const Light* sampleNextEvent(const SamplerInfo& sInfo, const Vec3f& normal, Vec3f& dir, DirSampler::Info& info)
+{
+    float lightProb;
+    const Light* const light{ renderer.GetLightTree().Sample(sInfo.P(), normal, sInfo.RandomFloat(), lightProb) };
+    if (light == nullptr || !light->GenerateSample(sInfo, dir, info))
+        return nullptr;
+
+    info.prob *= lightProb;
+    return light;
+}
+
+// MIS weight of a light hit by a bounce ray, against sampling the light from the origin of the ray, where the surface had lastNormal
+float lightHitWeight(const Light* light, const Ray& ray, const Vec3f& lastNormal, DirSampler::Lobe lastBounceLobe, float lastBounceProb)
+{
+    if (lastBounceLobe != DirSampler::Lobe::DIFFUSE)
+        return 1.0f;
+
+    HitInfo dummyHitInfo;
+    dummyHitInfo.p = ray.p;
+    SamplerInfo dummySamplerInfo{ tileThreads::rng };
+    dummySamplerInfo.SetHit(ray, dummyHitInfo);
+
+    DirSampler::Info lightInfo;
+    light->GetSampleInfo(dummySamplerInfo, ray.dir, lightInfo);
+    lightInfo.prob *= renderer.GetLightTree().Probability(light, ray.p, lastNormal);
+
+    if (lightInfo.prob > 0.0f)
+        return (lastBounceProb * lastBounceProb) / (lastBounceProb * lastBounceProb + lightInfo.prob * lightInfo.prob);
+    return 1.0f;
+}
+
+// MIS weighted contribution of an unoccluded next event estimation sample, without the path throughput
+Color nextEventContribution(const MtlBasePhongBlinn* material, const SamplerInfo& sInfo, const Ray& ray, const Vec3f& normal,
+                            const Vec3f& nextEventShadowDir, const DirSampler::Info& nextEventInfo)
+{
+    const float cosThetaSurface{ std::max(0.0f, normal.Dot(nextEventShadowDir)) };
+    if (!(cosThetaSurface > 0.0f && nextEventInfo.prob > 0.0f))
+        return Color{ 0.0f };
+
+    // Calculate MIS weight
+    DirSampler::Info materialInfo;
+    material->GetSampleInfo(sInfo, nextEventShadowDir, materialInfo);
+    float weight{ 1.0f };
+    if (materialInfo.prob > 0.0f)
+        weight = (nextEventInfo.prob * nextEventInfo.prob) / (nextEventInfo.prob * nextEventInfo.prob + materialInfo.prob * materialInfo.prob);
+
+    // Regular shading
+    const Color diffuse{ material->Diffuse().GetValue() };
+    Color brdf{ diffuse / Pi<float>() };
+
+    const Vec3f h{ (nextEventShadowDir - ray.dir).GetNormalized() };
+    const float blinnTerm{ std::max(0.0f, normal.Dot(h)) };
+
+    const float gloss{ material->Glossiness().GetValue() };
+    if (blinnTerm > 0.0f && materialInfo.lobe == DirSampler::Lobe::DIFFUSE)
+    {
+        const Color specular{ material->Specular().GetValue() };
+        const float specNorm{ (gloss + 2) / (2.0f * Pi<float>()) };
+        brdf += specular * specNorm * pow(blinnTerm, gloss);
+    }
+
+    return (brdf * cosThetaSurface * nextEventInfo.mult) * weight / nextEventInfo.prob;
+}
+
+// The ray cones that select the levels of detail of meshes: a ray leaving the hit of ray at distance z starts with
+// the footprint of ray there, and a diffuse bounce widens it further, since the directions it samples spread over
+// the whole hemisphere and average away the small details of what they hit
+constexpr float diffuseConeSpread{ 0.05f };
+
+Ray continueRayCone(const Ray& ray, float z, const Vec3f& p, const Vec3f& dir, bool diffuseBounce)
+{
+    return Ray{ p, dir, ray.FootprintWidth(z) / dir.Length(), ray.coneSpread + (diffuseBounce ? diffuseConeSpread : 0.0f) };
+}
+
+Color tracePath(Ray ray, const PrimaryHit& primaryHit)
 {
     Color throughput{ 1.0f };
     Color result{ 0.0f };
-    constexpr size_t maxBounces{ 50 };
-    const Light* light{ renderer.GetScene().lights[0] };
     DirSampler::Info indirectLightingInfo;
 
     float lastBounceProb{ 1.0f };
+    Vec3f lastNormal{};
 
-    for (size_t bounce{ 0 }; bounce < maxBounces; ++bounce)
+    for (size_t bounce{ 0 }; bounce < tileThreads::maxBounces; ++bounce)
     {
-        HitInfo hInfo{};
-        if (!renderer.TraceRay(ray, hInfo, HIT_FRONT_AND_BACK))
+        HitInfo hInfo{ bounce == 0 ? primaryHit.hInfo : HitInfo{} };
+        if (bounce == 0 ? !primaryHit.hit : !renderer.TraceRay(ray, hInfo, HIT_FRONT_AND_BACK))
         {
             const Color c{ renderer.GetScene().background.Eval(ray.dir) };
             result += c * throughput;
@@ -183,28 +245,14 @@ Color tracePath(Ray ray)
 
         if (hInfo.light)
         {
+            const Light* const light{ hInfo.lightSource };
             if (bounce == 0)
             {
                 result += light->Radiance(sInfo) * throughput;
             }
             else
             {
-                float weight{ 1.0f };
-                if (indirectLightingInfo.lobe == DirSampler::Lobe::DIFFUSE)
-                {
-                    HitInfo dummyHitInfo;
-                    dummyHitInfo.p = ray.p;
-                    SamplerInfo dummySamplerInfo{ tileThreads::rng };
-                    dummySamplerInfo.SetHit(ray, dummyHitInfo);
-
-                    DirSampler::Info lightInfo;
-                    light->GetSampleInfo(dummySamplerInfo, ray.dir, lightInfo);
-
-                    if (lightInfo.prob > 0.0f)
-                        weight = (lastBounceProb * lastBounceProb) / (lastBounceProb * lastBounceProb + lightInfo.prob * lightInfo.prob);
-                }
-
-                result += light->Radiance(sInfo) * throughput * weight;
+                result += light->Radiance(sInfo) * throughput * lightHitWeight(light, ray, lastNormal, indirectLightingInfo.lobe, lastBounceProb);
             }
             return result;
         }
@@ -212,42 +260,14 @@ Color tracePath(Ray ray)
         const MtlBasePhongBlinn* material{ static_cast<const MtlBasePhongBlinn*>(hInfo.node->GetMaterial()) };
 
         // Next event estimation
-        DirSampler::Info nextEventInfo;
-        Vec3f nextEventShadowDir;
-        if (light->GenerateSample(sInfo, nextEventShadowDir, nextEventInfo))
+        DirSampler::Info nextEventInfo{ primaryHit.nextEventInfo };
+        Vec3f nextEventShadowDir{ primaryHit.nextEventShadowDir };
+        if (bounce == 0 ? primaryHit.nextEventSampled : sampleNextEvent(sInfo, normal, nextEventShadowDir, nextEventInfo) != nullptr)
         {
             const float sign{ hInfo.front ? 1.0f : -1.0f };
-            const Ray nextEventShadowRay{ hInfo.p + (normal * 0.002f * sign), nextEventShadowDir };
-            if (!renderer.TraceShadowRay(nextEventShadowRay, nextEventInfo.dist - 0.002f, HIT_FRONT_AND_BACK))
-            {
-                const float cosThetaSurface{ std::max(0.0f, normal.Dot(nextEventShadowDir)) };
-                if (cosThetaSurface > 0.0f && nextEventInfo.prob > 0.0f)
-                {
-                    // Calculate MIS weight
-                    DirSampler::Info materialInfo;
-                    material->GetSampleInfo(sInfo, nextEventShadowDir, materialInfo);
-                    float weight{ 1.0f };
-                    if (materialInfo.prob > 0.0f)
-                        weight = (nextEventInfo.prob * nextEventInfo.prob) / (nextEventInfo.prob * nextEventInfo.prob + materialInfo.prob * materialInfo.prob);
-
-                    // Regular shading
-                    const Color diffuse{ material->Diffuse().GetValue() };
-                    Color brdf{ diffuse / Pi<float>() };
-
-                    const Vec3f h{ (nextEventShadowDir - ray.dir).GetNormalized() };
-                    const float blinnTerm{ std::max(0.0f, normal.Dot(h)) };
-                    
-                    const float gloss{ material->Glossiness().GetValue() };
-                    if (blinnTerm > 0.0f && materialInfo.lobe == DirSampler::Lobe::DIFFUSE)
-                    {
-                        const Color specular{ material->Specular().GetValue() };
-                        const float specNorm{ (gloss + 2) / (2.0f * Pi<float>()) };
-                        brdf += specular * specNorm * pow(blinnTerm, gloss);
-                    }
-
-                    result += (brdf * cosThetaSurface * nextEventInfo.mult) * weight / nextEventInfo.prob * throughput;
-                }
-            }
+            const Ray nextEventShadowRay{ continueRayCone(ray, hInfo.z, hInfo.p + (normal * 0.002f * sign), nextEventShadowDir, false) };
+            if (bounce == 0 ? !primaryHit.occluded : !renderer.TraceShadowRay(nextEventShadowRay, nextEventInfo.dist - 0.002f, HIT_FRONT_AND_BACK))
+                result += nextEventContribution(material, sInfo, ray, normal, nextEventShadowDir, nextEventInfo) * throughput;
         }
 
         // Indirect bounce
@@ -256,10 +276,10 @@ Color tracePath(Ray ray)
             break;
 
         lastBounceProb = indirectLightingInfo.prob;
+        lastNormal = normal;
 
-        ray.dir = bounceDir;
         const float sign{ (normal.Dot(bounceDir) > 0.0f) ? 1.0f : -1.0f };
-        ray.p = hInfo.p + (normal * 0.002f * sign);
+        ray = continueRayCone(ray, hInfo.z, hInfo.p + (normal * 0.002f * sign), bounceDir, indirectLightingInfo.lobe == DirSampler::Lobe::DIFFUSE);
 
         throughput *= indirectLightingInfo.mult / indirectLightingInfo.prob;
     }
@@ -267,12 +287,727 @@ Color tracePath(Ray ray)
     return result;
 }
 
+// Traces the camera rays of the lanes in laneMask as one packet, samples the light
+// from their surface hits, and traces the shadow rays of these samples as a second
+// packet. Both sets of rays start close together, so the packets stay coherent.
+void tracePrimaryPacket(const Ray* cameraRays, int laneMask, PrimaryHit* primaryHits)
+{
+    HitInfo hInfo[rayPacketWidth]{};
+    const int hitMask{ renderer.TraceRayPacket(cameraRays, hInfo, laneMask) };
+
+    Ray shadowRays[rayPacketWidth]{};
+    float shadowTMax[rayPacketWidth]{};
+    int shadowMask{ 0 };
+    for (int lane{ 0 }; lane < rayPacketWidth; ++lane)
+    {
+        if (!(laneMask & (1 << lane)))
+            continue;
+
+        PrimaryHit& primaryHit{ primaryHits[lane] };
+        primaryHit = PrimaryHit{};
+        primaryHit.hit = (hitMask & (1 << lane)) != 0;
+        primaryHit.hInfo = hInfo[lane];
+        if (!primaryHit.hit || primaryHit.hInfo.light)
+            continue;
+
+        SamplerInfo sInfo{ tileThreads::rng };
+        sInfo.SetHit(cameraRays[lane], primaryHit.hInfo);
+        const Vec3f normal{ primaryHit.hInfo.N.GetNormalized() };
+        primaryHit.nextEventSampled = sampleNextEvent(sInfo, normal, primaryHit.nextEventShadowDir, primaryHit.nextEventInfo) != nullptr;
+        if (!primaryHit.nextEventSampled)
+            continue;
+
+        const float sign{ primaryHit.hInfo.front ? 1.0f : -1.0f };
+        shadowRays[lane] = continueRayCone(cameraRays[lane], primaryHit.hInfo.z, primaryHit.hInfo.p + (normal * 0.002f * sign), primaryHit.nextEventShadowDir, false);
+        shadowTMax[lane] = primaryHit.nextEventInfo.dist - 0.002f;
+        shadowMask |= 1 << lane;
+    }
+
+    const int occludedMask{ shadowMask == 0 ? 0 : renderer.TraceShadowRayPacket(shadowRays, shadowTMax, shadowMask) };
+    for (int lane{ 0 }; lane < rayPacketWidth; ++lane)
+        primaryHits[lane].occluded = (occludedMask & (1 << lane)) != 0;
+}
+
+Ray generateCameraRay(int i, int j, size_t k, float aaOffsetPixelX, float aaOffsetPixelY, float dofOffsetTheta, float dofOffsetRadius)
+{
+    const float jitterX{ fmod(tileThreads::aaHaltonSeqX[k] + aaOffsetPixelX, 1.0f) };
+    const float jitterY{ fmod(tileThreads::aaHaltonSeqY[k] + aaOffsetPixelY, 1.0f) };
+    const float pixelX{ static_cast<float>(i) + jitterX };
+    const float pixelY{ static_cast<float>(j) + jitterY };
+    const float spaceX{ -tileThreads::imagePlaneHalfWidth + tileThreads::pixelSize * pixelX };
+    const float spaceY{ tileThreads::imagePlaneHalfHeight - tileThreads::pixelSize * pixelY };
+    const Vec3f worldRayDestination{ renderer.GetCamera().pos + tileThreads::cameraToWorld * Vec3f{spaceX, spaceY, -renderer.GetCamera().focaldist} };
+
+    const float jitterTheta{ fmod(tileThreads::diskHaltonSeqTheta[k] + dofOffsetTheta, 1.0f) };
+    const float jitterRadius{ fmod(tileThreads::diskHaltonSeqRadius[k] + dofOffsetRadius, 1.0f) };
+    const float diskTheta{ jitterTheta * 2.0f * M_PI };
+    const float diskRadius{ sqrt(jitterRadius) };
+    const Vec3f cameraRayPosOffset{
+        diskRadius * renderer.GetCamera().dof * cos(diskTheta),
+        diskRadius * renderer.GetCamera().dof * sin(diskTheta),
+        0.0f
+    };
+
+    const Vec3f worldRayPos{ renderer.GetCamera().pos + tileThreads::cameraToWorld * cameraRayPosOffset };
+    const Vec3f worldRayDir{ worldRayDestination - worldRayPos };
+    return Ray{ worldRayPos, worldRayDir, 0.0f, tileThreads::pixelSpread };
+}
+
+// Adaptive sampling stops once three standard errors of the mean are below deltaMax in every channel
+bool pixelConverged(const Color& colorSum, const Color& colorSumSquared, size_t sampleCount)
+{
+    if (sampleCount < tileThreads::minNumSamples)
+        return false;
+
+    Color sigma{ (colorSumSquared - ((colorSum * colorSum) / static_cast<float>(sampleCount))) / (static_cast<float>(sampleCount - 1)) };
+    sigma.r = fmaxf(0.0f, sigma.r);
+    sigma.g = fmaxf(0.0f, sigma.g);
+    sigma.b = fmaxf(0.0f, sigma.b);
+    sigma.r = sqrtf(sigma.r);
+    sigma.g = sqrtf(sigma.g);
+    sigma.b = sqrtf(sigma.b);
+    const Color delta{ 3.0f * (sigma / sqrtf(static_cast<float>(sampleCount))) };
+    constexpr float deltaMax{ 0.01f };
+
+    return delta.r < deltaMax && delta.g < deltaMax && delta.b < deltaMax;
+}
+
+void storePixel(int i, int j, const Color& colorSum, size_t sampleCount)
+{
+    Color c{ colorSum / static_cast<float>(sampleCount) };
+    if (renderer.GetCamera().sRGB)
+        c = c.Linear2sRGB();
+
+    renderer.GetRenderImage().GetPixels()[j * renderer.GetCamera().imgWidth + i] = Color24{ c };
+    renderer.GetRenderImage().GetSampleCount()[j * renderer.GetCamera().imgWidth + i] = static_cast<int>(sampleCount);
+    renderer.GetRenderImage().IncrementNumRenderPixel(1);
+}
+
+// Wavefront path tracing: instead of following one path at a time, all paths of a
+// batch of samples of a tile go through the same stage together (extend: trace the
+// rays, shade: handle the hits and sample the next bounce, shadow: trace the next
+// event rays), so each stage runs over a long queue of similar work. Before the
+// extend and shadow stages the rays are sorted by a Morton key of their direction
+// and origin, and before shading the hits are sorted by material, so consecutive
+// rays visit the same BVH nodes and consecutive hits run the same material code.
+// The estimator is the one of tracePath; only the order of the work differs.
+namespace wavefront
+{
+    constexpr size_t samplesPerBatch{ 16 };   // 4096 paths per queue for a full tile
+
+    struct Path
+    {
+        Ray ray;
+        HitInfo hInfo;
+        Color throughput{ 1.0f };
+        Color result{ 0.0f };
+        float lastBounceProb{ 1.0f };
+        Vec3f lastNormal{};
+        DirSampler::Lobe lastBounceLobe{ DirSampler::Lobe::NONE };
+        bool hit{ false };
+        int pixel{ 0 };
+    };
+
+    struct ShadowRay
+    {
+        Ray ray;
+        float tMax;
+        Color contribution;   // added to the path result if the ray is not occluded
+        unsigned int path;
+    };
+
+    struct SortEntry
+    {
+        uint64_t key;
+        unsigned int index;
+
+        bool operator<(const SortEntry& other) const { return key < other.key; }
+    };
+
+    // Spreads the low 10 bits of v to every third bit
+    uint64_t expandBits(uint64_t v)
+    {
+        v &= 0x3ff;
+        v = (v | (v << 16)) & 0x30000ff;
+        v = (v | (v << 8)) & 0x300f00f;
+        v = (v | (v << 4)) & 0x30c30c3;
+        v = (v | (v << 2)) & 0x9249249;
+        return v;
+    }
+
+    uint64_t morton3(float x, float y, float z, int bits)
+    {
+        const float scale{ static_cast<float>((1 << bits) - 1) };
+        const auto quantize = [scale](float f) { return static_cast<uint64_t>(std::clamp(f, 0.0f, 1.0f) * scale); };
+        return (expandBits(quantize(x)) << 2) | (expandBits(quantize(y)) << 1) | expandBits(quantize(z));
+    }
+
+    // The direction goes into the high bits, since rays in similar directions share
+    // more of their traversal than rays from nearby origins in different directions
+    uint64_t rayKey(const Ray& ray, const Box& sceneBox)
+    {
+        const Vec3f dir{ ray.dir.GetNormalized() };
+        const Vec3f extent{ sceneBox.pmax - sceneBox.pmin };
+        const Vec3f origin{ (ray.p - sceneBox.pmin) / Vec3f{ std::max(extent.x, 1e-6f), std::max(extent.y, 1e-6f), std::max(extent.z, 1e-6f) } };
+        return (morton3(dir.x * 0.5f + 0.5f, dir.y * 0.5f + 0.5f, dir.z * 0.5f + 0.5f, 4) << 30) | morton3(origin.x, origin.y, origin.z, 10);
+    }
+
+    struct Queues
+    {
+        std::vector<Path> paths;
+        std::vector<unsigned int> active;
+        std::vector<unsigned int> nextActive;
+        std::vector<ShadowRay> shadowRays;
+        std::vector<SortEntry> order;
+
+        // The rays of a batch trace in the sorted order
+        std::vector<Ray> batchRays;
+        std::vector<HitInfo> batchHits;
+        std::vector<float> batchTMax;
+        std::unique_ptr<bool[]> batchFlags;   // not a vector<bool>, whose elements are bits
+        size_t batchCapacity{ 0 };
+
+        bool* BatchFlags(size_t count)
+        {
+            if (count > batchCapacity)
+            {
+                batchCapacity = count;
+                batchFlags = std::make_unique<bool[]>(count);
+            }
+            return batchFlags.get();
+        }
+    };
+
+    // Traces the rays of the active paths as one batch, sorted by their keys except for the camera
+    // rays, which are already coherent in sample order and are traced as packets unless the scene
+    // has out-of-core meshes, whose clusters are paged in once per batch instead of once per packet
+    void extend(Queues& queues, size_t bounce, const Box& sceneBox)
+    {
+        if (bounce == 0 && !renderer.GetSceneBVH().HasClusteredMeshes())
+        {
+            for (size_t first{ 0 }; first < queues.active.size(); first += rayPacketWidth)
+            {
+                const int packetSize{ static_cast<int>(std::min<size_t>(rayPacketWidth, queues.active.size() - first)) };
+                Ray rays[rayPacketWidth]{};
+                HitInfo hInfo[rayPacketWidth]{};
+                for (int lane{ 0 }; lane < packetSize; ++lane)
+                    rays[lane] = queues.paths[queues.active[first + lane]].ray;
+
+                const int hitMask{ renderer.TraceRayPacket(rays, hInfo, (1 << packetSize) - 1) };
+                for (int lane{ 0 }; lane < packetSize; ++lane)
+                {
+                    Path& path{ queues.paths[queues.active[first + lane]] };
+                    path.hInfo = hInfo[lane];
+                    path.hit = (hitMask & (1 << lane)) != 0;
+                }
+            }
+            return;
+        }
+
+        queues.order.clear();
+        for (const unsigned int p : queues.active)
+            queues.order.push_back({ bounce == 0 ? 0 : rayKey(queues.paths[p].ray, sceneBox), p });
+        std::stable_sort(queues.order.begin(), queues.order.end());
+
+        const size_t count{ queues.order.size() };
+        queues.batchRays.resize(count);
+        queues.batchHits.assign(count, HitInfo{});
+        bool* const found{ queues.BatchFlags(count) };
+        for (size_t i{ 0 }; i < count; ++i)
+            queues.batchRays[i] = queues.paths[queues.order[i].index].ray;
+
+        renderer.TraceRays(queues.batchRays.data(), queues.batchHits.data(), found, count);
+        for (size_t i{ 0 }; i < count; ++i)
+        {
+            Path& path{ queues.paths[queues.order[i].index] };
+            path.hInfo = queues.batchHits[i];
+            path.hit = found[i];
+        }
+    }
+
+    // Ends the paths that missed or hit the light, and for surface hits queues the next
+    // event shadow ray and samples the next bounce of the path, grouped by material
+    void shade(Queues& queues, size_t bounce)
+    {
+        queues.order.clear();
+        for (const unsigned int p : queues.active)
+        {
+            const Path& path{ queues.paths[p] };
+            const bool surfaceHit{ path.hit && !path.hInfo.light };
+            queues.order.push_back({ surfaceHit ? reinterpret_cast<uintptr_t>(path.hInfo.node->GetMaterial()) : 0, p });
+        }
+        std::stable_sort(queues.order.begin(), queues.order.end());
+
+        queues.nextActive.clear();
+        for (const SortEntry& entry : queues.order)
+        {
+            Path& path{ queues.paths[entry.index] };
+            if (!path.hit)
+            {
+                const Color c{ renderer.GetScene().background.Eval(path.ray.dir) };
+                path.result += c * path.throughput;
+                continue;
+            }
+
+            SamplerInfo sInfo{ tileThreads::rng };
+            sInfo.SetHit(path.ray, path.hInfo);
+
+            if (path.hInfo.light)
+            {
+                const Light* const light{ path.hInfo.lightSource };
+                const float weight{ bounce == 0 ? 1.0f : lightHitWeight(light, path.ray, path.lastNormal, path.lastBounceLobe, path.lastBounceProb) };
+                path.result += light->Radiance(sInfo) * path.throughput * weight;
+                continue;
+            }
+
+            const Vec3f normal{ path.hInfo.N.GetNormalized() };
+            const MtlBasePhongBlinn* material{ static_cast<const MtlBasePhongBlinn*>(path.hInfo.node->GetMaterial()) };
+
+            // Next event estimation, whose shadow ray is only needed if the sample contributes. With ReSTIR, the primary
+            // hits already have their shadow rays toward the lights with an area from resampleDirectLighting, so only a
+            // sample of a delta light is kept for them.
+            DirSampler::Info nextEventInfo;
+            Vec3f nextEventShadowDir;
+            const Light* const nextEventLight{ sampleNextEvent(sInfo, normal, nextEventShadowDir, nextEventInfo) };
+            if (nextEventLight != nullptr && !(bounce == 0 && restirDirectLighting && nextEventLight->GetSize() > 0.0f))
+            {
+                const Color contribution{ nextEventContribution(material, sInfo, path.ray, normal, nextEventShadowDir, nextEventInfo) * path.throughput };
+                if (contribution.r > 0.0f || contribution.g > 0.0f || contribution.b > 0.0f)
+                {
+                    const float sign{ path.hInfo.front ? 1.0f : -1.0f };
+                    const Ray nextEventShadowRay{ continueRayCone(path.ray, path.hInfo.z, path.hInfo.p + (normal * 0.002f * sign), nextEventShadowDir, false) };
+                    queues.shadowRays.push_back({ nextEventShadowRay, nextEventInfo.dist - 0.002f, contribution, entry.index });
+                }
+            }
+
+            // Indirect bounce
+            Vec3f bounceDir;
+            DirSampler::Info indirectLightingInfo;
+            if (!material->GenerateSample(sInfo, bounceDir, indirectLightingInfo))
+                continue;
+
+            path.lastBounceProb = indirectLightingInfo.prob;
+            path.lastBounceLobe = indirectLightingInfo.lobe;
+            path.lastNormal = normal;
+
+            const float sign{ (normal.Dot(bounceDir) > 0.0f) ? 1.0f : -1.0f };
+            path.ray = continueRayCone(path.ray, path.hInfo.z, path.hInfo.p + (normal * 0.002f * sign), bounceDir, indirectLightingInfo.lobe == DirSampler::Lobe::DIFFUSE);
+
+            path.throughput *= indirectLightingInfo.mult / indirectLightingInfo.prob;
+            queues.nextActive.push_back(entry.index);
+        }
+    }
+
+    // Traces the queued shadow rays sorted by their keys, and adds the contributions of the
+    // unoccluded ones. The shadow rays of the first bounce start close together and all
+    // go toward the light, so after sorting they are coherent enough for packets.
+    void shadow(Queues& queues, size_t bounce, const Box& sceneBox)
+    {
+        queues.order.clear();
+        for (unsigned int i{ 0 }; i < queues.shadowRays.size(); ++i)
+            queues.order.push_back({ rayKey(queues.shadowRays[i].ray, sceneBox), i });
+        std::sort(queues.order.begin(), queues.order.end());
+
+        if (bounce == 0 && !renderer.GetSceneBVH().HasClusteredMeshes())
+        {
+            for (size_t first{ 0 }; first < queues.order.size(); first += rayPacketWidth)
+            {
+                const int packetSize{ static_cast<int>(std::min<size_t>(rayPacketWidth, queues.order.size() - first)) };
+                Ray rays[rayPacketWidth]{};
+                float tMax[rayPacketWidth]{};
+                for (int lane{ 0 }; lane < packetSize; ++lane)
+                {
+                    rays[lane] = queues.shadowRays[queues.order[first + lane].index].ray;
+                    tMax[lane] = queues.shadowRays[queues.order[first + lane].index].tMax;
+                }
+
+                const int occludedMask{ renderer.TraceShadowRayPacket(rays, tMax, (1 << packetSize) - 1) };
+                for (int lane{ 0 }; lane < packetSize; ++lane)
+                {
+                    const ShadowRay& shadowRay{ queues.shadowRays[queues.order[first + lane].index] };
+                    if (!(occludedMask & (1 << lane)))
+                        queues.paths[shadowRay.path].result += shadowRay.contribution;
+                }
+            }
+            return;
+        }
+
+        const size_t count{ queues.order.size() };
+        queues.batchRays.resize(count);
+        queues.batchTMax.resize(count);
+        bool* const occluded{ queues.BatchFlags(count) };
+        for (size_t i{ 0 }; i < count; ++i)
+        {
+            queues.batchRays[i] = queues.shadowRays[queues.order[i].index].ray;
+            queues.batchTMax[i] = queues.shadowRays[queues.order[i].index].tMax;
+        }
+
+        renderer.TraceShadowRays(queues.batchRays.data(), queues.batchTMax.data(), occluded, count);
+        for (size_t i{ 0 }; i < count; ++i)
+        {
+            const ShadowRay& shadowRay{ queues.shadowRays[queues.order[i].index] };
+            if (!occluded[i])
+                queues.paths[shadowRay.path].result += shadowRay.contribution;
+        }
+    }
+
+    // ReSTIR direct lighting of the primary hits (see restirDirectLighting). For every sample, each
+    // pixel fills a reservoir holding one light sample, a point on a light, chosen among several
+    // candidates with a probability proportional to a target function: the luminance of the
+    // unshadowed contribution of the point per unit light area (streaming RIS). The reservoir is then
+    // merged with the reservoirs of the same sample of random neighboring pixels in the tile (spatial
+    // reuse), so every pixel resamples from many more candidates than it draws, and only the final
+    // sample needs a shadow ray. A merge weights every reservoir with the balance heuristic over the
+    // target functions of all merged shading points, which keeps the result unbiased, and keeps a
+    // sample that was unlikely at the point it came from from getting a huge weight at a point where
+    // it is likely. There is no temporal reuse: the reservoir of the previous sample of a pixel would
+    // correlate the samples that are averaged into the pixel. Only the lights with an area have points
+    // to resample; the delta lights (directional lights and point lights of size 0) keep the regular
+    // next event estimation sample of the primary hits in shade.
+    constexpr int restirCandidates{ 4 };
+    constexpr int restirSpatialNeighbors{ 3 };
+    constexpr int restirSpatialRadius{ 4 };   // in pixels
+
+    // A point on a light, which can be evaluated from any shading point
+    struct LightSample
+    {
+        const Light* light{ nullptr };
+        Vec3f point{};
+        Vec3f normal{};
+        Color radiance{ 0.0f };
+    };
+
+    struct Reservoir
+    {
+        LightSample sample;
+        float target{ 0.0f };      // the target function of the sample at the shading point of the reservoir
+        float weightSum{ 0.0f };
+        float M{ 0.0f };           // the number of candidates seen
+        float W{ 0.0f };           // the contribution weight of the sample, an estimate of one over its density
+
+        void Add(const LightSample& candidate, float candidateTarget, float weight, float u)
+        {
+            weightSum += weight;
+            if (weight > 0.0f && u * weightSum < weight)
+            {
+                sample = candidate;
+                target = candidateTarget;
+            }
+        }
+    };
+
+    // The primary hit of a sample, with what its target function needs
+    struct ShadingPoint
+    {
+        Ray ray;
+        HitInfo hInfo;
+        Vec3f normal;
+        Vec3f view;
+        Color diffuse;
+        Color specular;
+        float glossiness;
+        const MtlBasePhongBlinn* material{ nullptr };   // nullptr if the sample has no surface hit
+    };
+
+    // The reservoirs of the pixels of a tile for one sample
+    struct TileReservoirs
+    {
+        int width{ 0 };
+        int height{ 0 };
+        std::vector<Reservoir> reservoirs;
+        std::vector<ShadingPoint> points;
+        std::vector<int> firstPaths;   // the path of the first sample of each pixel in the batch, or -1
+
+        void Resize(int tileWidth, int tileHeight)
+        {
+            width = tileWidth;
+            height = tileHeight;
+            const size_t count{ static_cast<size_t>(tileWidth * tileHeight) };
+            reservoirs.resize(count);
+            points.resize(count);
+            firstPaths.resize(count);
+        }
+    };
+
+    // The target function: the luminance of the unshadowed Blinn-Phong shading of the light sample at s per unit
+    // area of the light. A point on the far side of the light, sampled from another shading point, is hidden
+    // behind the light and has a target of 0.
+    float lightSampleTarget(const ShadingPoint& s, const LightSample& sample)
+    {
+        if (s.material == nullptr || sample.light == nullptr)
+            return 0.0f;
+
+        Vec3f dir{ sample.point - s.hInfo.p };
+        const float distSquared{ dir.LengthSquared() };
+        if (!(distSquared > 0.0f))
+            return 0.0f;
+        dir /= sqrtf(distSquared);
+
+        const float cosSurface{ s.normal.Dot(dir) };
+        const float cosLight{ -sample.normal.Dot(dir) };
+        if (!(cosSurface > 0.0f && cosLight > 0.0f))
+            return 0.0f;
+
+        Color brdf{ s.diffuse / Pi<float>() };
+        const float blinnTerm{ s.normal.Dot((dir + s.view).GetNormalized()) };
+        if (blinnTerm > 0.0f)
+            brdf += s.specular * ((s.glossiness + 2.0f) / (2.0f * Pi<float>())) * powf(blinnTerm, s.glossiness);
+
+        return (brdf * sample.radiance).Gray() * cosSurface * cosLight / distSquared;
+    }
+
+    // The MIS weighted, unshadowed next event contribution of the light sample at s per unit area of the light
+    Color lightSampleContribution(const ShadingPoint& s, const LightSample& sample)
+    {
+        Vec3f dir{ sample.point - s.hInfo.p };
+        const float distSquared{ dir.LengthSquared() };
+        const float dist{ sqrtf(distSquared) };
+        dir /= dist;
+
+        SamplerInfo sInfo{ tileThreads::rng };
+        sInfo.SetHit(s.ray, s.hInfo);
+        DirSampler::Info lightInfo;
+        sample.light->GetSampleInfo(sInfo, dir, lightInfo);
+        lightInfo.prob *= renderer.GetLightTree().Probability(sample.light, s.hInfo.p, s.normal);
+        lightInfo.mult = sample.radiance;
+        lightInfo.dist = dist;
+
+        // nextEventContribution divides by the density of the direction, which is multiplied back here
+        const float cosLight{ std::max(0.0f, -sample.normal.Dot(dir)) };
+        return nextEventContribution(s.material, sInfo, s.ray, s.normal, dir, lightInfo) * (lightInfo.prob * cosLight / distSquared);
+    }
+
+    ShadingPoint shadingPoint(const Path& path)
+    {
+        ShadingPoint s;
+        if (!path.hit || path.hInfo.light)
+            return s;
+
+        s.ray = path.ray;
+        s.hInfo = path.hInfo;
+        s.normal = path.hInfo.N.GetNormalized();
+        s.view = -path.ray.dir.GetNormalized();
+        s.material = static_cast<const MtlBasePhongBlinn*>(path.hInfo.node->GetMaterial());
+        s.diffuse = s.material->Diffuse().GetValue();
+        s.specular = s.material->Specular().GetValue();
+        s.glossiness = s.material->Glossiness().GetValue();
+        return s;
+    }
+
+    // Streams the light sampling candidates of s into a new reservoir. A candidate is picked like a next event
+    // estimation sample, so its density per unit light area is the density of its direction times the cosine at
+    // the light over the squared distance.
+    Reservoir initialReservoir(const ShadingPoint& s)
+    {
+        SamplerInfo sInfo{ tileThreads::rng };
+        sInfo.SetHit(s.ray, s.hInfo);
+
+        Reservoir r;
+        r.M = restirCandidates;
+        for (int i{ 0 }; i < restirCandidates; ++i)
+        {
+            Vec3f dir;
+            DirSampler::Info info;
+            const Light* const light{ sampleNextEvent(sInfo, s.normal, dir, info) };
+            if (light == nullptr || !(light->GetSize() > 0.0f))
+                continue;
+
+            LightSample candidate{ light, s.hInfo.p + dir * info.dist };
+            const Box lightBox{ light->GetBoundBox() };
+            candidate.normal = (candidate.point - 0.5f * (lightBox.pmin + lightBox.pmax)).GetNormalized();
+            candidate.radiance = info.mult;
+
+            const float target{ lightSampleTarget(s, candidate) };
+            const float density{ info.prob * -candidate.normal.Dot(dir) / (info.dist * info.dist) };
+            if (target > 0.0f && density > 0.0f)
+                r.Add(candidate, target, target / density, sInfo.RandomFloat());
+        }
+
+        r.W = r.target > 0.0f ? r.weightSum / (r.M * r.target) : 0.0f;
+        return r;
+    }
+
+    // Merges the reservoirs of the given shading points into a reservoir of the first one. The balance heuristic
+    // weight of a reservoir for its sample is its candidate count times its target function of the sample, over
+    // the sum of these for all the reservoirs.
+    Reservoir mergeReservoirs(const ShadingPoint* const* points, const Reservoir* const* reservoirs, int count)
+    {
+        Reservoir r;
+        for (int i{ 0 }; i < count; ++i)
+        {
+            const Reservoir& ri{ *reservoirs[i] };
+            r.M += ri.M;
+            if (!(ri.W > 0.0f))
+                continue;
+
+            const float target{ i == 0 ? ri.target : lightSampleTarget(*points[0], ri.sample) };
+            if (!(target > 0.0f))
+                continue;
+
+            float misSum{ 0.0f };
+            for (int j{ 0 }; j < count; ++j)
+            {
+                const float targetAtJ{ j == i ? ri.target : (j == 0 ? target : lightSampleTarget(*points[j], ri.sample)) };
+                misSum += reservoirs[j]->M * targetAtJ;
+            }
+            const float mis{ ri.M * ri.target / misSum };
+            r.Add(ri.sample, target, mis * target * ri.W, tileThreads::rng.RandomFloat());
+        }
+
+        r.W = r.target > 0.0f ? r.weightSum / r.target : 0.0f;
+        return r;
+    }
+
+    // Replaces the next event estimation of the primary hits of the batch by resampled light samples, one shadow
+    // ray each. Sample k of a pixel reuses the reservoirs of sample k of its neighbors.
+    void resampleDirectLighting(Queues& queues, TileReservoirs& tile, size_t batchSize)
+    {
+        const int numPixels{ tile.width * tile.height };
+        std::fill(tile.firstPaths.begin(), tile.firstPaths.end(), -1);
+        for (int p{ static_cast<int>(queues.paths.size()) - 1 }; p >= 0; --p)
+            tile.firstPaths[queues.paths[p].pixel] = p;
+
+        for (size_t k{ 0 }; k < batchSize; ++k)
+        {
+            for (int p{ 0 }; p < numPixels; ++p)
+            {
+                ShadingPoint& s{ tile.points[p] };
+                s = tile.firstPaths[p] < 0 ? ShadingPoint{} : shadingPoint(queues.paths[tile.firstPaths[p] + k]);
+                tile.reservoirs[p] = s.material == nullptr ? Reservoir{} : initialReservoir(s);
+            }
+
+            // Spatial reuse from random neighbors whose surface faces the same way
+            for (int p{ 0 }; p < numPixels; ++p)
+            {
+                const ShadingPoint& s{ tile.points[p] };
+                if (s.material == nullptr)
+                    continue;
+
+                const ShadingPoint* points[restirSpatialNeighbors + 1]{ &s };
+                const Reservoir* reservoirs[restirSpatialNeighbors + 1]{ &tile.reservoirs[p] };
+                int count{ 1 };
+                const int x{ p % tile.width };
+                const int y{ p / tile.width };
+                for (int i{ 0 }; i < restirSpatialNeighbors; ++i)
+                {
+                    const int nx{ x - restirSpatialRadius + static_cast<int>(tileThreads::rng.RandomFloat() * (2 * restirSpatialRadius + 1)) };
+                    const int ny{ y - restirSpatialRadius + static_cast<int>(tileThreads::rng.RandomFloat() * (2 * restirSpatialRadius + 1)) };
+                    if (nx < 0 || ny < 0 || nx >= tile.width || ny >= tile.height)
+                        continue;
+
+                    const int n{ ny * tile.width + nx };
+                    if (n == p || tile.points[n].material == nullptr || tile.points[n].normal.Dot(s.normal) < 0.9f)
+                        continue;
+
+                    points[count] = &tile.points[n];
+                    reservoirs[count] = &tile.reservoirs[n];
+                    ++count;
+                }
+                const Reservoir r{ mergeReservoirs(points, reservoirs, count) };
+                if (!(r.W > 0.0f))
+                    continue;
+
+                // The shadow ray of the sample
+                const unsigned int pathIndex{ static_cast<unsigned int>(tile.firstPaths[p] + k) };
+                const Path& path{ queues.paths[pathIndex] };
+                const Color contribution{ lightSampleContribution(s, r.sample) * r.W * path.throughput };
+                if (!(contribution.r > 0.0f || contribution.g > 0.0f || contribution.b > 0.0f))
+                    continue;
+
+                const float sign{ path.hInfo.front ? 1.0f : -1.0f };
+                Vec3f dir{ r.sample.point - path.hInfo.p };
+                const float dist{ dir.Length() };
+                dir /= dist;
+                const Ray shadowRay{ continueRayCone(path.ray, path.hInfo.z, path.hInfo.p + (s.normal * 0.002f * sign), dir, false) };
+                queues.shadowRays.push_back({ shadowRay, dist - 0.002f, contribution, pathIndex });
+            }
+        }
+    }
+
+    void renderTile(int imageX, int imageY, int tileWidth, int tileHeight)
+    {
+        struct Pixel
+        {
+            Color colorSum{ 0.0f };
+            Color colorSumSquared{ 0.0f };
+            size_t sampleCount{ 0 };
+            bool converged{ false };
+            float aaOffsetPixelX;
+            float aaOffsetPixelY;
+            float dofOffsetTheta;
+            float dofOffsetRadius;
+        };
+
+        thread_local Queues queues;
+        thread_local TileReservoirs reservoirs;
+        if (restirDirectLighting)
+            reservoirs.Resize(tileWidth, tileHeight);
+
+        std::vector<Pixel> pixels(tileWidth * tileHeight);
+        for (Pixel& pixel : pixels)
+        {
+            pixel.aaOffsetPixelX = tileThreads::rng.RandomFloat();
+            pixel.aaOffsetPixelY = tileThreads::rng.RandomFloat();
+            pixel.dofOffsetTheta = tileThreads::rng.RandomFloat();
+            pixel.dofOffsetRadius = tileThreads::rng.RandomFloat();
+        }
+
+        const Box& sceneBox{ renderer.GetScene().rootNode.GetChildBoundBox() };
+        for (size_t firstSample{ 0 }; firstSample < tileThreads::maxNumSamples; firstSample += samplesPerBatch)
+        {
+            const size_t batchSize{ std::min(samplesPerBatch, tileThreads::maxNumSamples - firstSample) };
+
+            queues.paths.clear();
+            queues.active.clear();
+            for (int p{ 0 }; p < static_cast<int>(pixels.size()); ++p)
+            {
+                if (pixels[p].converged)
+                    continue;
+
+                const int i{ imageX + p % tileWidth };
+                const int j{ imageY + p / tileWidth };
+                for (size_t k{ firstSample }; k < firstSample + batchSize; ++k)
+                {
+                    Path& path{ queues.paths.emplace_back() };
+                    path.ray = generateCameraRay(i, j, k, pixels[p].aaOffsetPixelX, pixels[p].aaOffsetPixelY, pixels[p].dofOffsetTheta, pixels[p].dofOffsetRadius);
+                    path.pixel = p;
+                    queues.active.push_back(static_cast<unsigned int>(queues.paths.size() - 1));
+                }
+            }
+            if (queues.paths.empty())
+                break;
+
+            for (size_t bounce{ 0 }; bounce < tileThreads::maxBounces && !queues.active.empty(); ++bounce)
+            {
+                extend(queues, bounce, sceneBox);
+                queues.shadowRays.clear();
+                if (bounce == 0 && restirDirectLighting)
+                    resampleDirectLighting(queues, reservoirs, batchSize);
+                shade(queues, bounce);
+                shadow(queues, bounce, sceneBox);
+                std::swap(queues.active, queues.nextActive);
+            }
+
+            // The adaptive check runs once per batch, after all samples of the batch are in
+            for (const Path& path : queues.paths)
+            {
+                Pixel& pixel{ pixels[path.pixel] };
+                pixel.colorSum += path.result;
+                pixel.colorSumSquared += path.result * path.result;
+                ++pixel.sampleCount;
+            }
+            for (Pixel& pixel : pixels)
+                pixel.converged = pixel.converged || pixelConverged(pixel.colorSum, pixel.colorSumSquared, pixel.sampleCount);
+        }
+
+        for (int p{ 0 }; p < static_cast<int>(pixels.size()); ++p)
+            storePixel(imageX + p % tileWidth, imageY + p / tileWidth, pixels[p].colorSum, pixels[p].sampleCount);
+    }
+}
+
 // Adaptive
 void threadRenderTiles()
 {
-    constexpr size_t minNumSamples{ 128 };
-    constexpr size_t maxNumSamples{ 128 };
-
     while (true)
     {
         const int tileIndex{ tileThreads::tileCounter++ };
@@ -283,6 +1018,12 @@ void threadRenderTiles()
         const int tileWidth{ std::min(tileThreads::tileSize, renderer.GetCamera().imgWidth - imageX) };
         const int tileHeight{ std::min(tileThreads::tileSize, renderer.GetCamera().imgHeight - imageY) };
 
+        if (wavefrontPathTracing || restirDirectLighting)
+        {
+            wavefront::renderTile(imageX, imageY, tileWidth, tileHeight);
+            continue;
+        }
+
         for (int j{ imageY }; j < imageY + tileHeight; ++j)
         {
             for (int i{ imageX }; i < imageX + tileWidth; ++i)
@@ -290,95 +1031,36 @@ void threadRenderTiles()
                 Color colorSum{ 0.0f };
                 Color colorSumSquared{ 0.0f };
                 size_t sampleCount{ 0 };
+                bool converged{ false };
 
                 const float aaOffsetPixelX{ tileThreads::rng.RandomFloat() };
                 const float aaOffsetPixelY{ tileThreads::rng.RandomFloat() };
                 const float dofOffsetTheta{ tileThreads::rng.RandomFloat() };
                 const float dofOffsetRadius{ tileThreads::rng.RandomFloat() };
 
-                for (size_t k{ 0 }; k < maxNumSamples; ++k)
+                // The samples of a pixel go through the first bounce as packets, and are then shaded one by one
+                for (size_t firstSample{ 0 }; firstSample < tileThreads::maxNumSamples && !converged; firstSample += rayPacketWidth)
                 {
-                    ++sampleCount;
-
-                    const float jitterX{ fmod(tileThreads::aaHaltonSeqX[k] + aaOffsetPixelX, 1.0f) };
-                    const float jitterY{ fmod(tileThreads::aaHaltonSeqY[k] + aaOffsetPixelY, 1.0f) };
-                    const float pixelX{ static_cast<float>(i) + jitterX };
-                    const float pixelY{ static_cast<float>(j) + jitterY };
-                    const float spaceX{ -tileThreads::imagePlaneHalfWidth + tileThreads::pixelSize * pixelX };
-                    const float spaceY{ tileThreads::imagePlaneHalfHeight - tileThreads::pixelSize * pixelY };
-                    const Vec3f worldRayDestination{ renderer.GetCamera().pos + tileThreads::cameraToWorld * Vec3f{spaceX, spaceY, -renderer.GetCamera().focaldist} };
-
-                    const float jitterTheta{ fmod(tileThreads::diskHaltonSeqTheta[k] + dofOffsetTheta, 1.0f) };
-                    const float jitterRadius{ fmod(tileThreads::diskHaltonSeqRadius[k] + dofOffsetRadius, 1.0f) };
-                    const float diskTheta{ jitterTheta * 2.0f * M_PI };
-                    const float diskRadius{ sqrt(jitterRadius) };
-                    const Vec3f cameraRayPosOffset{
-                        diskRadius * renderer.GetCamera().dof * cos(diskTheta),
-                        diskRadius * renderer.GetCamera().dof * sin(diskTheta),
-                        0.0f
-                    };
-
-                    const Vec3f worldRayPos{ renderer.GetCamera().pos + tileThreads::cameraToWorld * cameraRayPosOffset };
-                    const Vec3f worldRayDir{ worldRayDestination - worldRayPos };
-                    const Ray worldRay{ worldRayPos, worldRayDir };
-
-                    HitInfo hitInfo{};
-                    //ShadeInfo sInfo{ renderer.GetScene().lights, renderer.GetScene().environment, tileThreads::rng };
-                    //sInfo.SetPixelSample(i);
-                    const Color c{ tracePath(worldRay) };
-                    colorSum += c;
-                    colorSumSquared += c * c;
-                    //if (renderer.TraceRay(worldRay, hitInfo))
-                    //{
-                    //    if (hitInfo.light)
-                    //    {
-                    //        const Color c{ 1.0f };
-                    //        colorSum += c;
-                    //        colorSumSquared += c * c;
-                    //    }
-                    //    else
-                    //    {
-                    //        //sInfo.SetHit(worldRay, hitInfo);
-                    //        //const Color c{ hitInfo.light ? Color{ 1.0f, 1.0f, 1.0f } : hitInfo.node->GetMaterial()->Shade(sInfo) };
-                    //        // TODO: Path tracing algorithm
-                    //        colorSum += c;
-                    //        colorSumSquared += c * c;
-                    //    }
-                    //}
-                    //else
-                    //{
-                    //    const float u{ (static_cast<float>(i) + tileThreads::aaHaltonSeqX[k]) / static_cast<float>(renderer.GetCamera().imgWidth - 1) };
-                    //    const float v{ (static_cast<float>(j) + tileThreads::aaHaltonSeqY[k]) / static_cast<float>(renderer.GetCamera().imgHeight - 1) };
-                    //    const Color c{ renderer.GetScene().background.Eval( Vec3f{ u, v, 1.0f } ) };
-                    //    colorSum += c;
-                    //    colorSumSquared += c * c;
-                    //}
-
-                    if (sampleCount < minNumSamples)
-                        continue;
+                    const int packetSize{ static_cast<int>(std::min<size_t>(rayPacketWidth, tileThreads::maxNumSamples - firstSample)) };
+                    Ray cameraRays[rayPacketWidth]{};
+                    for (int lane{ 0 }; lane < packetSize; ++lane)
+                        cameraRays[lane] = generateCameraRay(i, j, firstSample + lane, aaOffsetPixelX, aaOffsetPixelY, dofOffsetTheta, dofOffsetRadius);
 
-                    const Color meanColor{ colorSum / sampleCount };
-                    Color sigma{ (colorSumSquared - ((colorSum * colorSum) / static_cast<float>(sampleCount))) / (static_cast<float>(sampleCount - 1)) };
-                    sigma.r = fmaxf(0.0f, sigma.r);
-                    sigma.g = fmaxf(0.0f, sigma.g);
-                    sigma.b = fmaxf(0.0f, sigma.b);
-                    sigma.r = sqrtf(sigma.r);
-                    sigma.g = sqrtf(sigma.g);
-                    sigma.b = sqrtf(sigma.b);
-                    const Color delta{ 3.0f * (sigma / sqrtf(static_cast<float>(sampleCount))) };
-                    constexpr float deltaMax{ 0.01f };
-
-                    if (delta.r < deltaMax && delta.g < deltaMax && delta.b < deltaMax)
-                        break;
-                }
+                    PrimaryHit primaryHits[rayPacketWidth];
+                    tracePrimaryPacket(cameraRays, (1 << packetSize) - 1, primaryHits);
+
+                    for (int lane{ 0 }; lane < packetSize && !converged; ++lane)
+                    {
+                        ++sampleCount;
 
-                Color c{ colorSum / static_cast<float>(sampleCount) };
-                if (renderer.GetCamera().sRGB)
-                    c = c.Linear2sRGB();
+                        const Color c{ tracePath(cameraRays[lane], primaryHits[lane]) };
+                        colorSum += c;
+                        colorSumSquared += c * c;
+                        converged = pixelConverged(colorSum, colorSumSquared, sampleCount);
+                    }
+                }
 
-                renderer.GetRenderImage().GetPixels()[j * renderer.GetCamera().imgWidth + i] = Color24{ c };
-                renderer.GetRenderImage().GetSampleCount()[j * renderer.GetCamera().imgWidth + i] = static_cast<int>(sampleCount);
-                renderer.GetRenderImage().IncrementNumRenderPixel(1);
+                storePixel(i, j, colorSum, sampleCount);
             }
         }
     }
@@ -412,6 +1094,7 @@ int main()
     const float aspectRatio{ static_cast<float>(renderer.GetCamera().imgWidth) / static_cast<float>(renderer.GetCamera().imgHeight) };
     tileThreads::imagePlaneHalfWidth = aspectRatio * tileThreads::imagePlaneHalfHeight;
     tileThreads::pixelSize = (tileThreads::imagePlaneHalfWidth * 2.0f) / static_cast<float>(renderer.GetCamera().imgWidth);
+    tileThreads::pixelSpread = tileThreads::pixelSize / renderer.GetCamera().focaldist;
 
     const auto start{ std::chrono::high_resolution_clock::now() };
 
@@ -609,6 +1292,17 @@ int main()
     const auto durationMilli{ std::chrono::duration_cast<std::chrono::milliseconds>(end - start) };
     const auto durationSeconds{ std::chrono::duration_cast<std::chrono::seconds>(end - start) };
     std::cout << "\nTime: " << durationSeconds << " : " << durationMilli % 1000 << '\n';
+    if (TriObj::NumDeferredBVHs() > 0)
+    {
+        const unsigned int numBuilt{ TriObj::NumLazyBuiltBVHs() };
+        std::cout << "Lazy BVHs: " << numBuilt << " of " << TriObj::NumDeferredBVHs() << " built, "
+                  << TriObj::NumDeferredBVHs() - numBuilt << " skipped\n";
+    }
+    if (renderer.GetSceneBVH().HasClusteredMeshes())
+    {
+        std::cout << "Clustered meshes: " << ClusteredMesh::NumPageIns() << " page-ins, " << ClusteredMesh::NumEvictions() << " evictions, "
+                  << ClusteredMesh::NumDeferredRays() << " deferred rays\n";
+    }
 
     renderer.GetRenderImage().ComputeZBufferImage();
     renderer.GetRenderImage().ComputeSampleCountImage();
@@ -20,13 +20,24 @@
 #include "scene.h"
 #include "cyCore/cyTriMesh.h"
 #include "cyCore/cyBVH.h"
+#include "widebvh.h"
+#include "quantizedbvh.h"
+#include "triangleblocks.h"
+#include "raypacket.h"
+#include "bvhcache.h"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 
 //-------------------------------------------------------------------------------
 
 class Sphere : public Object
 {
 public:
-	bool IntersectRay( Ray const &ray, HitInfo &hInfo, int hitSide=HIT_FRONT ) const override;
+	bool IntersectRayHit( Ray const &ray, RayHit &hit, int hitSide=HIT_FRONT ) const override;
+	void SetHitInfo( Ray const &ray, RayHit const &hit, HitInfo &hInfo ) const override;
     bool IntersectShadowRay( Ray const &ray, float t_max=BIGFLOAT ) const override;
 	Box  GetBoundBox() const override { return Box(-1,-1,-1,1,1,1); }
 	void ViewportDisplay( Material const *mtl ) const override;
@@ -37,7 +48,8 @@ public:
 class Plane : public Object
 {
 public:
-	bool IntersectRay( Ray const &ray, HitInfo &hInfo, int hitSide=HIT_FRONT ) const override;
+	bool IntersectRayHit( Ray const &ray, RayHit &hit, int hitSide=HIT_FRONT ) const override;
+	void SetHitInfo( Ray const &ray, RayHit const &hit, HitInfo &hInfo ) const override;
     bool IntersectShadowRay( Ray const &ray, float t_max=BIGFLOAT ) const override;
 	Box  GetBoundBox() const override { return Box(-1,-1,0,1,1,0); }
 	void ViewportDisplay( const Material *mtl ) const override;
@@ -50,24 +62,251 @@ extern Plane thePlane;
 class TriObj : public Object, public TriMesh
 {
 public:
-	bool IntersectRay( Ray const &ray, HitInfo &hInfo, int hitSide=HIT_FRONT ) const override;
+	bool IntersectRayHit( Ray const &ray, RayHit &hit, int hitSide=HIT_FRONT ) const override;
+	void SetHitInfo( Ray const &ray, RayHit const &hit, HitInfo &hInfo ) const override;
     bool IntersectShadowRay( Ray const &ray, float t_max=BIGFLOAT ) const override;
 	Box  GetBoundBox() const override { return Box(GetBoundMin(),GetBoundMax()); }
 	void ViewportDisplay( const Material *mtl ) const override;
 
-	bool Load( char const *filename )
+	struct BVHOptions
 	{
-		if ( ! LoadFromFileObj( filename ) ) return false;
-		if ( ! HasNormals() ) ComputeNormals();
-		ComputeBoundingBox();
-		bvh.SetMesh(this,4);
-		return true;
-	}
+		cy::BVH::SplitMethod splitMethod = cy::BVH::SPLIT_SAH;
+		float spatialSplitBudget = CY_BVH_SBVH_DEFAULT_BUDGET;	// duplicated triangle references of SPLIT_SBVH as a fraction of the triangle count
+		int width = 2;	// children per node used for traversal: 2 (binary), or 4 or 8 for the collapsed wide nodes
+		bool quantized = false;	// stores the child bounds of 4 and 8 wide nodes as 8-bit offsets, which halves the node memory
+		int leafBlockWidth = 1;	// triangles per SIMD leaf block: 4 or 8, or 1 to intersect the mesh faces one by one
+		bool cache = false;	// loads the BVH from a cache file if the mesh has not changed, and writes it after building otherwise
+		char const *cacheDir = nullptr;	// directory of the cache file, next to the mesh file if null
+		float rebuildThreshold = 1.5f;	// UpdateVertices rebuilds the BVH instead of refitting it once its SAH cost grows past this factor of the built cost
+		bool lazy = false;	// defers building the BVH until the first ray reaches the mesh, so meshes that no ray reaches are never built
+		int  lodLevels = 0;	// simplified levels of detail built after loading the mesh (see BuildLODs)
+	};
+	bool Load( char const *filename, BVHOptions const &options );
+	bool Load( char const *filename ) { return Load( filename, BVHOptions() ); }
+
+	// Replaces the positions of all NV() vertices of an animated mesh and updates its BVH by refitting it,
+	// or by rebuilding it if refitting has degraded it too much. Returns true if the BVH was rebuilt.
+	// Vertex normals are recomputed if the mesh file had none. It must not be called while rendering,
+	// and Renderer::UpdateScene must be called afterwards, since the bounding box of the mesh changes.
+	bool UpdateVertices( Vec3f const *positions );
+
+	// Makes this mesh a copy of the given mesh with its vertices and normals transformed by the given transformation,
+	// and builds its BVH with the same options. The scene BVH uses it to bake small meshes into world space.
+	void InitTransformed( TriObj const &mesh, Transformation const &transform );
+
+	// Level of detail chain: builds up to numLevels (at most maxLODLevels) simplified copies of the mesh, each with its own BVH
+	// built with the options of Load; Load reports their sizes and speeds. Level i clusters the vertices in cells of
+	// LODError(i), starting at twice the mean edge length and doubling with each level, and the chain stops early once
+	// a level no longer removes triangles. Rays with a footprint (see Ray::FootprintWidth) intersect the coarsest level
+	// whose error is at most their footprint width where they enter the bounding box, divided by lodQuality.
+	void BuildLODs( int numLevels );
+	int  NumLODs() const { return 1 + (int)lods.size(); }	// including the mesh itself as level 0
+	TriObj const & GetLOD( int level ) const { return level == 0 ? *this : *lods[level-1]; }
+	float LODError( int level ) const { return level == 0 ? 0 : lodErrors[level-1]; }
+	int  SelectLOD( Ray const &ray ) const;
+	static constexpr int   maxLODLevels = 8;
+	static constexpr float lodQuality   = 1;	// larger values select finer levels, and 0 always uses the full mesh
+
+	size_t MemoryBytes() const;	// the mesh, its BVH, and its traversal data, without the other levels of detail
+
+	// Statistics of the lazy BVHs of all meshes: how many were deferred at load time and how many of them have been built since
+	static unsigned int NumDeferredBVHs();
+	static unsigned int NumLazyBuiltBVHs();
+
+	// Packet versions of IntersectRayHit and IntersectShadowRay for the lanes in laneMask, in the local coordinates of the mesh.
+	// They traverse the binary BVH once for the whole packet. IntersectPacket sets the hits of the lanes that hit the mesh
+	// within their packet.tMax, shortens their tMax to the hit, and returns their mask. IntersectShadowPacket returns the mask
+	// of the lanes that hit anything within their tMax.
+	int  IntersectPacket      ( RayPacket<rayPacketWidth> &packet, int laneMask, RayHit *hit, int hitSide=HIT_FRONT ) const;
+	int  IntersectShadowPacket( RayPacket<rayPacketWidth> const &packet, int laneMask ) const;
+
+	// Batch versions of IntersectRayHit and IntersectShadowRay for count independent rays, in the local coordinates of the mesh.
+	// IntersectRays sets found[i] and hit[i] if rays[i] hits the mesh closer than hit[i].z, and IntersectShadowRays sets occluded[i]
+	// if rays[i] hits anything within t_max[i]. With 4 or 8 wide nodes and leaf blocks, interleavedRays rays are traversed at a time,
+	// switching between them after every node, so that the cache misses of one ray overlap with the work on the others.
+	void IntersectRays      ( Ray const *rays, RayHit *hit, bool *found, size_t count, int hitSide=HIT_FRONT ) const;
+	void IntersectShadowRays( Ray const *rays, float const *t_max, bool *occluded, size_t count ) const;
+	static constexpr int interleavedRays = 8;
 
 private:
 	BVHTriMesh bvh;
-	bool IntersectTriangle( Ray const &ray, HitInfo &hInfo, int hitSide, unsigned int faceID ) const;
-	bool TraceBVHNode     ( Ray const &ray, HitInfo &hInfo, int hitSide, unsigned int nodeID ) const;
+	BVHCache   bvhCache;
+	WideBVH<4> bvh4;
+	WideBVH<8> bvh8;
+	QuantizedBVH<4> quantizedBVH4;
+	QuantizedBVH<8> quantizedBVH8;
+	int        bvhWidth = 2;
+	bool       quantizedNodes = false;
+	float      builtSAHCost = 0;
+	float      rebuildThreshold = 1.5f;
+	bool       computedNormals = false;
+	TriangleBlocks<4> leafBlocks4;
+	TriangleBlocks<8> leafBlocks8;
+	int        leafBlockWidth = 1;
+	BVHOptions  bvhOptions;	// the options of Load, without cacheDir
+	std::string meshFile;	// empty for the world-space copies of InitTransformed
+	std::string cacheDir;
+	bool        lazyBVH = false;
+	bool        bvhBuilt = false;
+	mutable std::once_flag bvhBuildFlag;
+	std::vector<std::unique_ptr<TriObj>> lods;	// levels 1 and up
+	std::vector<float> lodErrors;	// the cell sizes of lods in object space
+	void   InitSimplified( TriObj const &mesh, float cellSize );	// vertex clustering of mesh, used by BuildLODs
+	void   InitBVHFrom( TriObj const &mesh );	// builds the BVH of a mesh derived from mesh with its options, but neither cached nor reported
+	void   ReportLODs() const;	// prints the triangles, memory, and closest-hit ray rate of each level
+	void   BuildBVH();	// builds (or loads from the cache) bvh and the traversal data with bvhOptions
+	void   BuildLazyBVH() const;	// builds a lazy BVH once, on the first call from any thread
+	size_t BuildTraversalData();	// builds the wide nodes and leaf blocks from bvh and returns the size of the uncompressed nodes
+	template <bool anyHit, typename LeafFunc> bool Traverse( TraversalRay const &ray, float &tMax, LeafFunc &&intersectLeaf ) const;
+	bool   CanInterleave() const { return (bvhWidth == 4 || bvhWidth == 8) && !quantizedNodes && (leafBlockWidth == 4 || leafBlockWidth == 8); }
+	template <bool anyHit, typename LeafFunc> void TraverseInterleaved( TraversalRay const *rays, float *tMax, size_t count, LeafFunc &&intersectLeaf ) const;
+};
+
+//-------------------------------------------------------------------------------
+
+// A large set of spheres, such as the particles of a simulation, as a single object.
+// Instead of a Node with a full transformation per sphere, the centers and radii are
+// kept in SoA blocks of 16 spheres (16 bytes per sphere) under a BVH of the blocks,
+// and each block is intersected with two 8-wide SIMD kernels. The blocks are filled
+// in Morton order of the centers, so the spheres of a block are close together, and
+// blocks of 16 keep the BVH small enough for a total under 20 bytes per sphere.
+class SphereSet : public Object
+{
+public:
+	bool IntersectRayHit( Ray const &ray, RayHit &hit, int hitSide=HIT_FRONT ) const override;
+	void SetHitInfo( Ray const &ray, RayHit const &hit, HitInfo &hInfo ) const override;
+    bool IntersectShadowRay( Ray const &ray, float t_max=BIGFLOAT ) const override;
+	Box  GetBoundBox() const override { return boundBox; }
+	void ViewportDisplay( const Material *mtl ) const override;
+
+	// Loads a binary particle file: the characters "SPHS", the number of spheres as a 32-bit unsigned
+	// integer, and then the center x, y, z and the radius of each sphere as 32-bit floats.
+	bool Load( char const *filename );
+
+	unsigned int NumSpheres() const { return numSpheres; }
+	size_t MemoryBytes() const;	// the blocks and the BVH
+
+private:
+	static constexpr int blockWidth = 16;
+	static constexpr int simdWidth  = 8;
+	struct Block
+	{
+		alignas(32) float center[3][blockWidth];	// NaN in the unused lanes of the last block, which no ray can hit
+		alignas(32) float radius[blockWidth];
+	};
+
+	class BlockBVH : public cy::BVH
+	{
+	public:
+		void Build( std::vector<Block> const &b ) { blocks = &b; SetSplitMethod(SPLIT_SAH); cy::BVH::Build( (unsigned int)b.size() ); }
+	protected:
+		void  GetElementBounds( unsigned int i, float box[6] ) const override;
+		float GetElementCenter( unsigned int i, int dimension ) const override { float box[6]; GetElementBounds(i,box); return 0.5f*(box[dimension]+box[dimension+3]); }
+	private:
+		std::vector<Block> const *blocks = nullptr;
+	};
+
+	std::vector<Block> blocks;
+	BlockBVH     bvh;
+	Box          boundBox;
+	unsigned int numSpheres = 0;
+
+	// Returns the lanes of the block hit within (0,tMax] on the given side and writes their distances and sides
+	int IntersectBlock( Block const &block, TraversalRay const &ray, int hitSide, float tMax, float *t, float *front ) const;
+};
+
+//-------------------------------------------------------------------------------
+
+// A triangle mesh too large to keep in memory. Load converts the OBJ file once into a cluster file: the triangles
+// are sorted in Morton order of their centers and cut into spatial clusters, and each cluster keeps its own vertex
+// arrays and BVH at a page-aligned offset of the file. Only the cluster bounds and a BVH over them stay in memory;
+// a cluster is memory-mapped when a ray first reaches it, and the least recently used clusters are unmapped once
+// the mapped ones exceed the resident budget. Converting needs the whole mesh in memory once, rendering does not.
+//
+// IntersectRayHit, IntersectShadowRay, and SetHitInfo wait for the clusters they reach to be paged in. The batch
+// traversal of SceneBVH defers rays instead: IntersectResident only intersects the resident clusters and returns
+// the others that the ray reaches, and once a whole batch of rays has gone through, each deferred cluster is pinned
+// (paged in) once for all of its rays, so the cost of a page-in is shared by many rays instead of stalling each one.
+class ClusteredMesh : public Object
+{
+public:
+	ClusteredMesh();
+	~ClusteredMesh() override;
+
+	bool IntersectRayHit( Ray const &ray, RayHit &hit, int hitSide=HIT_FRONT ) const override;
+	void SetHitInfo( Ray const &ray, RayHit const &hit, HitInfo &hInfo ) const override;
+	bool IntersectShadowRay( Ray const &ray, float t_max=BIGFLOAT ) const override;
+	Box  GetBoundBox() const override { return boundBox; }
+	void ViewportDisplay( const Material *mtl ) const override;
+
+	static constexpr unsigned int clusterFaceBits = 16;	// RayHit::primID holds the cluster above these bits and its face below them
+	static constexpr unsigned int maxClusterFaces = 1u << clusterFaceBits;
+	static constexpr unsigned int maxClusters = 1u << (32 - clusterFaceBits);	// the clusters that fit above the face bits
+
+	struct Options
+	{
+		unsigned int clusterFaces = 16384;	// triangles per cluster, up to maxClusterFaces, and raised if the mesh would need more than maxClusters
+		size_t residentBudget = size_t(256) << 20;	// bytes of mapped clusters, beyond which the least recently used ones are unmapped
+		char const *clusterDir = nullptr;	// directory of the cluster file, next to the mesh file if null
+	};
+	bool Load( char const *filename, Options const &options );
+
+	unsigned int NumClusters() const { return numClusters; }
+	Box          GetClusterBox( unsigned int cluster ) const;
+	size_t       ResidentBytes() const { return residentBytes; }
+	unsigned int NumMaterials() const { return numMaterials; }	// the materials of the OBJ file, which a clustered mesh does not use
+
+	// Deferred traversal. IntersectResident is IntersectRayHit over the resident clusters, and it appends the other clusters
+	// that the ray reaches before hit.z to deferred (IntersectResidentShadow is the same for shadow rays). ReachesCluster tests
+	// a ray against the bounds of a cluster. IntersectCluster and IntersectClusterShadow may only be called between PinCluster,
+	// which pages the cluster in if needed and keeps it from being unmapped, and UnpinCluster.
+	bool IntersectResident      ( Ray const &ray, RayHit &hit, int hitSide, std::vector<unsigned int> &deferred ) const;
+	bool IntersectResidentShadow( Ray const &ray, float t_max, std::vector<unsigned int> &deferred ) const;
+	bool ReachesCluster         ( unsigned int cluster, Ray const &ray, float t_max ) const;
+	void PinCluster  ( unsigned int cluster ) const;
+	void UnpinCluster( unsigned int cluster ) const;
+	bool IntersectCluster      ( unsigned int cluster, Ray const &ray, RayHit &hit, int hitSide ) const;
+	bool IntersectClusterShadow( unsigned int cluster, Ray const &ray, float t_max ) const;
+
+	// Statistics of all clustered meshes: clusters paged in and out, and rays deferred by the batch traversal
+	static unsigned int NumPageIns();
+	static unsigned int NumEvictions();
+	static unsigned int NumDeferredRays();
+	static void         AddDeferredRays( unsigned int count );
+
+private:
+	struct ClusterInfo;	// the cluster table entry of the file
+	struct Cluster;		// the residency of a cluster
+
+	class ClusterBVH : public cy::BVH
+	{
+	public:
+		void Build( std::vector<ClusterInfo> const &c );
+	protected:
+		void  GetElementBounds( unsigned int i, float box[6] ) const override;
+		float GetElementCenter( unsigned int i, int dimension ) const override { float box[6]; GetElementBounds(i,box); return 0.5f*(box[dimension]+box[dimension+3]); }
+	private:
+		std::vector<ClusterInfo> const *clusterInfos = nullptr;
+	};
+
+	std::vector<ClusterInfo>   clusterInfos;
+	std::unique_ptr<Cluster[]> clusters;
+	unsigned int numClusters = 0;
+	unsigned int numMaterials = 0;
+	ClusterBVH   bvh;	// over the bounds of the clusters
+	Box          boundBox;
+	std::string  clusterFile;
+	int          fileDescriptor = -1;
+	size_t       residentBudget = 0;
+	mutable std::atomic<size_t>   residentBytes{ 0 };
+	mutable std::atomic<uint64_t> useClock{ 0 };
+	mutable std::mutex evictMutex;
+
+	bool BuildClusterFile( char const *filename, uint64_t contentHash, unsigned int clusterFaces ) const;
+	bool OpenClusterFile( uint64_t contentHash );
+	void PageIn( unsigned int cluster ) const;
+	void EvictOverBudget() const;
+	template <bool anyHit, typename ClusterFunc> bool TraverseClusters( Ray const &ray, float &tMax, ClusterFunc &&intersectCluster ) const;
 };
 
 //-------------------------------------------------------------------------------
@@ -0,0 +1,259 @@
+#ifndef _QUANTIZEDBVH_H_INCLUDED_
+#define _QUANTIZEDBVH_H_INCLUDED_
+
+#include "widebvh.h"
+
+#include <immintrin.h>
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Compressed version of a WideBVH. The child bounds of a node are stored as 8-bit
+// offsets on a grid local to the node: a child bound is origin + q * 2^exponent per
+// axis. The bounds are rounded outwards when they are quantized, so the decoded
+// boxes always contain the original ones and the traversal finds the same hits,
+// only visiting a few more nodes. A node is 64 bytes for width 4 and 96 bytes for
+// width 8, about half the size of a WideBVH node.
+template <int width>
+class QuantizedBVH
+{
+    static_assert(width == 4 || width == 8, "QuantizedBVH supports 4 and 8 children per node");
+
+public:
+    static constexpr unsigned int leafFlag{ WideBVH<width>::leafFlag };
+
+    struct alignas(width == 4 ? 64 : 32) Node
+    {
+        float origin[3];                 // minimum corner of the children
+        int8_t exponent[3];              // grid spacing of each axis is 2^exponent
+        uint8_t childCount;
+        uint8_t bounds[6][width];        // quantized minX, minY, minZ, maxX, maxY, maxZ of each child
+        unsigned int children[width];    // node index, or binary leaf node ID | leafFlag
+    };
+
+    void Build(const WideBVH<width>& wideBVH)
+    {
+        nodes.assign(wideBVH.NumNodes(), Node{});
+        for (size_t i{ 0 }; i < nodes.size(); ++i)
+            quantize(wideBVH.GetNode(i), nodes[i]);
+    }
+
+    bool IsEmpty() const { return nodes.empty(); }
+    size_t NumNodes() const { return nodes.size(); }
+    size_t MemoryBytes() const { return nodes.size() * sizeof(Node); }
+
+    // Same contract as WideBVH::Traverse
+    template <bool anyHit, typename LeafFunc>
+    bool Traverse(const TraversalRay& ray, float& tMax, LeafFunc&& intersectLeaf) const;
+
+private:
+    static constexpr int maxStackSize{ 64 * width };
+    static constexpr int minExponent{ -126 };
+    static constexpr int maxExponent{ 127 };
+
+    struct StackEntry
+    {
+        unsigned int child;
+        float tNear;
+    };
+
+    std::vector<Node> nodes;
+
+    static float gridSpacing(int exponent) { return std::bit_cast<float>(static_cast<uint32_t>(exponent + 127) << 23); }
+
+    // q * spacing is exact for 8-bit q and a power of two spacing, so this gives
+    // the same result with or without a fused multiply-add.
+    static float decode(float origin, float spacing, int q) { return origin + static_cast<float>(q) * spacing; }
+
+    static void quantize(const typename WideBVH<width>::Node& wideNode, Node& node)
+    {
+        const int count{ static_cast<int>(wideNode.childCount) };
+        node.childCount = static_cast<uint8_t>(count);
+        for (int i{ 0 }; i < width; ++i)
+            node.children[i] = i < count ? wideNode.children[i] : 0;
+
+        for (int axis{ 0 }; axis < 3; ++axis)
+        {
+            float lo{ wideNode.bounds[axis][0] };
+            float hi{ wideNode.bounds[axis + 3][0] };
+            for (int i{ 1 }; i < count; ++i)
+            {
+                lo = std::min(lo, wideNode.bounds[axis][i]);
+                hi = std::max(hi, wideNode.bounds[axis + 3][i]);
+            }
+
+            // The smallest power of two spacing whose 255 steps still reach the maximum
+            int exponent{ minExponent };
+            if (hi > lo)
+            {
+                int binaryExponent;
+                std::frexp((hi - lo) / 255.0f, &binaryExponent);
+                exponent = std::clamp(binaryExponent, minExponent, maxExponent);
+            }
+            while (exponent > minExponent && decode(lo, gridSpacing(exponent - 1), 255) >= hi) --exponent;
+            while (exponent < maxExponent && decode(lo, gridSpacing(exponent), 255) < hi) ++exponent;
+
+            const float spacing{ gridSpacing(exponent) };
+            node.origin[axis] = lo;
+            node.exponent[axis] = static_cast<int8_t>(exponent);
+
+            for (int i{ 0 }; i < width; ++i)
+            {
+                if (i >= count)
+                {
+                    node.bounds[axis][i] = 0;
+                    node.bounds[axis + 3][i] = 0;
+                    continue;
+                }
+
+                // Round outwards and fix the cases where the float arithmetic of the decode rounds inwards
+                int qMin{ std::clamp(static_cast<int>(std::floor((wideNode.bounds[axis][i] - lo) / spacing)), 0, 255) };
+                while (qMin > 0 && decode(lo, spacing, qMin) > wideNode.bounds[axis][i]) --qMin;
+                int qMax{ std::clamp(static_cast<int>(std::ceil((wideNode.bounds[axis + 3][i] - lo) / spacing)), 0, 255) };
+                while (qMax < 255 && decode(lo, spacing, qMax) < wideNode.bounds[axis + 3][i]) ++qMax;
+
+                node.bounds[axis][i] = static_cast<uint8_t>(qMin);
+                node.bounds[axis + 3][i] = static_cast<uint8_t>(qMax);
+            }
+        }
+    }
+
+    // Decodes the child bounds and tests them like WideBVH, so the decoded planes
+    // go through the same float operations as the planes of an uncompressed node.
+    // Returns a bit mask of the children that the ray hits within [0, tMax] and
+    // writes their entry distances.
+    static int intersectChildren(const Node& node, const TraversalRay& ray, float tMax, float* tNear)
+    {
+        int mask;
+        if constexpr (width == 8)
+        {
+#ifdef __AVX2__
+            __m256 tMin8{ _mm256_setzero_ps() };
+            __m256 tMax8{ _mm256_set1_ps(tMax) };
+            for (int axis{ 0 }; axis < 3; ++axis)
+            {
+                const __m256 origin{ _mm256_set1_ps(node.origin[axis]) };
+                const __m256 o{ _mm256_set1_ps(ray.p[axis]) };
+                const __m256 spacing{ _mm256_set1_ps(gridSpacing(node.exponent[axis])) };
+                const __m256 id{ _mm256_set1_ps(ray.invDir[axis]) };
+                const uint8_t* qNear{ node.bounds[axis + 3 * ray.sign[axis]] };
+                const uint8_t* qFar{ node.bounds[axis + 3 - 3 * ray.sign[axis]] };
+                const __m256 near{ _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(qNear)))) };
+                const __m256 far{ _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(qFar)))) };
+                const __m256 t0{ _mm256_mul_ps(_mm256_sub_ps(_mm256_add_ps(origin, _mm256_mul_ps(near, spacing)), o), id) };
+                const __m256 t1{ _mm256_mul_ps(_mm256_sub_ps(_mm256_add_ps(origin, _mm256_mul_ps(far, spacing)), o), id) };
+                tMin8 = _mm256_max_ps(tMin8, t0);
+                tMax8 = _mm256_min_ps(tMax8, t1);
+            }
+            _mm256_storeu_ps(tNear, tMin8);
+            mask = _mm256_movemask_ps(_mm256_cmp_ps(tMin8, tMax8, _CMP_LE_OQ));
+#else
+            mask = intersectChildrenScalar(node, ray, tMax, tNear);
+#endif
+        }
+        else
+        {
+#ifdef __SSE4_1__
+            __m128 tMin4{ _mm_setzero_ps() };
+            __m128 tMax4{ _mm_set1_ps(tMax) };
+            for (int axis{ 0 }; axis < 3; ++axis)
+            {
+                const __m128 origin{ _mm_set1_ps(node.origin[axis]) };
+                const __m128 o{ _mm_set1_ps(ray.p[axis]) };
+                const __m128 spacing{ _mm_set1_ps(gridSpacing(node.exponent[axis])) };
+                const __m128 id{ _mm_set1_ps(ray.invDir[axis]) };
+                uint32_t qNear, qFar;
+                std::memcpy(&qNear, node.bounds[axis + 3 * ray.sign[axis]], 4);
+                std::memcpy(&qFar, node.bounds[axis + 3 - 3 * ray.sign[axis]], 4);
+                const __m128 near{ _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(static_cast<int>(qNear)))) };
+                const __m128 far{ _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(static_cast<int>(qFar)))) };
+                const __m128 t0{ _mm_mul_ps(_mm_sub_ps(_mm_add_ps(origin, _mm_mul_ps(near, spacing)), o), id) };
+                const __m128 t1{ _mm_mul_ps(_mm_sub_ps(_mm_add_ps(origin, _mm_mul_ps(far, spacing)), o), id) };
+                tMin4 = _mm_max_ps(tMin4, t0);
+                tMax4 = _mm_min_ps(tMax4, t1);
+            }
+            _mm_storeu_ps(tNear, tMin4);
+            mask = _mm_movemask_ps(_mm_cmple_ps(tMin4, tMax4));
+#else
+            mask = intersectChildrenScalar(node, ray, tMax, tNear);
+#endif
+        }
+        return mask & ((1 << node.childCount) - 1);
+    }
+
+    [[maybe_unused]] static int intersectChildrenScalar(const Node& node, const TraversalRay& ray, float tMax, float* tNear)
+    {
+        int mask{ 0 };
+        for (int i{ 0 }; i < width; ++i)
+        {
+            float tMinI{ 0.0f };
+            float tMaxI{ tMax };
+            for (int axis{ 0 }; axis < 3; ++axis)
+            {
+                const float spacing{ gridSpacing(node.exponent[axis]) };
+                const float near{ decode(node.origin[axis], spacing, node.bounds[axis + 3 * ray.sign[axis]][i]) };
+                const float far{ decode(node.origin[axis], spacing, node.bounds[axis + 3 - 3 * ray.sign[axis]][i]) };
+                tMinI = std::max(tMinI, (near - ray.p[axis]) * ray.invDir[axis]);
+                tMaxI = std::min(tMaxI, (far - ray.p[axis]) * ray.invDir[axis]);
+            }
+            tNear[i] = tMinI;
+            if (tMinI <= tMaxI) mask |= 1 << i;
+        }
+        return mask;
+    }
+};
+
+template <int width>
+template <bool anyHit, typename LeafFunc>
+bool QuantizedBVH<width>::Traverse(const TraversalRay& ray, float& tMax, LeafFunc&& intersectLeaf) const
+{
+    if (nodes.empty()) return false;
+
+    StackEntry nodeStack[maxStackSize];
+    int stackSize{ 0 };
+    nodeStack[stackSize++] = { 0, 0.0f };
+
+    while (stackSize > 0)
+    {
+        const StackEntry entry{ nodeStack[--stackSize] };
+        if (entry.tNear > tMax)
+            continue;
+
+        if (entry.child & leafFlag)
+        {
+            if (intersectLeaf(entry.child & ~leafFlag) && anyHit)
+                return true;
+            continue;
+        }
+
+        const Node& node{ nodes[entry.child] };
+        alignas(32) float tNear[width];
+        int mask{ intersectChildren(node, ray, tMax, tNear) };
+        if (mask == 0) continue;
+
+        // Sort the hit children far to near, so that the nearest one is popped first
+        StackEntry hits[width];
+        int hitCount{ 0 };
+        while (mask != 0)
+        {
+            const int i{ std::countr_zero(static_cast<unsigned int>(mask)) };
+            mask &= mask - 1;
+
+            const StackEntry hitEntry{ node.children[i], tNear[i] };
+            int j{ hitCount++ };
+            for (; j > 0 && hits[j - 1].tNear < hitEntry.tNear; --j)
+                hits[j] = hits[j - 1];
+            hits[j] = hitEntry;
+        }
+
+        for (int i{ 0 }; i < hitCount; ++i)
+            nodeStack[stackSize++] = hits[i];
+    }
+
+    return false;
+}
+
+#endif
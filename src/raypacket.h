@@ -0,0 +1,214 @@
+#ifndef _RAYPACKET_H_INCLUDED_
+#define _RAYPACKET_H_INCLUDED_
+
+#include "bvhtraversal.h"
+#include "simdfloat.h"
+
+#include <bit>
+
+// Packets match the AVX registers of the SIMD kernels
+constexpr int rayPacketWidth{ 8 };
+
+// Coherent rays (e.g. the camera rays of a pixel or the shadow rays toward a
+// point light) in SoA lanes, so that a BVH node or a triangle is tested against
+// all of them with one SIMD kernel. Lanes are selected with bit masks, one bit
+// per lane: lanes that are unused, or that have finished their traversal, are
+// simply left out of the mask and their values are ignored.
+template <int width>
+struct RayPacket
+{
+    static constexpr int allLanes{ (1 << width) - 1 };
+    static constexpr float triangleEpsilon{ 1e-6f };   // same as the single ray triangle tests
+
+    alignas(32) float p[3][width];
+    alignas(32) float dir[3][width];
+    alignas(32) float invDir[3][width];
+    alignas(32) float tMax[width];
+    float coneWidth[width];
+    float coneSpread[width];
+
+    void Set(int lane, const Ray& ray, float t)
+    {
+        for (int axis{ 0 }; axis < 3; ++axis)
+        {
+            p[axis][lane] = ray.p[axis];
+            dir[axis][lane] = ray.dir[axis];
+            invDir[axis][lane] = 1.0f / ray.dir[axis];
+        }
+        tMax[lane] = t;
+        coneWidth[lane] = ray.coneWidth;
+        coneSpread[lane] = ray.coneSpread;
+    }
+
+    Ray GetRay(int lane) const
+    {
+        return Ray{ Vec3f{ p[0][lane], p[1][lane], p[2][lane] }, Vec3f{ dir[0][lane], dir[1][lane], dir[2][lane] }, coneWidth[lane], coneSpread[lane] };
+    }
+};
+
+// Slab test of a cy::BVH node box (min xyz, max xyz) against the lanes in laneMask,
+// each within [0, tMax]. The lanes may point in different directions, so the near
+// and far planes are picked with min/max instead of the sign of TraversalRay.
+// Returns the mask of the lanes that hit the box.
+template <int width>
+int IntersectPacketBVHNode(const RayPacket<width>& packet, const float* bounds, int laneMask)
+{
+    using F = SimdFloat<width>;
+
+    F tNear{ F::Set(0.0f) };
+    F tFar{ F::Load(packet.tMax) };
+    for (int axis{ 0 }; axis < 3; ++axis)
+    {
+        const F p{ F::Load(packet.p[axis]) };
+        const F invDir{ F::Load(packet.invDir[axis]) };
+        const F t0{ (F::Set(bounds[axis]) - p) * invDir };
+        const F t1{ (F::Set(bounds[axis + 3]) - p) * invDir };
+        tNear = Max(tNear, Min(t0, t1));
+        tFar = Min(tFar, Max(t0, t1));
+    }
+    return (tNear <= tFar).Mask() & laneMask;
+}
+
+// Möller-Trumbore of one triangle against the lanes in laneMask. Returns the mask
+// of the lanes hit within (epsilon, tMax] and writes their t, det, u, and v.
+template <int width>
+int IntersectPacketTriangle(const RayPacket<width>& packet, const Vec3f& v0, const Vec3f& v1, const Vec3f& v2, int hitSide, int laneMask,
+                            float* tOut, float* detOut, float* uOut, float* vOut)
+{
+    using F = SimdFloat<width>;
+
+    const Vec3f e1{ v1 - v0 };
+    const Vec3f e2{ v2 - v0 };
+    const F e1x{ F::Set(e1.x) }, e1y{ F::Set(e1.y) }, e1z{ F::Set(e1.z) };
+    const F e2x{ F::Set(e2.x) }, e2y{ F::Set(e2.y) }, e2z{ F::Set(e2.z) };
+    const F dx{ F::Load(packet.dir[0]) }, dy{ F::Load(packet.dir[1]) }, dz{ F::Load(packet.dir[2]) };
+
+    const F px{ dy * e2z - dz * e2y };
+    const F py{ dz * e2x - dx * e2z };
+    const F pz{ dx * e2y - dy * e2x };
+    const F det{ e1x * px + e1y * py + e1z * pz };
+
+    const F eps{ F::Set(RayPacket<width>::triangleEpsilon) };
+    const F negEps{ F::Set(-RayPacket<width>::triangleEpsilon) };
+    F mask{ hitSide == HIT_FRONT ? det >= eps : hitSide == HIT_BACK ? det <= negEps : (det >= eps) | (det <= negEps) };
+    if ((mask.Mask() & laneMask) == 0) return 0;
+
+    const F invDet{ F::Set(1.0f) / det };
+    const F sx{ F::Load(packet.p[0]) - F::Set(v0.x) };
+    const F sy{ F::Load(packet.p[1]) - F::Set(v0.y) };
+    const F sz{ F::Load(packet.p[2]) - F::Set(v0.z) };
+
+    const F u{ invDet * (sx * px + sy * py + sz * pz) };
+
+    const F qx{ sy * e1z - sz * e1y };
+    const F qy{ sz * e1x - sx * e1z };
+    const F qz{ sx * e1y - sy * e1x };
+    const F v{ invDet * (dx * qx + dy * qy + dz * qz) };
+    const F t{ invDet * (e2x * qx + e2y * qy + e2z * qz) };
+
+    const F zero{ F::Set(0.0f) };
+    const F one{ F::Set(1.0f) };
+    mask = mask & (u >= zero) & (u <= one) & (v >= zero) & (u + v <= one) & (t > eps) & (t <= F::Load(packet.tMax));
+
+    const int hitMask{ mask.Mask() & laneMask };
+    if (hitMask != 0)
+    {
+        t.Store(tOut);
+        det.Store(detOut);
+        u.Store(uOut);
+        v.Store(vOut);
+    }
+    return hitMask;
+}
+
+// Depth-first traversal of the subtree of nodeID of a binary cy::BVH with a whole
+// packet, for the lanes in nodeLaneMask, visiting each node once for all lanes that
+// hit its box. A stack entry keeps the lanes that hit the parent, and the box test on
+// pop drops the lanes that miss the node, so the packet thins out as it goes down the
+// tree and a node nobody hits is skipped. intersectLeaf(leafNodeID, laneMask) returns
+// the lanes it found a hit for, which are added to hitMask. For closest-hit traversal
+// (anyHit == false) it shortens packet.tMax of those lanes, which culls the remaining
+// nodes; for any-hit traversal the lanes it returns are done, and the traversal stops
+// and returns true once all lanes of laneMask are done. The stack holds at most one
+// entry per level plus one, so a node whose children do not fit, which only a tree
+// deeper than the stack can reach, has its subtree traversed with a new stack.
+template <bool anyHit, int width, typename LeafFunc>
+bool TraversePacketBVHSubtree(const cy::BVH& bvh, const RayPacket<width>& packet, int laneMask, unsigned int nodeID, int nodeLaneMask, int& hitMask, LeafFunc& intersectLeaf)
+{
+    constexpr int maxStackSize{ 128 };
+    struct StackEntry
+    {
+        unsigned int nodeID;
+        int laneMask;
+    };
+
+    StackEntry nodeStack[maxStackSize];
+    int stackSize{ 0 };
+    nodeStack[stackSize++] = { nodeID, nodeLaneMask };
+
+    while (stackSize > 0)
+    {
+        const StackEntry entry{ nodeStack[--stackSize] };
+        const int activeMask{ anyHit ? entry.laneMask & ~hitMask : entry.laneMask };
+        const int nodeMask{ activeMask == 0 ? 0 : IntersectPacketBVHNode(packet, bvh.GetNodeBounds(entry.nodeID), activeMask) };
+        if (nodeMask == 0)
+            continue;
+
+        if (bvh.IsLeafNode(entry.nodeID))
+        {
+            hitMask |= intersectLeaf(entry.nodeID, nodeMask);
+            if (anyHit && (laneMask & ~hitMask) == 0)
+                return true;
+            continue;
+        }
+
+        if (stackSize + 2 > maxStackSize)
+        {
+            if (TraversePacketBVHSubtree<anyHit>(bvh, packet, laneMask, entry.nodeID, nodeMask, hitMask, intersectLeaf) && anyHit)
+                return true;
+            continue;
+        }
+
+        unsigned int child1ID, child2ID;
+        bvh.GetChildNodes(entry.nodeID, child1ID, child2ID);
+
+        // The children are ordered along the axis that separates them most, using the
+        // direction of the first lane, and the near one is pushed last to be visited first
+        const float* bounds1{ bvh.GetNodeBounds(child1ID) };
+        const float* bounds2{ bvh.GetNodeBounds(child2ID) };
+        int axis{ 0 };
+        float maxSeparation{ -1.0f };
+        for (int a{ 0 }; a < 3; ++a)
+        {
+            const float separation{ (bounds2[a] + bounds2[a + 3]) - (bounds1[a] + bounds1[a + 3]) };
+            const float absSeparation{ separation < 0.0f ? -separation : separation };
+            if (absSeparation > maxSeparation)
+            {
+                maxSeparation = absSeparation;
+                axis = a;
+            }
+        }
+        const int lane{ std::countr_zero(static_cast<unsigned int>(nodeMask)) };
+        const float separation{ (bounds2[axis] + bounds2[axis + 3]) - (bounds1[axis] + bounds1[axis + 3]) };
+        const bool child1First{ (separation >= 0.0f) == (packet.dir[axis][lane] >= 0.0f) };
+
+        nodeStack[stackSize++] = { child1First ? child2ID : child1ID, nodeMask };
+        nodeStack[stackSize++] = { child1First ? child1ID : child2ID, nodeMask };
+    }
+
+    return false;
+}
+
+// Traverses the whole cy::BVH with the lanes in laneMask; see TraversePacketBVHSubtree.
+// Returns the lanes with a hit.
+template <bool anyHit, int width, typename LeafFunc>
+int TraversePacketBVH(const cy::BVH& bvh, const RayPacket<width>& packet, int laneMask, LeafFunc&& intersectLeaf)
+{
+    if (bvh.GetNumNodes() == 0 || laneMask == 0) return 0;
+
+    int hitMask{ 0 };
+    TraversePacketBVHSubtree<anyHit>(bvh, packet, laneMask, bvh.GetRootNodeID(), laneMask, hitMask, intersectLeaf);
+    return hitMask;
+}
+
+#endif
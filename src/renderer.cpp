@@ -5,3 +5,5 @@ const bool doingDirectWithPhotonMapping{ false };
 const bool doingIndirectWithPhotonMapping{ true };
 const bool doingCaustics{ true };
 const bool monteCarloWithPhoton{ false };
+const bool wavefrontPathTracing{ false };   // renders the tiles with the wavefront integrator of main.cpp instead of tracePath
+const bool restirDirectLighting{ false };   // resamples the direct lighting of the primary hits from the lights with an area with ReSTIR, in the wavefront integrator
@@ -20,6 +20,8 @@
 //-------------------------------------------------------------------------------
 
 #include "scene.h"
+#include "scenebvh.h"
+#include "lighttree.h"
 #include "rng.h"
 
 #include "lodepng.h"
@@ -28,6 +30,8 @@ const extern bool doingDirectWithPhotonMapping;
 const extern bool doingIndirectWithPhotonMapping;
 const extern bool doingCaustics;
 const extern bool monteCarloWithPhoton;
+const extern bool wavefrontPathTracing;
+const extern bool restirDirectLighting;
 
 //-------------------------------------------------------------------------------
 
@@ -206,6 +210,8 @@ class Renderer
 {
 protected:
 	Scene       scene;
+	SceneBVH    sceneBVH;
+	LightTree   lightTree;
 	Camera      camera;
 	RenderImage renderImage;
     PhotonMap* photonMap;
@@ -216,12 +222,15 @@ protected:
 public:
 	Scene &             GetScene      ()       { return scene; }
 	Scene const &       GetScene      () const { return scene; }
+	SceneBVH const &    GetSceneBVH   () const { return sceneBVH; }
+	LightTree const &   GetLightTree  () const { return lightTree; }
 	Camera &            GetCamera     ()       { return camera; }
 	Camera const &      GetCamera     () const { return camera; }
 	RenderImage &       GetRenderImage()       { return renderImage; }
 	RenderImage const & GetRenderImage() const { return renderImage; }
 
 	virtual bool LoadScene( char const *sceneFilename );
+	virtual void UpdateScene();	// Updates the scene bounds and rebuilds the scene BVH and the light tree after node transformations or mesh vertices (see TriObj::UpdateVertices) change. It must not be called while rendering.
 	std::string const & SceneFileName() const { return sceneFile; }
 
 	virtual void BeginRender() {}	// Generates one or more rendering threads and begins rendering. Returns immediately.
@@ -231,6 +240,18 @@ public:
 	virtual bool TraceRay      ( Ray const &ray, HitInfo &hInfo, int hitSide=HIT_FRONT_AND_BACK ) const;
 	virtual bool TraceShadowRay( Ray const &ray, float t_max,    int hitSide=HIT_FRONT_AND_BACK ) const;
 
+	// Packet versions of TraceRay and TraceShadowRay for rays[lane] of the lanes in laneMask (up to rayPacketWidth lanes), which should be coherent.
+	// TraceRayPacket returns the mask of the lanes that hit something closer than their hInfo[lane].z, and TraceShadowRayPacket the mask of the occluded lanes.
+	virtual int TraceRayPacket      ( Ray const *rays, HitInfo *hInfo,       int laneMask ) const;
+	virtual int TraceShadowRayPacket( Ray const *rays, float const *t_max,   int laneMask ) const;
+
+	// Batch versions of TraceRay and TraceShadowRay for count incoherent rays, which set found[i] if rays[i] hits something closer than
+	// hInfo[i].z, or occluded[i] if it is occluded within t_max[i]. Traced together, the rays that reach parts of out-of-core meshes
+	// that are not in memory wait for the rest of the batch instead of paging each part in on their own, and the rays through a large
+	// mesh are interleaved to overlap their cache misses (see SceneBVH::IntersectRays).
+	virtual void TraceRays      ( Ray const *rays, HitInfo *hInfo,       bool *found,    size_t count ) const;
+	virtual void TraceShadowRays( Ray const *rays, float const *t_max,   bool *occluded, size_t count ) const;
+
 	virtual PhotonMap const * GetPhotonMap  () const { return photonMap; }
     virtual void SetPhotonMap(PhotonMap* p) { photonMap = p; }
 	virtual PhotonMap const * GetCausticsMap() const { return causticsMap; }
@@ -61,9 +61,16 @@ typedef ItemList<Texture>  TextureFileList;
 struct Ray
 {
 	Vec3f p, dir;
+	float coneWidth=0, coneSpread=0;	// ray cone of the footprint of the ray, which is 0 for a thin ray (see FootprintWidth)
 
 	Ray() = default;
 	Ray( Vec3f const &_p, Vec3f const &_dir ) : p(_p), dir(_dir) {}
+	Ray( Vec3f const &_p, Vec3f const &_dir, float _coneWidth, float _coneSpread ) : p(_p), dir(_dir), coneWidth(_coneWidth), coneSpread(_coneSpread) {}
+
+	// The width of the footprint at distance t along the ray. With a normalized dir, coneWidth is the width at p and
+	// coneSpread is the spread angle; in general both are scaled by the length of dir, so that the footprint keeps its
+	// size relative to the geometry when the ray is transformed into the coordinates of a (uniformly scaled) node.
+	float FootprintWidth( float t ) const { return (coneWidth + coneSpread*t) * dir.Length(); }
 };
 
 //-------------------------------------------------------------------------------
@@ -87,9 +94,28 @@ struct HitInfo
 	int         mtlID;	// sub-material index
 	bool        front;	// true if the ray hits the front side, false if the ray hits the back side
 	bool        light;	// true if the ray hits a renderable light source
+	Light const *lightSource;	// the light that was hit, if light is true
 
 	HitInfo() { Init(); }
-	void Init() { z=BIGFLOAT; node=nullptr; uvw.Set(0.5f); duvw[0].Zero(); duvw[1].Zero(); mtlID=0; front=true; light=false; }
+	void Init() { z=BIGFLOAT; node=nullptr; uvw.Set(0.5f); duvw[0].Zero(); duvw[1].Zero(); mtlID=0; front=true; light=false; lightSource=nullptr; }
+};
+
+//-------------------------------------------------------------------------------
+
+// The closest hit found so far while a ray is traced. It only keeps what is needed to compute
+// the HitInfo of the final hit afterwards (see Object::SetHitInfo), so that the candidate hits
+// that are later replaced by closer ones do not pay for normals, texture coordinates, and transformations.
+struct RayHit
+{
+	float        z;			// the distance from the ray center to the hit point (the maximum distance before a hit is found)
+	unsigned int primID;	// the primitive of the object that was hit (e.g. the triangle of a mesh)
+	float        u, v;		// barycentric coordinates of the hit point on the primitive
+	unsigned int instance;	// the instance of the scene BVH that was hit
+	bool         front;		// true if the ray hits the front side, false if the ray hits the back side
+	unsigned char lod;		// the level of detail of the mesh that was hit, 0 for the full mesh
+
+	RayHit() { Init(); }
+	void Init() { z=BIGFLOAT; primID=0; u=0; v=0; instance=0; front=true; lod=0; }
 };
 
 //-------------------------------------------------------------------------------
@@ -183,7 +209,7 @@ public:
 	Vec3f NormalTransformFrom( Vec3f const &dir ) const { return itm.GetSubMatrix3().TransposeMult(dir); }
 
 	// Transformations
-	Ray ToNodeCoords( Ray const &ray ) const { return Ray( TransformTo(ray.p), DirectionTransformTo(ray.dir) ); }
+	Ray ToNodeCoords( Ray const &ray ) const { return Ray( TransformTo(ray.p), DirectionTransformTo(ray.dir), ray.coneWidth, ray.coneSpread ); }
 	void FromNodeCoords( HitInfo &hInfo ) const
 	{
 		hInfo.p  = TransformFrom      ( hInfo.p  );
@@ -211,7 +237,23 @@ public:
 class Object : public ItemBase
 {
 public:
-	virtual bool IntersectRay( Ray const &ray, HitInfo &hInfo, int hitSide=HIT_FRONT ) const=0;
+	virtual ~Object() {}	// objects are deleted through ObjFileList
+
+	// Finds the closest hit closer than hit.z and sets hit, without computing the hit information.
+	virtual bool IntersectRayHit( Ray const &ray, RayHit &hit, int hitSide=HIT_FRONT ) const=0;
+
+	// Computes the hit information of a hit found by IntersectRayHit with the same ray.
+	virtual void SetHitInfo( Ray const &ray, RayHit const &hit, HitInfo &hInfo ) const=0;
+
+	// Finds the closest hit and computes its hit information.
+	virtual bool IntersectRay( Ray const &ray, HitInfo &hInfo, int hitSide=HIT_FRONT ) const
+	{
+		RayHit hit;
+		if ( ! IntersectRayHit( ray, hit, hitSide ) ) return false;
+		SetHitInfo( ray, hit, hInfo );
+		return true;
+	}
+
     virtual bool IntersectShadowRay( Ray const &ray, float t_max=BIGFLOAT ) const=0;
 	virtual Box  GetBoundBox() const=0;
 	virtual void ViewportDisplay( Material const *mtl ) const {}	// used for OpenGL display
@@ -270,6 +312,8 @@ public:
     virtual float GetSize() const {}
 
 	// From Object
+	bool IntersectRayHit( Ray const &, RayHit &, int=HIT_FRONT ) const override { return false; }
+	void SetHitInfo( Ray const &, RayHit const &, HitInfo & ) const override {}
 	bool IntersectRay( Ray const &ray, HitInfo &hInfo, int hitSide=HIT_FRONT ) const override { return false; }
 	Box  GetBoundBox() const override { return Box(); }	// empty box
 };
@@ -488,6 +532,7 @@ public:
 	virtual ~ItemList() { DeleteAll(); }
 	void DeleteAll() { for ( T *i : *this ) if (i) delete i; this->clear(); }
 	T* Find( char const *name ) const { for ( T *i : *this ) if ( i && strcmp(name,i->GetName())==0 ) return i; return nullptr; }
+	template <class U> U* Find( char const *name ) const { for ( T *i : *this ) if ( i && strcmp(name,i->GetName())==0 ) if ( U *u = dynamic_cast<U*>(i) ) return u; return nullptr; }	// the item of type U with the given name, since items of different types can share a name
 };
 
 //-------------------------------------------------------------------------------
@@ -0,0 +1,627 @@
+#include "scenebvh.h"
+#include "bvhtraversal.h"
+#include "lights.h"
+
+#include <algorithm>
+#include <bit>
+#include <functional>
+#include <memory>
+
+static_assert(sizeof(SceneBVH::Instance) == 64, "the traversal data of an instance should fit in a cache line");
+
+namespace
+{
+    SceneBVH::ObjectType getObjectType(const Object* obj)
+    {
+        if (dynamic_cast<const TriObj*>(obj) != nullptr) return SceneBVH::ObjectType::Mesh;
+        if (dynamic_cast<const Sphere*>(obj) != nullptr) return SceneBVH::ObjectType::Sphere;
+        if (dynamic_cast<const Plane*>(obj) != nullptr) return SceneBVH::ObjectType::Plane;
+        if (dynamic_cast<const SphereSet*>(obj) != nullptr) return SceneBVH::ObjectType::SphereSet;
+        if (dynamic_cast<const ClusteredMesh*>(obj) != nullptr) return SceneBVH::ObjectType::ClusteredMesh;
+        if (dynamic_cast<const PointLight*>(obj) != nullptr) return SceneBVH::ObjectType::Light;
+        return SceneBVH::ObjectType::Other;
+    }
+
+    // The qualified calls go straight to the implementation of the type instead of through the vtable
+    bool intersectObject(const SceneBVH::Instance& instance, const Ray& ray, RayHit& hit, int hitSide)
+    {
+        switch (instance.type)
+        {
+        case SceneBVH::ObjectType::Sphere:    return static_cast<const Sphere*>(instance.obj)->Sphere::IntersectRayHit(ray, hit, hitSide);
+        case SceneBVH::ObjectType::Plane:     return static_cast<const Plane*>(instance.obj)->Plane::IntersectRayHit(ray, hit, hitSide);
+        case SceneBVH::ObjectType::Mesh:      return static_cast<const TriObj*>(instance.obj)->TriObj::IntersectRayHit(ray, hit, hitSide);
+        case SceneBVH::ObjectType::SphereSet: return static_cast<const SphereSet*>(instance.obj)->SphereSet::IntersectRayHit(ray, hit, hitSide);
+        case SceneBVH::ObjectType::ClusteredMesh: return static_cast<const ClusteredMesh*>(instance.obj)->ClusteredMesh::IntersectRayHit(ray, hit, hitSide);
+        case SceneBVH::ObjectType::Light:     return static_cast<const PointLight*>(instance.obj)->PointLight::IntersectRayHit(ray, hit, HIT_FRONT);
+        default:                              return instance.obj->IntersectRayHit(ray, hit, hitSide);
+        }
+    }
+
+    bool intersectObjectShadow(const SceneBVH::Instance& instance, const Ray& ray, float t_max)
+    {
+        switch (instance.type)
+        {
+        case SceneBVH::ObjectType::Sphere:    return static_cast<const Sphere*>(instance.obj)->Sphere::IntersectShadowRay(ray, t_max);
+        case SceneBVH::ObjectType::Plane:     return static_cast<const Plane*>(instance.obj)->Plane::IntersectShadowRay(ray, t_max);
+        case SceneBVH::ObjectType::Mesh:      return static_cast<const TriObj*>(instance.obj)->TriObj::IntersectShadowRay(ray, t_max);
+        case SceneBVH::ObjectType::SphereSet: return static_cast<const SphereSet*>(instance.obj)->SphereSet::IntersectShadowRay(ray, t_max);
+        case SceneBVH::ObjectType::ClusteredMesh: return static_cast<const ClusteredMesh*>(instance.obj)->ClusteredMesh::IntersectShadowRay(ray, t_max);
+        case SceneBVH::ObjectType::Light:     return false;
+        default:                              return instance.obj->IntersectShadowRay(ray, t_max);
+        }
+    }
+
+    void setObjectHitInfo(const SceneBVH::Instance& instance, const Ray& ray, const RayHit& hit, HitInfo& hitInfo)
+    {
+        switch (instance.type)
+        {
+        case SceneBVH::ObjectType::Sphere:    static_cast<const Sphere*>(instance.obj)->Sphere::SetHitInfo(ray, hit, hitInfo); break;
+        case SceneBVH::ObjectType::Plane:     static_cast<const Plane*>(instance.obj)->Plane::SetHitInfo(ray, hit, hitInfo); break;
+        case SceneBVH::ObjectType::Mesh:      static_cast<const TriObj*>(instance.obj)->TriObj::SetHitInfo(ray, hit, hitInfo); break;
+        case SceneBVH::ObjectType::SphereSet: static_cast<const SphereSet*>(instance.obj)->SphereSet::SetHitInfo(ray, hit, hitInfo); break;
+        case SceneBVH::ObjectType::ClusteredMesh: static_cast<const ClusteredMesh*>(instance.obj)->ClusteredMesh::SetHitInfo(ray, hit, hitInfo); break;
+        case SceneBVH::ObjectType::Light:     static_cast<const PointLight*>(instance.obj)->PointLight::SetHitInfo(ray, hit, hitInfo); break;
+        default:                              instance.obj->SetHitInfo(ray, hit, hitInfo); break;
+        }
+    }
+}
+
+void SceneBVH::BuildFromScene(const ::Node& rootNode, const LightList& lights)
+{
+    instances.clear();
+    instanceData.clear();
+    bakedMeshes.clear();
+    Matrix34f identity;
+    identity.SetIdentity();
+    addInstances(rootNode, identity);
+
+    // Lights are placed in world space
+    for (const Light* light : lights)
+    {
+        if (!light->IsRenderable()) continue;
+
+        Instance instance{};
+        instance.obj = light;
+        instance.type = getObjectType(light);
+        instance.worldSpace = true;
+        InstanceData data{};
+        data.worldBox = light->GetBoundBox();
+        instances.push_back(instance);
+        instanceData.push_back(data);
+    }
+
+    hasClusteredMeshes = std::any_of(instances.begin(), instances.end(), [](const Instance& instance) { return instance.type == ObjectType::ClusteredMesh; });
+    SetSplitMethod(SPLIT_SAH);
+    Build(static_cast<unsigned int>(instances.size()), 2);
+}
+
+void SceneBVH::addInstances(const ::Node& node, const Matrix34f& parentToWorld)
+{
+    const Matrix34f nodeToWorld{ parentToWorld * node.GetTransform() };
+
+    const Object* const obj{ node.GetNodeObj() };
+    if (obj != nullptr)
+    {
+        const ::Box objBox{ obj->GetBoundBox() };
+        if (!objBox.IsEmpty())
+        {
+            Instance instance{};
+            InstanceData data{};
+            data.node = &node;
+            instance.obj = obj;
+            instance.type = getObjectType(obj);
+            instance.worldSpace = nodeToWorld.IsIdentity();
+
+            const TriObj* const mesh{ instance.type == ObjectType::Mesh ? static_cast<const TriObj*>(obj) : nullptr };
+            if (!instance.worldSpace && mesh != nullptr && mesh->NF() <= maxBakedMeshFaces)
+            {
+                Transformation meshToWorld{};
+                meshToWorld.Transform(nodeToWorld);
+                bakedMeshes.emplace_back().InitTransformed(*mesh, meshToWorld);
+                instance.obj = &bakedMeshes.back();
+                instance.worldSpace = true;
+            }
+
+            instance.interleaved = instance.type == ObjectType::Mesh && static_cast<const TriObj*>(instance.obj)->NF() >= minInterleavedMeshFaces;
+
+            if (instance.worldSpace)
+                data.worldBox = instance.obj->GetBoundBox();
+            else
+            {
+                data.transform.Transform(nodeToWorld);
+                instance.worldToObject = data.transform.GetInverseTransform();
+                for (int i{ 0 }; i < 8; ++i)
+                    data.worldBox += data.transform.TransformFrom(objBox.Corner(i));
+            }
+
+            instances.push_back(instance);
+            instanceData.push_back(data);
+        }
+    }
+
+    for (int i{ 0 }; i < node.GetNumChild(); ++i)
+        addInstances(*node.GetChild(i), nodeToWorld);
+}
+
+void SceneBVH::GetElementBounds(unsigned int i, float box[6]) const
+{
+    const ::Box& worldBox{ instanceData[i].worldBox };
+    box[0] = worldBox.pmin.x; box[1] = worldBox.pmin.y; box[2] = worldBox.pmin.z;
+    box[3] = worldBox.pmax.x; box[4] = worldBox.pmax.y; box[5] = worldBox.pmax.z;
+}
+
+float SceneBVH::GetElementCenter(unsigned int i, int dimension) const
+{
+    return 0.5f * (instanceData[i].worldBox.pmin[dimension] + instanceData[i].worldBox.pmax[dimension]);
+}
+
+bool SceneBVH::IntersectRay(const Ray& ray, HitInfo& hitInfo, int hitSide) const
+{
+    RayHit closest{};
+    closest.z = hitInfo.z;
+    if (!IntersectRayHit(ray, closest, hitSide))
+        return false;
+
+    SetHitInfo(ray, closest, hitInfo);
+    return true;
+}
+
+bool SceneBVH::IntersectRayHit(const Ray& ray, RayHit& hit, int hitSide) const
+{
+    // The transformations are affine, so the distance along the ray is the same in every instance and
+    // the closest hit so far bounds the search in the instances visited later
+    bool found{ false };
+    const auto intersectLeaf = [&](unsigned int leafID)
+    {
+        const unsigned int* elements{ GetNodeElements(leafID) };
+        for (unsigned int i{ 0 }; i < GetNodeElementCount(leafID); ++i)
+        {
+            const Instance& instance{ instances[elements[i]] };
+            if (!intersectObject(instance, instance.ToObject(ray), hit, hitSide))
+                continue;
+
+            hit.instance = elements[i];
+            found = true;
+        }
+        return false;
+    };
+
+    TraverseBVH<false>(*this, TraversalRay{ ray }, hit.z, intersectLeaf);
+    return found;
+}
+
+void SceneBVH::SetHitInfo(const Ray& ray, const RayHit& hit, HitInfo& hitInfo) const
+{
+    const Instance& instance{ instances[hit.instance] };
+    const InstanceData& data{ instanceData[hit.instance] };
+    hitInfo.Init();
+    setObjectHitInfo(instance, instance.ToObject(ray), hit, hitInfo);
+    if (!instance.worldSpace)
+        data.transform.FromNodeCoords(hitInfo);
+    hitInfo.node = data.node;
+}
+
+bool SceneBVH::IntersectShadowRay(const Ray& ray, float t_max) const
+{
+    const auto intersectLeaf = [&](unsigned int leafID)
+    {
+        const unsigned int* elements{ GetNodeElements(leafID) };
+        for (unsigned int i{ 0 }; i < GetNodeElementCount(leafID); ++i)
+        {
+            const Instance& instance{ instances[elements[i]] };
+            if (intersectObjectShadow(instance, instance.ToObject(ray), t_max))
+                return true;
+        }
+        return false;
+    };
+
+    return TraverseBVH<true>(*this, TraversalRay{ ray }, t_max, intersectLeaf);
+}
+
+int SceneBVH::IntersectPacket(RayPacket<rayPacketWidth>& packet, int laneMask, HitInfo* hitInfo, int hitSide) const
+{
+    RayHit closest[rayPacketWidth];
+    for (int lane{ 0 }; lane < rayPacketWidth; ++lane)
+        closest[lane].z = packet.tMax[lane];
+
+    const int hitMask{ IntersectPacketHit(packet, laneMask, closest, hitSide) };
+    for (int mask{ hitMask }; mask != 0; mask &= mask - 1)
+    {
+        const int lane{ std::countr_zero(static_cast<unsigned int>(mask)) };
+        SetHitInfo(packet.GetRay(lane), closest[lane], hitInfo[lane]);
+    }
+    return hitMask;
+}
+
+int SceneBVH::IntersectPacketHit(RayPacket<rayPacketWidth>& packet, int laneMask, RayHit* hit, int hitSide) const
+{
+    return TraversePacketBVH<false>(*this, packet, laneMask, [&](unsigned int leafID, int leafMask)
+    {
+        int leafHitMask{ 0 };
+        const unsigned int* elements{ GetNodeElements(leafID) };
+        for (unsigned int i{ 0 }; i < GetNodeElementCount(leafID); ++i)
+        {
+            const Instance& instance{ instances[elements[i]] };
+            float worldBounds[6];
+            GetElementBounds(elements[i], worldBounds);
+            const int instanceMask{ IntersectPacketBVHNode(packet, worldBounds, leafMask) };
+            if (instanceMask == 0)
+                continue;
+
+            RayPacket<rayPacketWidth> localPacket{};
+            if (!instance.worldSpace)
+            {
+                for (int mask{ instanceMask }; mask != 0; mask &= mask - 1)
+                {
+                    const int lane{ std::countr_zero(static_cast<unsigned int>(mask)) };
+                    localPacket.Set(lane, instance.ToObject(packet.GetRay(lane)), packet.tMax[lane]);
+                }
+            }
+            RayPacket<rayPacketWidth>& instancePacket{ instance.worldSpace ? packet : localPacket };
+
+            int instanceHitMask{ 0 };
+            if (instance.type == ObjectType::Mesh)
+                instanceHitMask = static_cast<const TriObj*>(instance.obj)->IntersectPacket(instancePacket, instanceMask, hit, hitSide);
+            else
+            {
+                for (int mask{ instanceMask }; mask != 0; mask &= mask - 1)
+                {
+                    const int lane{ std::countr_zero(static_cast<unsigned int>(mask)) };
+                    if (intersectObject(instance, instancePacket.GetRay(lane), hit[lane], hitSide))
+                        instanceHitMask |= 1 << lane;
+                }
+            }
+
+            for (int mask{ instanceHitMask }; mask != 0; mask &= mask - 1)
+            {
+                const int lane{ std::countr_zero(static_cast<unsigned int>(mask)) };
+                hit[lane].instance = elements[i];
+                packet.tMax[lane] = hit[lane].z;
+            }
+            leafHitMask |= instanceHitMask;
+        }
+        return leafHitMask;
+    });
+}
+
+int SceneBVH::IntersectShadowPacket(const RayPacket<rayPacketWidth>& packet, int laneMask) const
+{
+    return TraversePacketBVH<true>(*this, packet, laneMask, [&](unsigned int leafID, int leafMask)
+    {
+        int leafHitMask{ 0 };
+        const unsigned int* elements{ GetNodeElements(leafID) };
+        for (unsigned int i{ 0 }; i < GetNodeElementCount(leafID) && leafMask != 0; ++i)
+        {
+            const Instance& instance{ instances[elements[i]] };
+            float worldBounds[6];
+            GetElementBounds(elements[i], worldBounds);
+            const int instanceMask{ IntersectPacketBVHNode(packet, worldBounds, leafMask) };
+            if (instanceMask == 0)
+                continue;
+
+            RayPacket<rayPacketWidth> localPacket{};
+            if (!instance.worldSpace)
+            {
+                for (int mask{ instanceMask }; mask != 0; mask &= mask - 1)
+                {
+                    const int lane{ std::countr_zero(static_cast<unsigned int>(mask)) };
+                    localPacket.Set(lane, instance.ToObject(packet.GetRay(lane)), packet.tMax[lane]);
+                }
+            }
+            const RayPacket<rayPacketWidth>& instancePacket{ instance.worldSpace ? packet : localPacket };
+
+            int instanceHitMask{ 0 };
+            if (instance.type == ObjectType::Mesh)
+                instanceHitMask = static_cast<const TriObj*>(instance.obj)->IntersectShadowPacket(instancePacket, instanceMask);
+            else
+            {
+                for (int mask{ instanceMask }; mask != 0; mask &= mask - 1)
+                {
+                    const int lane{ std::countr_zero(static_cast<unsigned int>(mask)) };
+                    if (intersectObjectShadow(instance, instancePacket.GetRay(lane), instancePacket.tMax[lane]))
+                        instanceHitMask |= 1 << lane;
+                }
+            }
+
+            leafHitMask |= instanceHitMask;
+            leafMask &= ~instanceHitMask;
+        }
+        return leafHitMask;
+    });
+}
+
+bool SceneBVH::intersectRayDeferred(const Ray& ray, RayHit& hit, int hitSide, unsigned int rayIndex, std::vector<DeferredRay>& deferred, std::vector<MeshRay>& meshRays) const
+{
+    thread_local std::vector<unsigned int> clusters;
+    bool found{ false };
+    const auto intersectLeaf = [&](unsigned int leafID)
+    {
+        const unsigned int* elements{ GetNodeElements(leafID) };
+        for (unsigned int i{ 0 }; i < GetNodeElementCount(leafID); ++i)
+        {
+            const Instance& instance{ instances[elements[i]] };
+            if (instance.interleaved)
+            {
+                meshRays.push_back({ elements[i], rayIndex });
+                continue;
+            }
+
+            bool instanceHit;
+            if (instance.type == ObjectType::ClusteredMesh)
+            {
+                const ClusteredMesh* const mesh{ static_cast<const ClusteredMesh*>(instance.obj) };
+                clusters.clear();
+                instanceHit = mesh->IntersectResident(instance.ToObject(ray), hit, hitSide, clusters);
+                for (unsigned int cluster : clusters)
+                    deferred.push_back({ mesh, cluster, elements[i], rayIndex });
+            }
+            else
+                instanceHit = intersectObject(instance, instance.ToObject(ray), hit, hitSide);
+            if (!instanceHit)
+                continue;
+
+            hit.instance = elements[i];
+            found = true;
+        }
+        return false;
+    };
+
+    TraverseBVH<false>(*this, TraversalRay{ ray }, hit.z, intersectLeaf);
+    return found;
+}
+
+bool SceneBVH::intersectShadowRayDeferred(const Ray& ray, float t_max, unsigned int rayIndex, std::vector<DeferredRay>& deferred, std::vector<MeshRay>& meshRays) const
+{
+    thread_local std::vector<unsigned int> clusters;
+    const auto intersectLeaf = [&](unsigned int leafID)
+    {
+        const unsigned int* elements{ GetNodeElements(leafID) };
+        for (unsigned int i{ 0 }; i < GetNodeElementCount(leafID); ++i)
+        {
+            const Instance& instance{ instances[elements[i]] };
+            if (instance.interleaved)
+                meshRays.push_back({ elements[i], rayIndex });
+            else if (instance.type == ObjectType::ClusteredMesh)
+            {
+                const ClusteredMesh* const mesh{ static_cast<const ClusteredMesh*>(instance.obj) };
+                clusters.clear();
+                if (mesh->IntersectResidentShadow(instance.ToObject(ray), t_max, clusters))
+                    return true;
+                for (unsigned int cluster : clusters)
+                    deferred.push_back({ mesh, cluster, elements[i], rayIndex });
+            }
+            else if (intersectObjectShadow(instance, instance.ToObject(ray), t_max))
+                return true;
+        }
+        return false;
+    };
+
+    return TraverseBVH<true>(*this, TraversalRay{ ray }, t_max, intersectLeaf);
+}
+
+void SceneBVH::intersectMeshRays(const Ray* rays, RayHit* hits, bool* found, std::vector<MeshRay>& meshRays, int hitSide) const
+{
+    thread_local std::vector<Ray> localRays;
+    thread_local std::vector<RayHit> localHits;
+    thread_local std::unique_ptr<bool[]> localFound;
+    thread_local size_t localCapacity{ 0 };
+
+    // Each mesh traces all of its rays at once, bounded by the hits found so far
+    std::sort(meshRays.begin(), meshRays.end());
+    for (size_t first{ 0 }, last{ 0 }; first < meshRays.size(); first = last)
+    {
+        const unsigned int instanceID{ meshRays[first].instance };
+        const Instance& instance{ instances[instanceID] };
+        for (last = first; last < meshRays.size() && meshRays[last].instance == instanceID; ++last) {}
+
+        const size_t count{ last - first };
+        if (count > localCapacity)
+        {
+            localCapacity = count;
+            localFound = std::make_unique<bool[]>(count);
+        }
+        localRays.resize(count);
+        localHits.resize(count);
+        for (size_t k{ 0 }; k < count; ++k)
+        {
+            localRays[k] = instance.ToObject(rays[meshRays[first + k].ray]);
+            localHits[k] = hits[meshRays[first + k].ray];
+        }
+
+        static_cast<const TriObj*>(instance.obj)->IntersectRays(localRays.data(), localHits.data(), localFound.get(), count, hitSide);
+        for (size_t k{ 0 }; k < count; ++k)
+        {
+            if (!localFound[k]) continue;
+            const unsigned int ray{ meshRays[first + k].ray };
+            hits[ray] = localHits[k];
+            hits[ray].instance = instanceID;
+            found[ray] = true;
+        }
+    }
+}
+
+void SceneBVH::intersectMeshShadowRays(const Ray* rays, const float* t_max, bool* occluded, std::vector<MeshRay>& meshRays) const
+{
+    thread_local std::vector<Ray> localRays;
+    thread_local std::vector<float> localTMax;
+    thread_local std::vector<unsigned int> localIndex;
+    thread_local std::unique_ptr<bool[]> localOccluded;
+    thread_local size_t localCapacity{ 0 };
+
+    // The rays that are already occluded, possibly by another mesh, are left out
+    std::sort(meshRays.begin(), meshRays.end());
+    for (size_t first{ 0 }, last{ 0 }; first < meshRays.size(); first = last)
+    {
+        const unsigned int instanceID{ meshRays[first].instance };
+        const Instance& instance{ instances[instanceID] };
+        localRays.clear();
+        localTMax.clear();
+        localIndex.clear();
+        for (last = first; last < meshRays.size() && meshRays[last].instance == instanceID; ++last)
+        {
+            const unsigned int ray{ meshRays[last].ray };
+            if (occluded[ray]) continue;
+            localRays.push_back(instance.ToObject(rays[ray]));
+            localTMax.push_back(t_max[ray]);
+            localIndex.push_back(ray);
+        }
+
+        const size_t count{ localRays.size() };
+        if (count == 0) continue;
+        if (count > localCapacity)
+        {
+            localCapacity = count;
+            localOccluded = std::make_unique<bool[]>(count);
+        }
+
+        static_cast<const TriObj*>(instance.obj)->IntersectShadowRays(localRays.data(), localTMax.data(), localOccluded.get(), count);
+        for (size_t k{ 0 }; k < count; ++k)
+        {
+            if (localOccluded[k]) occluded[localIndex[k]] = true;
+        }
+    }
+}
+
+void SceneBVH::sortDeferredRays(std::vector<DeferredRay>& deferred)
+{
+    // Counted once per ray, and the rays of a batch are deferred in order
+    unsigned int numRays{ 0 };
+    for (size_t i{ 0 }; i < deferred.size(); ++i)
+        numRays += i == 0 || deferred[i].ray != deferred[i - 1].ray;
+    ClusteredMesh::AddDeferredRays(numRays);
+
+    // Grouped by cluster, so that each cluster is pinned once for all of its rays
+    std::sort(deferred.begin(), deferred.end(), [](const DeferredRay& a, const DeferredRay& b)
+    {
+        if (a.mesh != b.mesh) return std::less<const ClusteredMesh*>{}(a.mesh, b.mesh);
+        if (a.cluster != b.cluster) return a.cluster < b.cluster;
+        return a.ray < b.ray;
+    });
+}
+
+void SceneBVH::IntersectRays(const Ray* rays, HitInfo* hitInfo, bool* found, size_t count, int hitSide) const
+{
+    thread_local std::vector<RayHit> hits;
+    thread_local std::vector<DeferredRay> deferred;
+    thread_local std::vector<MeshRay> meshRays;
+    hits.resize(count);
+    deferred.clear();
+    meshRays.clear();
+
+    for (size_t i{ 0 }; i < count; ++i)
+    {
+        hits[i] = RayHit{};
+        hits[i].z = hitInfo[i].z;
+        found[i] = intersectRayDeferred(rays[i], hits[i], hitSide, static_cast<unsigned int>(i), deferred, meshRays);
+    }
+
+    if (!meshRays.empty())
+        intersectMeshRays(rays, hits.data(), found, meshRays, hitSide);
+
+    if (!deferred.empty())
+    {
+        sortDeferredRays(deferred);
+        for (size_t first{ 0 }, last{ 0 }; first < deferred.size(); first = last)
+        {
+            const ClusteredMesh* const mesh{ deferred[first].mesh };
+            const unsigned int cluster{ deferred[first].cluster };
+            bool pinned{ false };
+            for (last = first; last < deferred.size() && deferred[last].mesh == mesh && deferred[last].cluster == cluster; ++last)
+            {
+                // A closer hit found after the ray was deferred may have culled the cluster
+                const DeferredRay& entry{ deferred[last] };
+                const Ray localRay{ instances[entry.instance].ToObject(rays[entry.ray]) };
+                RayHit& hit{ hits[entry.ray] };
+                if (!mesh->ReachesCluster(cluster, localRay, hit.z))
+                    continue;
+
+                if (!pinned)
+                {
+                    mesh->PinCluster(cluster);
+                    pinned = true;
+                }
+                if (mesh->IntersectCluster(cluster, localRay, hit, hitSide))
+                {
+                    hit.instance = entry.instance;
+                    found[entry.ray] = true;
+                }
+            }
+            if (pinned) mesh->UnpinCluster(cluster);
+        }
+    }
+
+    if (!hasClusteredMeshes)
+    {
+        for (size_t i{ 0 }; i < count; ++i)
+        {
+            if (found[i]) SetHitInfo(rays[i], hits[i], hitInfo[i]);
+        }
+        return;
+    }
+
+    // The hit information of a clustered mesh is read from its cluster too, so the hits are grouped by cluster as well
+    thread_local std::vector<std::pair<uint64_t, unsigned int>> order;
+    order.clear();
+    for (size_t i{ 0 }; i < count; ++i)
+    {
+        if (!found[i]) continue;
+        const bool clustered{ instances[hits[i].instance].type == ObjectType::ClusteredMesh };
+        const uint64_t key{ clustered ? (static_cast<uint64_t>(hits[i].instance) + 1) << 32 | hits[i].primID >> ClusteredMesh::clusterFaceBits : 0 };
+        order.push_back({ key, static_cast<unsigned int>(i) });
+    }
+    std::sort(order.begin(), order.end());
+    for (const auto& [key, i] : order)
+        SetHitInfo(rays[i], hits[i], hitInfo[i]);
+}
+
+void SceneBVH::IntersectShadowRays(const Ray* rays, const float* t_max, bool* occluded, size_t count) const
+{
+    thread_local std::vector<DeferredRay> deferred;
+    thread_local std::vector<MeshRay> meshRays;
+    deferred.clear();
+    meshRays.clear();
+
+    for (size_t i{ 0 }; i < count; ++i)
+    {
+        // The clusters and meshes of a ray that turns out to be occluded anyway are not needed
+        const size_t numDeferred{ deferred.size() };
+        const size_t numMeshRays{ meshRays.size() };
+        occluded[i] = intersectShadowRayDeferred(rays[i], t_max[i], static_cast<unsigned int>(i), deferred, meshRays);
+        if (occluded[i])
+        {
+            deferred.resize(numDeferred);
+            meshRays.resize(numMeshRays);
+        }
+    }
+
+    if (!meshRays.empty())
+        intersectMeshShadowRays(rays, t_max, occluded, meshRays);
+
+    if (deferred.empty()) return;
+
+    sortDeferredRays(deferred);
+    for (size_t first{ 0 }, last{ 0 }; first < deferred.size(); first = last)
+    {
+        const ClusteredMesh* const mesh{ deferred[first].mesh };
+        const unsigned int cluster{ deferred[first].cluster };
+        bool pinned{ false };
+        for (last = first; last < deferred.size() && deferred[last].mesh == mesh && deferred[last].cluster == cluster; ++last)
+        {
+            const DeferredRay& entry{ deferred[last] };
+            if (occluded[entry.ray])
+                continue;
+
+            const Ray localRay{ instances[entry.instance].ToObject(rays[entry.ray]) };
+            if (!mesh->ReachesCluster(cluster, localRay, t_max[entry.ray]))
+                continue;
+
+            if (!pinned)
+            {
+                mesh->PinCluster(cluster);
+                pinned = true;
+            }
+            occluded[entry.ray] = mesh->IntersectClusterShadow(cluster, localRay, t_max[entry.ray]);
+        }
+        if (pinned) mesh->UnpinCluster(cluster);
+    }
+}
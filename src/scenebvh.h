@@ -0,0 +1,128 @@
+#ifndef _SCENEBVH_H_INCLUDED_
+#define _SCENEBVH_H_INCLUDED_
+
+#include "scene.h"
+#include "objects.h"
+#include "raypacket.h"
+
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+// Top-level acceleration structure over the object nodes of the scene.
+// Every node that holds an object becomes one instance with the transformations
+// of its whole node chain composed into a single world transformation, so a ray
+// is transformed once per visited instance instead of once per tree level.
+// Small meshes are baked: the instance gets a copy of the mesh with its vertices
+// in world space, so neither the rays nor the hits are transformed for it at all.
+// Objects keep their own bottom-level structures (e.g. the BVH of TriObj).
+// Renderable lights are instances too, so that a ray finds the light it hits
+// in the same traversal as the surfaces instead of testing every light.
+//
+// This is the compiled, immutable form of the scene that all trace calls use; the
+// node tree is only used for building it, the viewport, and editing. What traversal
+// reads of an instance is packed into one cache line in a contiguous array, and the
+// objects are intersected by switching on their type instead of virtual calls.
+class SceneBVH : public cy::BVH
+{
+public:
+    static constexpr unsigned int maxBakedMeshFaces{ 4096 };   // meshes up to this size are copied for each instance
+    static constexpr unsigned int minInterleavedMeshFaces{ 16384 };   // the batch traversal interleaves the rays of meshes from this size (see IntersectRays)
+
+    // The object types intersected without a virtual call, and Other for the rest. Light is a renderable
+    // PointLight, which is hit from the front only and does not occlude shadow rays.
+    enum class ObjectType : uint8_t { Sphere, Plane, Mesh, SphereSet, ClusteredMesh, Light, Other };
+
+    // The part of an instance that traversal reads
+    struct alignas(64) Instance
+    {
+        Matrix34f worldToObject{};   // unused if worldSpace
+        const Object* obj{ nullptr };
+        ObjectType type{ ObjectType::Other };
+        bool worldSpace{ false };   // obj is in world space (a baked mesh or an identity transform), so rays are not transformed
+        bool interleaved{ false };   // a mesh large enough for the batch traversal to queue its rays for TriObj::IntersectRays
+
+        Ray ToObject(const Ray& ray) const
+        {
+            return worldSpace ? ray : Ray{ worldToObject * ray.p, worldToObject.GetSubMatrix3() * ray.dir, ray.coneWidth, ray.coneSpread };
+        }
+    };
+
+    // The rest, which is only needed for building and for the final hit
+    struct InstanceData
+    {
+        const ::Node* node{ nullptr };   // nullptr for a light
+        Transformation transform{};   // from object space to world space
+        ::Box worldBox{};
+    };
+
+    void BuildFromScene(const ::Node& rootNode, const LightList& lights);
+
+    // Finds the closest hit closer than hitInfo.z and computes its hit information in world space
+    bool IntersectRay(const Ray& ray, HitInfo& hitInfo, int hitSide) const;
+    bool IntersectShadowRay(const Ray& ray, float t_max) const;
+
+    // IntersectRay in two steps: IntersectRayHit finds the closest hit closer than hit.z and records its
+    // instance, and SetHitInfo computes the hit information of the final hit only, once the ray is done
+    bool IntersectRayHit(const Ray& ray, RayHit& hit, int hitSide) const;
+    void SetHitInfo(const Ray& ray, const RayHit& hit, HitInfo& hitInfo) const;
+
+    // Packet versions of the above for the lanes in laneMask, with the maximum distance of each lane in packet.tMax.
+    // IntersectPacket fills hitInfo of the lanes that hit something closer, shortens their tMax, and returns their mask,
+    // and IntersectPacketHit does the same with hit instead; IntersectShadowPacket returns the mask of the occluded lanes.
+    // Objects other than meshes are intersected lane by lane.
+    int IntersectPacket(RayPacket<rayPacketWidth>& packet, int laneMask, HitInfo* hitInfo, int hitSide) const;
+    int IntersectPacketHit(RayPacket<rayPacketWidth>& packet, int laneMask, RayHit* hit, int hitSide) const;
+    int IntersectShadowPacket(const RayPacket<rayPacketWidth>& packet, int laneMask) const;
+
+    // Batch versions of IntersectRay and IntersectShadowRay for count rays, which need not be coherent. IntersectRays sets
+    // found[i] if ray i hits something closer than hitInfo[i].z and then fills hitInfo[i]; IntersectShadowRays sets
+    // occluded[i] if ray i hits something within t_max[i]. Rays that reach clusters of a ClusteredMesh that are not in
+    // memory are deferred until the whole batch has been traversed, and then each of those clusters is paged in once
+    // for all of its rays. Likewise, the rays that reach a large mesh are queued and then traced through it together
+    // with TriObj::IntersectRays, which interleaves them to hide the cache misses of a BVH that does not fit in cache.
+    void IntersectRays(const Ray* rays, HitInfo* hitInfo, bool* found, size_t count, int hitSide) const;
+    void IntersectShadowRays(const Ray* rays, const float* t_max, bool* occluded, size_t count) const;
+    bool HasClusteredMeshes() const { return hasClusteredMeshes; }
+
+    size_t NumInstances() const { return instances.size(); }
+    const Instance& GetInstance(size_t i) const { return instances[i]; }
+    const InstanceData& GetInstanceData(size_t i) const { return instanceData[i]; }
+
+protected:
+    void GetElementBounds(unsigned int i, float box[6]) const override;
+    float GetElementCenter(unsigned int i, int dimension) const override;
+
+private:
+    std::vector<Instance> instances;
+    std::vector<InstanceData> instanceData;
+    std::deque<TriObj> bakedMeshes;   // allocated in chunks, which also keeps their addresses when more are added
+    bool hasClusteredMeshes{ false };
+
+    // A ray of a batch that reaches a cluster that was not in memory during its traversal
+    struct DeferredRay
+    {
+        const ClusteredMesh* mesh;
+        unsigned int cluster;
+        unsigned int instance;
+        unsigned int ray;   // index in the batch
+    };
+
+    // A ray of a batch that reaches an interleaved mesh
+    struct MeshRay
+    {
+        unsigned int instance;
+        unsigned int ray;   // index in the batch
+
+        bool operator<(const MeshRay& other) const { return instance != other.instance ? instance < other.instance : ray < other.ray; }
+    };
+
+    void addInstances(const ::Node& node, const Matrix34f& parentToWorld);
+    bool intersectRayDeferred(const Ray& ray, RayHit& hit, int hitSide, unsigned int rayIndex, std::vector<DeferredRay>& deferred, std::vector<MeshRay>& meshRays) const;
+    bool intersectShadowRayDeferred(const Ray& ray, float t_max, unsigned int rayIndex, std::vector<DeferredRay>& deferred, std::vector<MeshRay>& meshRays) const;
+    void intersectMeshRays(const Ray* rays, RayHit* hits, bool* found, std::vector<MeshRay>& meshRays, int hitSide) const;
+    void intersectMeshShadowRays(const Ray* rays, const float* t_max, bool* occluded, std::vector<MeshRay>& meshRays) const;
+    static void sortDeferredRays(std::vector<DeferredRay>& deferred);
+};
+
+#endif
@@ -0,0 +1,100 @@
+#ifndef _SIMDFLOAT_H_INCLUDED_
+#define _SIMDFLOAT_H_INCLUDED_
+
+#include <immintrin.h>
+#include <cmath>
+
+// Minimal fixed-width float vector for the SIMD kernels of the acceleration
+// structures. Comparisons return all-bits lane masks that combine with & and |,
+// and Mask() packs them into an int with one bit per lane. The generic version
+// loops over the lanes; 4 and 8 lanes map to SSE and AVX registers when available.
+template <int width>
+struct SimdFloat
+{
+    float v[width];
+
+    static SimdFloat Set(float f) { SimdFloat r; for (int i{ 0 }; i < width; ++i) r.v[i] = f; return r; }
+    static SimdFloat Load(const float* p) { SimdFloat r; for (int i{ 0 }; i < width; ++i) r.v[i] = p[i]; return r; }
+    void Store(float* p) const { for (int i{ 0 }; i < width; ++i) p[i] = v[i]; }
+
+    friend SimdFloat operator+(SimdFloat a, SimdFloat b) { for (int i{ 0 }; i < width; ++i) a.v[i] += b.v[i]; return a; }
+    friend SimdFloat operator-(SimdFloat a, SimdFloat b) { for (int i{ 0 }; i < width; ++i) a.v[i] -= b.v[i]; return a; }
+    friend SimdFloat operator*(SimdFloat a, SimdFloat b) { for (int i{ 0 }; i < width; ++i) a.v[i] *= b.v[i]; return a; }
+    friend SimdFloat operator/(SimdFloat a, SimdFloat b) { for (int i{ 0 }; i < width; ++i) a.v[i] /= b.v[i]; return a; }
+    friend SimdFloat Min(SimdFloat a, SimdFloat b) { for (int i{ 0 }; i < width; ++i) a.v[i] = b.v[i] < a.v[i] ? b.v[i] : a.v[i]; return a; }
+    friend SimdFloat Max(SimdFloat a, SimdFloat b) { for (int i{ 0 }; i < width; ++i) a.v[i] = b.v[i] > a.v[i] ? b.v[i] : a.v[i]; return a; }
+    friend SimdFloat Sqrt(SimdFloat a) { for (int i{ 0 }; i < width; ++i) a.v[i] = std::sqrt(a.v[i]); return a; }
+
+    // Lane masks are kept as 0/1 floats in the generic version
+    friend SimdFloat operator<(SimdFloat a, SimdFloat b) { for (int i{ 0 }; i < width; ++i) a.v[i] = a.v[i] < b.v[i]; return a; }
+    friend SimdFloat operator<=(SimdFloat a, SimdFloat b) { for (int i{ 0 }; i < width; ++i) a.v[i] = a.v[i] <= b.v[i]; return a; }
+    friend SimdFloat operator>(SimdFloat a, SimdFloat b) { return b < a; }
+    friend SimdFloat operator>=(SimdFloat a, SimdFloat b) { return b <= a; }
+    friend SimdFloat operator&(SimdFloat a, SimdFloat b) { for (int i{ 0 }; i < width; ++i) a.v[i] = a.v[i] != 0.0f && b.v[i] != 0.0f; return a; }
+    friend SimdFloat operator|(SimdFloat a, SimdFloat b) { for (int i{ 0 }; i < width; ++i) a.v[i] = a.v[i] != 0.0f || b.v[i] != 0.0f; return a; }
+    friend SimdFloat Select(SimdFloat mask, SimdFloat a, SimdFloat b) { for (int i{ 0 }; i < width; ++i) a.v[i] = mask.v[i] != 0.0f ? a.v[i] : b.v[i]; return a; }   // a where mask is set, b elsewhere
+
+    int Mask() const { int m{ 0 }; for (int i{ 0 }; i < width; ++i) m |= (v[i] != 0.0f) << i; return m; }
+};
+
+#ifdef __SSE2__
+template <>
+struct SimdFloat<4>
+{
+    __m128 v;
+
+    static SimdFloat Set(float f) { return { _mm_set1_ps(f) }; }
+    static SimdFloat Load(const float* p) { return { _mm_load_ps(p) }; }
+    void Store(float* p) const { _mm_store_ps(p, v); }
+
+    friend SimdFloat operator+(SimdFloat a, SimdFloat b) { return { _mm_add_ps(a.v, b.v) }; }
+    friend SimdFloat operator-(SimdFloat a, SimdFloat b) { return { _mm_sub_ps(a.v, b.v) }; }
+    friend SimdFloat operator*(SimdFloat a, SimdFloat b) { return { _mm_mul_ps(a.v, b.v) }; }
+    friend SimdFloat operator/(SimdFloat a, SimdFloat b) { return { _mm_div_ps(a.v, b.v) }; }
+    friend SimdFloat Min(SimdFloat a, SimdFloat b) { return { _mm_min_ps(a.v, b.v) }; }
+    friend SimdFloat Max(SimdFloat a, SimdFloat b) { return { _mm_max_ps(a.v, b.v) }; }
+    friend SimdFloat Sqrt(SimdFloat a) { return { _mm_sqrt_ps(a.v) }; }
+
+    friend SimdFloat operator<(SimdFloat a, SimdFloat b) { return { _mm_cmplt_ps(a.v, b.v) }; }
+    friend SimdFloat operator<=(SimdFloat a, SimdFloat b) { return { _mm_cmple_ps(a.v, b.v) }; }
+    friend SimdFloat operator>(SimdFloat a, SimdFloat b) { return { _mm_cmpgt_ps(a.v, b.v) }; }
+    friend SimdFloat operator>=(SimdFloat a, SimdFloat b) { return { _mm_cmpge_ps(a.v, b.v) }; }
+    friend SimdFloat operator&(SimdFloat a, SimdFloat b) { return { _mm_and_ps(a.v, b.v) }; }
+    friend SimdFloat operator|(SimdFloat a, SimdFloat b) { return { _mm_or_ps(a.v, b.v) }; }
+    friend SimdFloat Select(SimdFloat mask, SimdFloat a, SimdFloat b) { return { _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v)) }; }
+
+    int Mask() const { return _mm_movemask_ps(v); }
+};
+#endif
+
+#ifdef __AVX__
+template <>
+struct SimdFloat<8>
+{
+    __m256 v;
+
+    static SimdFloat Set(float f) { return { _mm256_set1_ps(f) }; }
+    static SimdFloat Load(const float* p) { return { _mm256_load_ps(p) }; }
+    void Store(float* p) const { _mm256_store_ps(p, v); }
+
+    friend SimdFloat operator+(SimdFloat a, SimdFloat b) { return { _mm256_add_ps(a.v, b.v) }; }
+    friend SimdFloat operator-(SimdFloat a, SimdFloat b) { return { _mm256_sub_ps(a.v, b.v) }; }
+    friend SimdFloat operator*(SimdFloat a, SimdFloat b) { return { _mm256_mul_ps(a.v, b.v) }; }
+    friend SimdFloat operator/(SimdFloat a, SimdFloat b) { return { _mm256_div_ps(a.v, b.v) }; }
+    friend SimdFloat Min(SimdFloat a, SimdFloat b) { return { _mm256_min_ps(a.v, b.v) }; }
+    friend SimdFloat Max(SimdFloat a, SimdFloat b) { return { _mm256_max_ps(a.v, b.v) }; }
+    friend SimdFloat Sqrt(SimdFloat a) { return { _mm256_sqrt_ps(a.v) }; }
+
+    friend SimdFloat operator<(SimdFloat a, SimdFloat b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ) }; }
+    friend SimdFloat operator<=(SimdFloat a, SimdFloat b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ) }; }
+    friend SimdFloat operator>(SimdFloat a, SimdFloat b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ) }; }
+    friend SimdFloat operator>=(SimdFloat a, SimdFloat b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ) }; }
+    friend SimdFloat operator&(SimdFloat a, SimdFloat b) { return { _mm256_and_ps(a.v, b.v) }; }
+    friend SimdFloat operator|(SimdFloat a, SimdFloat b) { return { _mm256_or_ps(a.v, b.v) }; }
+    friend SimdFloat Select(SimdFloat mask, SimdFloat a, SimdFloat b) { return { _mm256_blendv_ps(b.v, a.v, mask.v) }; }
+
+    int Mask() const { return _mm256_movemask_ps(v); }
+};
+#endif
+
+#endif
@@ -0,0 +1,218 @@
+#ifndef _TRIANGLEBLOCKS_H_INCLUDED_
+#define _TRIANGLEBLOCKS_H_INCLUDED_
+
+#include "cyCore/cyTriMesh.h"
+#include "bvhtraversal.h"
+#include "simdfloat.h"
+
+#include <bit>
+#include <vector>
+
+struct TriangleHit
+{
+    float t{ BIGFLOAT };
+    float det{};
+    float u{};
+    float v{};
+    unsigned int faceID{};
+};
+
+// Möller-Trumbore of one ray, which only accepts hits in (epsilon, tMax]
+inline bool IntersectTriangle(const Ray& ray, const Vec3f& v0, const Vec3f& v1, const Vec3f& v2, int hitSide, float tMax, TriangleHit& hit)
+{
+    constexpr float epsilon{ 1e-6f };   // same as the SIMD kernels
+
+    const Vec3f e1{ v1 - v0 };
+    const Vec3f e2{ v2 - v0 };
+
+    const Vec3f rayCrossE2{ ray.dir ^ e2 };
+    const float det{ e1 % rayCrossE2 };
+
+    if (det > -epsilon && det < epsilon) return false;
+
+    if (hitSide == HIT_FRONT && det < 0.0f) return false;
+    if (hitSide == HIT_BACK && det > 0.0f) return false;
+
+    const float invDet{ 1.0f / det };
+    const Vec3f s{ ray.p - v0 };
+
+    const float u{ invDet * (s % rayCrossE2) };
+    if (u < 0.0f || u > 1.0f) return false;
+
+    const Vec3f sCrossE1{ s ^ e1 };
+    const float v{ invDet * (ray.dir % sCrossE1) };
+    if (v < 0.0f || u + v > 1.0f) return false;
+
+    const float t{ invDet * (e2 % sCrossE1) };
+    if (t <= epsilon || t > tMax) return false;
+
+    hit.t = t;
+    hit.det = det;
+    hit.u = u;
+    hit.v = v;
+    return true;
+}
+
+// Pre-gathered triangles of the leaves of a cy::BVH in SoA blocks of width.
+// Each block keeps the first vertex and the two edges of its triangles, so that
+// a leaf is intersected with one Möller-Trumbore kernel over all lanes without
+// touching the face and vertex arrays of the mesh. Unused lanes hold degenerate
+// triangles, which the determinant test rejects.
+template <int width>
+class TriangleBlocks
+{
+public:
+    static constexpr float epsilon{ 1e-6f };
+
+    struct Block
+    {
+        alignas(32) float v0[3][width];
+        alignas(32) float e1[3][width];
+        alignas(32) float e2[3][width];
+        unsigned int faceID[width];
+    };
+
+    void Build(const cy::BVH& bvh, const cy::TriMesh& mesh)
+    {
+        blocks.clear();
+        leafBlocks.assign(bvh.GetNumNodes() + 2, 0);
+
+        for (unsigned int nodeID{ bvh.GetRootNodeID() }; nodeID <= bvh.GetNumNodes(); ++nodeID)
+        {
+            leafBlocks[nodeID] = static_cast<unsigned int>(blocks.size());
+            if (!bvh.IsLeafNode(nodeID)) continue;
+
+            const unsigned int* elements{ bvh.GetNodeElements(nodeID) };
+            const unsigned int count{ bvh.GetNodeElementCount(nodeID) };
+            for (unsigned int first{ 0 }; first < count; first += width)
+            {
+                Block& block{ blocks.emplace_back() };
+                for (int lane{ 0 }; lane < width; ++lane)
+                {
+                    Vec3f v0{}, e1{}, e2{};
+                    unsigned int faceID{ 0 };
+                    if (first + lane < count)
+                    {
+                        faceID = elements[first + lane];
+                        const cy::TriMesh::TriFace& face{ mesh.F(faceID) };
+                        v0 = mesh.V(face.v[0]);
+                        e1 = mesh.V(face.v[1]) - v0;
+                        e2 = mesh.V(face.v[2]) - v0;
+                    }
+                    for (int axis{ 0 }; axis < 3; ++axis)
+                    {
+                        block.v0[axis][lane] = v0[axis];
+                        block.e1[axis][lane] = e1[axis];
+                        block.e2[axis][lane] = e2[axis];
+                    }
+                    block.faceID[lane] = faceID;
+                }
+            }
+        }
+        leafBlocks[bvh.GetNumNodes() + 1] = static_cast<unsigned int>(blocks.size());
+    }
+
+    size_t NumBlocks() const { return blocks.size(); }
+    size_t MemoryBytes() const { return blocks.size() * sizeof(Block) + leafBlocks.size() * sizeof(unsigned int); }
+
+    // Updates hit if the leaf has a hit closer than hit.t.
+    bool IntersectLeaf(unsigned int leafID, const TraversalRay& ray, int hitSide, TriangleHit& hit) const
+    {
+        bool found{ false };
+        for (unsigned int b{ leafBlocks[leafID] }; b < leafBlocks[leafID + 1]; ++b)
+        {
+            alignas(32) float t[width], det[width], u[width], v[width];
+            int mask{ intersectBlock(blocks[b], ray, hitSide, hit.t, t, det, u, v) };
+            if (mask == 0) continue;
+
+            int best{ std::countr_zero(static_cast<unsigned int>(mask)) };
+            for (mask &= mask - 1; mask != 0; mask &= mask - 1)
+            {
+                const int lane{ std::countr_zero(static_cast<unsigned int>(mask)) };
+                if (t[lane] < t[best]) best = lane;
+            }
+
+            hit.t = t[best];
+            hit.det = det[best];
+            hit.u = u[best];
+            hit.v = v[best];
+            hit.faceID = blocks[b].faceID[best];
+            found = true;
+        }
+        return found;
+    }
+
+    bool IntersectLeafShadow(unsigned int leafID, const TraversalRay& ray, float tMax) const
+    {
+        for (unsigned int b{ leafBlocks[leafID] }; b < leafBlocks[leafID + 1]; ++b)
+        {
+            alignas(32) float t[width], det[width], u[width], v[width];
+            if (intersectBlock(blocks[b], ray, HIT_FRONT_AND_BACK, tMax, t, det, u, v) != 0)
+                return true;
+        }
+        return false;
+    }
+
+    // Fetches the blocks of a leaf into cache ahead of IntersectLeaf
+    void PrefetchLeaf(unsigned int leafID) const
+    {
+        const char* const first{ reinterpret_cast<const char*>(blocks.data() + leafBlocks[leafID]) };
+        const char* const last{ reinterpret_cast<const char*>(blocks.data() + leafBlocks[leafID + 1]) };
+        for (const char* p{ first }; p < last; p += 64)
+            _mm_prefetch(p, _MM_HINT_T0);
+    }
+
+private:
+    std::vector<Block> blocks;
+    std::vector<unsigned int> leafBlocks;   // blocks of leaf node i are [leafBlocks[i], leafBlocks[i+1])
+
+    // Möller-Trumbore on all lanes. Returns the mask of the lanes hit within (epsilon, tMax].
+    static int intersectBlock(const Block& block, const TraversalRay& ray, int hitSide, float tMax,
+                              float* tOut, float* detOut, float* uOut, float* vOut)
+    {
+        using F = SimdFloat<width>;
+
+        const F dx{ F::Set(ray.dir.x) }, dy{ F::Set(ray.dir.y) }, dz{ F::Set(ray.dir.z) };
+        const F e1x{ F::Load(block.e1[0]) }, e1y{ F::Load(block.e1[1]) }, e1z{ F::Load(block.e1[2]) };
+        const F e2x{ F::Load(block.e2[0]) }, e2y{ F::Load(block.e2[1]) }, e2z{ F::Load(block.e2[2]) };
+
+        const F px{ dy * e2z - dz * e2y };
+        const F py{ dz * e2x - dx * e2z };
+        const F pz{ dx * e2y - dy * e2x };
+        const F det{ e1x * px + e1y * py + e1z * pz };
+
+        const F eps{ F::Set(epsilon) };
+        const F negEps{ F::Set(-epsilon) };
+        F mask{ hitSide == HIT_FRONT ? det >= eps : hitSide == HIT_BACK ? det <= negEps : (det >= eps) | (det <= negEps) };
+        if (mask.Mask() == 0) return 0;
+
+        const F invDet{ F::Set(1.0f) / det };
+        const F sx{ F::Set(ray.p.x) - F::Load(block.v0[0]) };
+        const F sy{ F::Set(ray.p.y) - F::Load(block.v0[1]) };
+        const F sz{ F::Set(ray.p.z) - F::Load(block.v0[2]) };
+
+        const F u{ invDet * (sx * px + sy * py + sz * pz) };
+
+        const F qx{ sy * e1z - sz * e1y };
+        const F qy{ sz * e1x - sx * e1z };
+        const F qz{ sx * e1y - sy * e1x };
+        const F v{ invDet * (dx * qx + dy * qy + dz * qz) };
+        const F t{ invDet * (e2x * qx + e2y * qy + e2z * qz) };
+
+        const F zero{ F::Set(0.0f) };
+        const F one{ F::Set(1.0f) };
+        mask = mask & (u >= zero) & (u <= one) & (v >= zero) & (u + v <= one) & (t > eps) & (t <= F::Set(tMax));
+
+        const int hitMask{ mask.Mask() };
+        if (hitMask != 0)
+        {
+            t.Store(tOut);
+            det.Store(detOut);
+            u.Store(uOut);
+            v.Store(vOut);
+        }
+        return hitMask;
+    }
+};
+
+#endif
@@ -854,6 +854,34 @@ void TriObj::ViewportDisplay( Material const *mtl ) const
 	}
 	glEnd();
 }
+void SphereSet::ViewportDisplay( Material const *mtl ) const
+{
+	glBegin(GL_POINTS);
+	for ( Block const &block : blocks ) {
+		for ( int i=0; i<blockWidth; i++ ) {
+			if ( std::isnan(block.center[0][i]) ) continue;
+			glVertex3f( block.center[0][i], block.center[1][i], block.center[2][i] );
+		}
+	}
+	glEnd();
+}
+void ClusteredMesh::ViewportDisplay( Material const *mtl ) const
+{
+	// Only the cluster bounds are in memory, so the clusters are drawn as boxes
+	glBegin(GL_LINES);
+	for ( unsigned int c=0; c<numClusters; c++ ) {
+		Box box = GetClusterBox(c);
+		for ( int i=0; i<8; i++ ) {
+			for ( int axis=1; axis<8; axis<<=1 ) {
+				if ( i & axis ) continue;
+				Vec3f p0 = box.Corner(i), p1 = box.Corner(i|axis);
+				glVertex3fv( &p0.x );
+				glVertex3fv( &p1.x );
+			}
+		}
+	}
+	glEnd();
+}
 void GenLight::SetViewportParam( int lightID, ColorA const &ambient, ColorA const &intensity, Vec4f const &pos ) const
 {
 	glEnable ( GL_LIGHT0 + lightID );
@@ -0,0 +1,352 @@
+#ifndef _WIDEBVH_H_INCLUDED_
+#define _WIDEBVH_H_INCLUDED_
+
+#include "bvhtraversal.h"
+
+#include <immintrin.h>
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <vector>
+
+// Collapsed BVH with width children per node, built from a binary cy::BVH.
+// The child bounds of a node are stored in SoA form, so that all children are
+// tested against a ray at once with a single SSE (width 4) or AVX (width 8) slab
+// test. Leaves are not copied; a leaf child refers to the leaf node of the binary
+// BVH it was built from, so the elements are still accessed through that BVH.
+template <int width>
+class WideBVH
+{
+    static_assert(width == 4 || width == 8, "WideBVH supports 4 and 8 children per node");
+
+public:
+    static constexpr unsigned int leafFlag{ 0x80000000u };
+
+    struct alignas(64) Node   // 128 or 256 bytes, so nodes start at cache lines
+    {
+        float bounds[6][width];               // minX, minY, minZ, maxX, maxY, maxZ of each child
+        unsigned int children[width];         // wide node index, or binary leaf node ID | leafFlag
+        unsigned int childCount;
+    };
+
+    void Build(const cy::BVH& bvh)
+    {
+        nodes.clear();
+        if (bvh.GetNumNodes() == 0) return;
+
+        const unsigned int rootID{ bvh.GetRootNodeID() };
+        if (!bvh.IsLeafNode(rootID))
+        {
+            collapse(bvh, rootID);
+            return;
+        }
+
+        // A single leaf still needs a wide node above it
+        nodes.emplace_back();
+        Node& root{ nodes.back() };
+        setChild(root, 0, bvh.GetNodeBounds(rootID), rootID | leafFlag);
+        root.childCount = 1;
+    }
+
+    bool IsEmpty() const { return nodes.empty(); }
+    size_t NumNodes() const { return nodes.size(); }
+    size_t MemoryBytes() const { return nodes.size() * sizeof(Node); }
+    const Node& GetNode(size_t i) const { return nodes[i]; }
+
+    // Same contract as TraverseBVH: intersectLeaf(binaryLeafID) is called for the leaves
+    // the ray may hit, near to far. It may shorten tMax, which culls the remaining
+    // children, and with anyHit the traversal stops as soon as it returns true.
+    template <bool anyHit, typename LeafFunc>
+    bool Traverse(const TraversalRay& ray, float& tMax, LeafFunc&& intersectLeaf) const;
+
+    // Traverse for count independent rays, interleaved to hide the latency of cache misses. Up to
+    // streams rays are in flight, and the worker switches to the next one after every node: a ray
+    // visits one node or leaf per turn and prefetches the one it visits next, which has arrived in
+    // cache by the time the other rays have had their turns. tMax[i] is the tMax of rays[i], and
+    // intersectLeaf(i, binaryLeafID) has the same contract as in Traverse for ray i. The leaf data
+    // is prefetched with prefetchLeaf(binaryLeafID).
+    template <bool anyHit, int streams, typename LeafFunc, typename PrefetchFunc>
+    void TraverseInterleaved(const TraversalRay* rays, float* tMax, size_t count, LeafFunc&& intersectLeaf, PrefetchFunc&& prefetchLeaf) const;
+
+private:
+    static constexpr int maxStackSize{ 64 * width };
+
+    struct StackEntry
+    {
+        unsigned int child;
+        float tNear;
+    };
+
+    std::vector<Node> nodes;
+
+    static float boxArea(const float* b)
+    {
+        const float dx{ b[3] - b[0] };
+        const float dy{ b[4] - b[1] };
+        const float dz{ b[5] - b[2] };
+        return dx * dy + dy * dz + dz * dx;
+    }
+
+    static void setChild(Node& node, int i, const float* b, unsigned int child)
+    {
+        for (int j{ 0 }; j < 6; ++j)
+            node.bounds[j][i] = b[j];
+        node.children[i] = child;
+    }
+
+    // Pulls up the grandchildren of the largest internal children until the node is full
+    unsigned int collapse(const cy::BVH& bvh, unsigned int binaryID)
+    {
+        unsigned int binaryChildren[width];
+        int count{ 2 };
+        bvh.GetChildNodes(binaryID, binaryChildren[0], binaryChildren[1]);
+
+        while (count < width)
+        {
+            int largest{ -1 };
+            float largestArea{ -1.0f };
+            for (int i{ 0 }; i < count; ++i)
+            {
+                if (bvh.IsLeafNode(binaryChildren[i])) continue;
+                const float area{ boxArea(bvh.GetNodeBounds(binaryChildren[i])) };
+                if (area > largestArea)
+                {
+                    largestArea = area;
+                    largest = i;
+                }
+            }
+            if (largest < 0) break;
+
+            bvh.GetChildNodes(binaryChildren[largest], binaryChildren[largest], binaryChildren[count]);
+            ++count;
+        }
+
+        const unsigned int nodeID{ static_cast<unsigned int>(nodes.size()) };
+        nodes.emplace_back();
+        for (int i{ 0 }; i < width; ++i)
+        {
+            for (int j{ 0 }; j < 6; ++j)
+                nodes[nodeID].bounds[j][i] = 0.0f;
+            nodes[nodeID].children[i] = 0;
+        }
+        nodes[nodeID].childCount = count;
+
+        for (int i{ 0 }; i < count; ++i)
+        {
+            const unsigned int binaryChild{ binaryChildren[i] };
+            const unsigned int child{ bvh.IsLeafNode(binaryChild) ? (binaryChild | leafFlag) : collapse(bvh, binaryChild) };
+            setChild(nodes[nodeID], i, bvh.GetNodeBounds(binaryChild), child);
+        }
+
+        return nodeID;
+    }
+
+    // Slab test of all children at once. Returns a bit mask of the children
+    // that the ray hits within [0, tMax] and writes their entry distances.
+    static int intersectChildren(const Node& node, const TraversalRay& ray, float tMax, float* tNear)
+    {
+        int mask;
+        if constexpr (width == 8)
+        {
+#ifdef __AVX__
+            __m256 tMin8{ _mm256_setzero_ps() };
+            __m256 tMax8{ _mm256_set1_ps(tMax) };
+            for (int axis{ 0 }; axis < 3; ++axis)
+            {
+                const __m256 o{ _mm256_set1_ps(ray.p[axis]) };
+                const __m256 id{ _mm256_set1_ps(ray.invDir[axis]) };
+                const __m256 t0{ _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[axis + 3 * ray.sign[axis]]), o), id) };
+                const __m256 t1{ _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[axis + 3 - 3 * ray.sign[axis]]), o), id) };
+                tMin8 = _mm256_max_ps(tMin8, t0);
+                tMax8 = _mm256_min_ps(tMax8, t1);
+            }
+            _mm256_storeu_ps(tNear, tMin8);
+            mask = _mm256_movemask_ps(_mm256_cmp_ps(tMin8, tMax8, _CMP_LE_OQ));
+#else
+            mask = intersectChildrenScalar(node, ray, tMax, tNear);
+#endif
+        }
+        else
+        {
+#ifdef __SSE2__
+            __m128 tMin4{ _mm_setzero_ps() };
+            __m128 tMax4{ _mm_set1_ps(tMax) };
+            for (int axis{ 0 }; axis < 3; ++axis)
+            {
+                const __m128 o{ _mm_set1_ps(ray.p[axis]) };
+                const __m128 id{ _mm_set1_ps(ray.invDir[axis]) };
+                const __m128 t0{ _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[axis + 3 * ray.sign[axis]]), o), id) };
+                const __m128 t1{ _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[axis + 3 - 3 * ray.sign[axis]]), o), id) };
+                tMin4 = _mm_max_ps(tMin4, t0);
+                tMax4 = _mm_min_ps(tMax4, t1);
+            }
+            _mm_storeu_ps(tNear, tMin4);
+            mask = _mm_movemask_ps(_mm_cmple_ps(tMin4, tMax4));
+#else
+            mask = intersectChildrenScalar(node, ray, tMax, tNear);
+#endif
+        }
+        return mask & ((1 << node.childCount) - 1);
+    }
+
+    // Pushes the children in mask far to near, so that the nearest one is popped first
+    static void pushChildren(const Node& node, int mask, const float* tNear, StackEntry* nodeStack, int& stackSize)
+    {
+        StackEntry hits[width];
+        int hitCount{ 0 };
+        while (mask != 0)
+        {
+            const int i{ std::countr_zero(static_cast<unsigned int>(mask)) };
+            mask &= mask - 1;
+
+            const StackEntry hitEntry{ node.children[i], tNear[i] };
+            int j{ hitCount++ };
+            for (; j > 0 && hits[j - 1].tNear < hitEntry.tNear; --j)
+                hits[j] = hits[j - 1];
+            hits[j] = hitEntry;
+        }
+
+        assert(stackSize + hitCount <= maxStackSize);
+        for (int i{ 0 }; i < hitCount; ++i)
+            nodeStack[stackSize++] = hits[i];
+    }
+
+    void prefetchNode(unsigned int nodeID) const
+    {
+        const char* const node{ reinterpret_cast<const char*>(&nodes[nodeID]) };
+        for (size_t offset{ 0 }; offset < sizeof(Node); offset += 64)
+            _mm_prefetch(node + offset, _MM_HINT_T0);
+    }
+
+    [[maybe_unused]] static int intersectChildrenScalar(const Node& node, const TraversalRay& ray, float tMax, float* tNear)
+    {
+        int mask{ 0 };
+        for (int i{ 0 }; i < width; ++i)
+        {
+            float tMinI{ 0.0f };
+            float tMaxI{ tMax };
+            for (int axis{ 0 }; axis < 3; ++axis)
+            {
+                tMinI = std::max(tMinI, (node.bounds[axis + 3 * ray.sign[axis]][i] - ray.p[axis]) * ray.invDir[axis]);
+                tMaxI = std::min(tMaxI, (node.bounds[axis + 3 - 3 * ray.sign[axis]][i] - ray.p[axis]) * ray.invDir[axis]);
+            }
+            tNear[i] = tMinI;
+            if (tMinI <= tMaxI) mask |= 1 << i;
+        }
+        return mask;
+    }
+};
+
+template <int width>
+template <bool anyHit, typename LeafFunc>
+bool WideBVH<width>::Traverse(const TraversalRay& ray, float& tMax, LeafFunc&& intersectLeaf) const
+{
+    if (nodes.empty()) return false;
+
+    StackEntry nodeStack[maxStackSize];
+    int stackSize{ 0 };
+    nodeStack[stackSize++] = { 0, 0.0f };
+
+    while (stackSize > 0)
+    {
+        const StackEntry entry{ nodeStack[--stackSize] };
+        if (entry.tNear > tMax)
+            continue;
+
+        if (entry.child & leafFlag)
+        {
+            if (intersectLeaf(entry.child & ~leafFlag) && anyHit)
+                return true;
+            continue;
+        }
+
+        const Node& node{ nodes[entry.child] };
+        alignas(32) float tNear[width];
+        const int mask{ intersectChildren(node, ray, tMax, tNear) };
+        if (mask != 0)
+            pushChildren(node, mask, tNear, nodeStack, stackSize);
+    }
+
+    return false;
+}
+
+template <int width>
+template <bool anyHit, int streams, typename LeafFunc, typename PrefetchFunc>
+void WideBVH<width>::TraverseInterleaved(const TraversalRay* rays, float* tMax, size_t count, LeafFunc&& intersectLeaf, PrefetchFunc&& prefetchLeaf) const
+{
+    // The traversal state of a ray in flight, which is all that a switch to another ray needs to keep
+    struct Stream
+    {
+        size_t ray;
+        int stackSize;
+        StackEntry nodeStack[maxStackSize];
+    };
+
+    if (nodes.empty() || count == 0) return;
+
+    Stream stream[streams];
+    int active{ 0 };
+    size_t nextRay{ 0 };
+    const auto start = [&](Stream& s)
+    {
+        s.ray = nextRay++;
+        s.stackSize = 1;
+        s.nodeStack[0] = { 0, 0.0f };
+        prefetchNode(0);
+    };
+    for (; active < streams && nextRay < count; ++active)
+        start(stream[active]);
+
+    // Visits the node or leaf on top of the stack, which was prefetched on the previous turn,
+    // and prefetches the next one. Returns false once the ray is done.
+    const auto step = [&](Stream& s)
+    {
+        const float rayTMax{ tMax[s.ray] };
+        while (s.stackSize > 0 && s.nodeStack[s.stackSize - 1].tNear > rayTMax)
+            --s.stackSize;
+        if (s.stackSize == 0) return false;
+
+        const StackEntry entry{ s.nodeStack[--s.stackSize] };
+        if (entry.child & leafFlag)
+        {
+            if (intersectLeaf(s.ray, entry.child & ~leafFlag) && anyHit)
+                return false;
+        }
+        else
+        {
+            const Node& node{ nodes[entry.child] };
+            alignas(32) float tNear[width];
+            const int mask{ intersectChildren(node, rays[s.ray], rayTMax, tNear) };
+            if (mask != 0)
+                pushChildren(node, mask, tNear, s.nodeStack, s.stackSize);
+        }
+        if (s.stackSize == 0) return false;
+
+        const unsigned int next{ s.nodeStack[s.stackSize - 1].child };
+        if (next & leafFlag)
+            prefetchLeaf(next & ~leafFlag);
+        else
+            prefetchNode(next);
+        return true;
+    };
+
+    // Round robin over the rays in flight, where a finished ray makes room for the next one
+    while (active > 0)
+    {
+        for (int i{ 0 }; i < active;)
+        {
+            if (step(stream[i]))
+                ++i;
+            else if (nextRay < count)
+                start(stream[i++]);
+            else if (i != --active)
+            {
+                stream[i].ray = stream[active].ray;
+                stream[i].stackSize = stream[active].stackSize;
+                std::copy_n(stream[active].nodeStack, stream[active].stackSize, stream[i].nodeStack);
+            }
+        }
+    }
+}
+
+#endif
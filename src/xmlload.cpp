@@ -67,6 +67,8 @@ bool Renderer::LoadScene( char const *filename )
 	}
 
 	scene.Load( Loader(xscene) );
+	sceneBVH.BuildFromScene( scene.rootNode, scene.lights );
+	lightTree.Build( scene.lights );
 	camera.Load( Loader(xcam) );
 	renderImage.Init( camera.imgWidth, camera.imgHeight );
 
@@ -141,11 +143,61 @@ void LoadNode( Loader loader, Node &parent, ObjFileList &objList )
 	if ( type ) {
 		if      ( type == "sphere" ) node->SetNodeObj( &theSphere );
 		else if ( type == "plane"  ) node->SetNodeObj( &thePlane );
+		else if ( type == "obj" && loader.Attribute("outofcore") == "true" ) {
+			ClusteredMesh *cobj = objList.Find<ClusteredMesh>(name);
+			if ( cobj == nullptr ) {	// object is not on the list, so we should load it now
+				ClusteredMesh::Options options;
+				int clusterFaces;
+				if ( loader.ReadInt( clusterFaces, "clusterfaces" ) ) {
+					if ( clusterFaces < 1 || clusterFaces > int(ClusteredMesh::maxClusterFaces) ) printf("WARNING: Cluster size must be between 1 and %u triangles\n", ClusteredMesh::maxClusterFaces);
+					options.clusterFaces = (unsigned int) std::max( clusterFaces, 1 );
+				}
+				float budget;
+				if ( loader.ReadFloat( budget, "budget" ) ) options.residentBudget = size_t( std::max( budget, 0.0f ) * (1<<20) );	// in MB
+				options.clusterDir = loader.Attribute("clusterdir");
+				cobj = new ClusteredMesh;
+				if ( ! cobj->Load( name, options ) ) {
+					printf("ERROR: Cannot load file \"%s.\"", name);
+					delete cobj;
+					cobj = nullptr;
+				} else {
+					cobj->SetName(name);
+					objList.push_back(cobj);	// add to the list
+				}
+			}
+			if ( mtlName==nullptr && cobj && cobj->NumMaterials()>0 ) printf("WARNING: The materials of \"%s\" are not used out of core, so the object has no material\n", name);
+			node->SetNodeObj( cobj );
+		}
 		else if ( type == "obj"    ) {
-			TriObj *tobj = (TriObj*) objList.Find(name);
+			TriObj *tobj = objList.Find<TriObj>(name);
 			if ( tobj == nullptr ) {	// object is not on the list, so we should load it now
+				// BVH build method and width
+				TriObj::BVHOptions bvhOptions;
+				Loader::String bvh = loader.Attribute("bvh");
+				if ( bvh ) {
+					if      ( bvh == "mean" ) bvhOptions.splitMethod = cy::BVH::SPLIT_MEAN;
+					else if ( bvh == "sah"  ) bvhOptions.splitMethod = cy::BVH::SPLIT_SAH;
+					else if ( bvh == "lbvh" ) bvhOptions.splitMethod = cy::BVH::SPLIT_MORTON;
+					else if ( bvh == "sbvh" ) bvhOptions.splitMethod = cy::BVH::SPLIT_SBVH;
+					else printf("WARNING: Unknown BVH method %s, using sah\n", static_cast<char const*>(bvh));
+				}
+				loader.ReadFloat( bvhOptions.spatialSplitBudget, "sbvhbudget" );
+				bvhOptions.quantized = loader.Attribute("bvhnodes") == "quantized";
+				loader.ReadFloat( bvhOptions.rebuildThreshold, "bvhrebuild" );
+				if ( loader.ReadInt( bvhOptions.width, "bvhwidth" ) && bvhOptions.width != 2 && bvhOptions.width != 4 && bvhOptions.width != 8 ) {
+					printf("WARNING: BVH width must be 2, 4, or 8, using 2\n");
+					bvhOptions.width = 2;
+				}
+				if ( loader.ReadInt( bvhOptions.leafBlockWidth, "leafblock" ) && bvhOptions.leafBlockWidth != 1 && bvhOptions.leafBlockWidth != 4 && bvhOptions.leafBlockWidth != 8 ) {
+					printf("WARNING: Leaf block width must be 1, 4, or 8, using 1\n");
+					bvhOptions.leafBlockWidth = 1;
+				}
+				bvhOptions.cacheDir = loader.Attribute("bvhcachedir");
+				bvhOptions.cache = loader.Attribute("bvhcache") == "true" || bvhOptions.cacheDir != nullptr;
+				bvhOptions.lazy = loader.Attribute("bvhlazy") == "true";
+				loader.ReadInt( bvhOptions.lodLevels, "lod" );
 				tobj = new TriObj;
-				if ( ! tobj->Load( name ) ) {
+				if ( ! tobj->Load( name, bvhOptions ) ) {
 					printf("ERROR: Cannot load file \"%s.\"", name);
 					delete tobj;
 					tobj = nullptr;
@@ -156,6 +208,20 @@ void LoadNode( Loader loader, Node &parent, ObjFileList &objList )
 			}
 			if ( mtlName==nullptr && tobj && tobj->NM()>0 ) node->SetMaterial( (Material*)tobj );	// temporarily set the material pointer to the object
 			node->SetNodeObj( tobj );
+		} else if ( type == "spheres" ) {
+			SphereSet *sobj = objList.Find<SphereSet>(name);
+			if ( sobj == nullptr ) {	// particle file is not on the list, so we should load it now
+				sobj = new SphereSet;
+				if ( ! sobj->Load( name ) ) {
+					printf("ERROR: Cannot load file \"%s.\"", name);
+					delete sobj;
+					sobj = nullptr;
+				} else {
+					sobj->SetName(name);
+					objList.push_back(sobj);	// add to the list
+				}
+			}
+			node->SetNodeObj( sobj );
 		} else printf("ERROR: Unknown object type %s\n", static_cast<char const*>(type));
 	}
 